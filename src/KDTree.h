@@ -4,6 +4,7 @@
 #include "helper.h"
 #include "triangle.h"
 #include "hittable_list.h"
+#include "threadpool.h"
 #include <variant>
 
 /*
@@ -22,7 +23,7 @@ struct BoundEdge {
 
     BoundEdge() {}
 
-    BoundEdge(float t, int primNum, bool starting) : t(t), num_prims(num_prims){
+    BoundEdge(float t, int primNum, bool starting) : t(t), num_prims(primNum){
         type = starting ? EdgeType::Start : EdgeType::End;
     }
 };
@@ -45,7 +46,7 @@ struct KD_Node {
     //methods
 
     //method to initialize leaf node
-    void initLeaf(const std::vector<int>& prim_indices, int np, std::vector<int>& tri_indices){
+    void initLeaf(const int* prim_indices, int np, std::vector<int>& tri_indices){
         axis = 3;
         num_prims |= (np << 2);
         if (np == 0){
@@ -61,9 +62,9 @@ struct KD_Node {
     }
 
     //method to initialize interior node
-    void initInterior(float split, int axis, int child_index){
+    void initInterior(float split, int split_axis, int child_index){
         split_pos = split;
-        axis = axis;
+        axis = split_axis;
         above_child |= (child_index << 2);
     }
 
@@ -82,14 +83,455 @@ struct ToDo {
     double tMin, tMax;
 };
 
+/*
+Closest hit traversal over a flattened tree
+Shared by KDTree and anything else that stores the same node layout (e.g. the shared memory scene)
+prim_hit(index, ray, interval, rec) intersects a single primitive
+Children are visited front to back, so traversal stops once the closest hit is in front of the next node
+*/
+
+template <typename PrimHit>
+bool kd_traverse(const KD_Node* nodes, const int* tri_indices, const Bounds& bounds, const Ray& r, interval ray_t, hit_record& rec, const PrimHit& prim_hit){
+    double tMin, tMax;
+    if(!bounds.intersect(r, tMin, tMax)){
+        return false;
+    }
+    tMin = std::max(tMin, ray_t.min);
+    tMax = std::min(tMax, ray_t.max);
+    if (tMin > tMax){
+        return false;
+    }
+
+    vec3 invDir = 1.0 / r.direction();
+    ToDo arr[64];
+    int curr = 0;
+
+    bool hit = false;
+    double closest = ray_t.max;
+    const KD_Node* node = &nodes[0];
+
+    while (node != nullptr){
+        //a hit closer than this node means nothing further along the ray can win
+        if (closest < tMin){
+            break;
+        }
+        if (!node->isLeaf()){
+
+            int axis = node->splitAxis();
+
+            double orig = getCoord(r.origin(), axis);
+            double r_dir = getCoord(point3(r.direction()), axis);
+            double inv_dir = getCoord(invDir, axis);
+            double tPlane = (node->splitPos() - orig) * inv_dir;
+
+            //get children pointers
+            const KD_Node* firstChild, *secondChild;
+            int belowFirst = (orig < node->splitPos()) || (orig == node->splitPos() && r_dir <= 0);
+            if (belowFirst){
+                firstChild = node + 1;
+                secondChild = &nodes[node->aboveChild()];
+            } else {
+                firstChild = &nodes[node->aboveChild()];
+                secondChild = node + 1;
+            }
+
+            if (tPlane > tMax || tPlane <= 0){
+                node = firstChild;
+            } else if (tPlane < tMin){
+                node = secondChild;
+            } else {
+                arr[curr].node = secondChild;
+                arr[curr].tMin = tPlane;
+                arr[curr].tMax = tMax;
+                curr++;
+                node = firstChild;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        int nPrimitives = node->numPrimitives();
+        if (nPrimitives == 1){
+            if (prim_hit(node->one_prim, r, interval(ray_t.min, closest), rec)){
+                hit = true;
+                closest = rec.t;
+            }
+        } else {
+            for (int i = 0; i < nPrimitives; i++){
+                int index = tri_indices[node->index_offset + i];
+                if (prim_hit(index, r, interval(ray_t.min, closest), rec)){
+                    hit = true;
+                    closest = rec.t;
+                }
+            }
+        }
+
+        if (curr > 0){
+            curr--;
+            node = arr[curr].node;
+            tMin = arr[curr].tMin;
+            tMax = arr[curr].tMax;
+        } else{
+            break;
+        }
+    }
+    return hit;
+}
+
+/*
+Any hit traversal (occlusion) over the same node layout
+prim_occluded(index, ray, interval) tests a single primitive
+Returns at the first primitive hit inside ray_t, so children are visited in whatever order is cheapest
+(the one the ray enters first, it needs no extra work) and no hit record is ever written
+*/
+
+template <typename PrimOccluded>
+bool kd_occluded(const KD_Node* nodes, const int* tri_indices, const Bounds& bounds, const Ray& r, interval ray_t, const PrimOccluded& prim_occluded){
+    double tMin, tMax;
+    if(!bounds.intersect(r, tMin, tMax)){
+        return false;
+    }
+    tMin = std::max(tMin, ray_t.min);
+    tMax = std::min(tMax, ray_t.max);
+    if (tMin > tMax){
+        return false;
+    }
+
+    vec3 invDir = 1.0 / r.direction();
+    ToDo arr[64];
+    int curr = 0;
+    const KD_Node* node = &nodes[0];
+
+    while (true){
+        if (!node->isLeaf()){
+            int axis = node->splitAxis();
+            double orig = getCoord(r.origin(), axis);
+            double tPlane = (node->splitPos() - orig) * getCoord(invDir, axis);
+            int belowFirst = (orig < node->splitPos()) || (orig == node->splitPos() && getCoord(r.direction(), axis) <= 0);
+            const KD_Node* firstChild = belowFirst ? node + 1 : &nodes[node->aboveChild()];
+            const KD_Node* secondChild = belowFirst ? &nodes[node->aboveChild()] : node + 1;
+
+            if (tPlane > tMax || tPlane <= 0){
+                node = firstChild;
+            } else if (tPlane < tMin){
+                node = secondChild;
+            } else {
+                arr[curr].node = secondChild;
+                arr[curr].tMin = tPlane;
+                arr[curr].tMax = tMax;
+                curr++;
+                node = firstChild;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        int nPrimitives = node->numPrimitives();
+        for (int i = 0; i < nPrimitives; i++){
+            int index = nPrimitives == 1 ? node->one_prim : tri_indices[node->index_offset + i];
+            if (prim_occluded(index, r, ray_t)){
+                return true;
+            }
+        }
+
+        if (curr == 0){
+            return false;
+        }
+        curr--;
+        node = arr[curr].node;
+        tMin = arr[curr].tMin;
+        tMax = arr[curr].tMax;
+    }
+}
+
+/*
+Packet closest hit traversal (same node layout as kd_traverse)
+
+All lanes walk the tree together, each with its own [tMin, tMax] segment, a lane mask says which lanes are still in the node
+- lanes share direction signs (checked up front), so near/far child is the same for the whole packet
+- a lane drops out of a node once its closest hit is in front of the node
+- interval_culling: bound the split plane distance of the whole packet with interval arithmetic (origin and 1/dir ranges)
+  and skip the per lane work when every lane clearly goes to one side (frustum culling for a kd-tree)
+- packets with mixed direction signs fall back to kd_traverse one lane at a time
+prim_hit is the same callback as kd_traverse
+*/
+
+template <typename PrimHit>
+uint32_t kd_traverse_packet(const KD_Node* nodes, const int* tri_indices, const Bounds& bounds, const RayPacket& packet, uint32_t mask,
+                            double t_min, double* closest, hit_record* recs, const PrimHit& prim_hit, bool interval_culling = false){
+    constexpr int W = RayPacket::max_size;
+    double lo[W], hi[W];
+
+    //clip every lane to the tree bounds
+    uint32_t active = 0;
+    for (uint32_t m = mask; m; m &= m - 1){
+        int lane = __builtin_ctz(m);
+        double tMin, tMax;
+        if (bounds.intersect(packet.ray(lane), tMin, tMax)){
+            lo[lane] = std::max(tMin, t_min);
+            hi[lane] = std::min(tMax, closest[lane]);
+            if (lo[lane] <= hi[lane]){
+                active |= 1u << lane;
+            }
+        }
+    }
+    if (active == 0){
+        return 0;
+    }
+
+    uint32_t hits = 0;
+    if (!packet.same_octant(active)){
+        for (uint32_t m = active; m; m &= m - 1){
+            int lane = __builtin_ctz(m);
+            if (kd_traverse(nodes, tri_indices, bounds, packet.ray(lane), interval(t_min, closest[lane]), recs[lane], prim_hit)){
+                closest[lane] = recs[lane].t;
+                hits |= 1u << lane;
+            }
+        }
+        return hits;
+    }
+
+    int first = __builtin_ctz(active);
+    bool positive[3];
+    double o_min[3], o_max[3], inv_min[3], inv_max[3];
+    for (int axis = 0; axis < 3; axis++){
+        positive[axis] = !std::signbit(packet.d[axis][first]);
+        o_min[axis] = inv_min[axis] = infinity;
+        o_max[axis] = inv_max[axis] = -infinity;
+        for (uint32_t m = active; m; m &= m - 1){
+            int lane = __builtin_ctz(m);
+            o_min[axis] = std::min(o_min[axis], packet.o[axis][lane]);
+            o_max[axis] = std::max(o_max[axis], packet.o[axis][lane]);
+            inv_min[axis] = std::min(inv_min[axis], packet.inv[axis][lane]);
+            inv_max[axis] = std::max(inv_max[axis], packet.inv[axis][lane]);
+        }
+    }
+
+    struct PacketToDo {
+        const KD_Node* node;
+        uint32_t mask;
+        double lo[W], hi[W];
+    };
+    PacketToDo todo[64];
+    int curr = 0;
+    const KD_Node* node = &nodes[0];
+
+    while (true){
+        //lanes whose closest hit is in front of this node are done with it
+        for (uint32_t m = active; m; m &= m - 1){
+            int lane = __builtin_ctz(m);
+            if (closest[lane] < lo[lane]){
+                active &= ~(1u << lane);
+            }
+        }
+
+        if (active != 0 && !node->isLeaf()){
+            int axis = node->splitAxis();
+            double split = node->splitPos();
+            const KD_Node* nearChild = positive[axis] ? node + 1 : &nodes[node->aboveChild()];
+            const KD_Node* farChild = positive[axis] ? &nodes[node->aboveChild()] : node + 1;
+
+            uint32_t near_mask = 0, far_mask = 0;
+            bool decided = false;
+            if (interval_culling){
+                //range of (split - o) * inv over the packet, NaN/inf ranges fall through to the per lane test
+                double a = split - o_max[axis], b = split - o_min[axis];
+                double c0 = a * inv_min[axis], c1 = a * inv_max[axis], c2 = b * inv_min[axis], c3 = b * inv_max[axis];
+                double plane_min = std::min({c0, c1, c2, c3}), plane_max = std::max({c0, c1, c2, c3});
+                double lo_min = infinity, hi_max = -infinity;
+                for (uint32_t m = active; m; m &= m - 1){
+                    int lane = __builtin_ctz(m);
+                    lo_min = std::min(lo_min, lo[lane]);
+                    hi_max = std::max(hi_max, hi[lane]);
+                }
+                if (plane_max < lo_min){
+                    far_mask = active;
+                    decided = true;
+                } else if (plane_min > hi_max){
+                    near_mask = active;
+                    decided = true;
+                }
+            }
+
+            double tPlane[W];
+            if (!decided){
+                //negated tests so a NaN plane distance (origin on the plane, direction 0) visits both children
+                for (uint32_t m = active; m; m &= m - 1){
+                    int lane = __builtin_ctz(m);
+                    tPlane[lane] = (split - packet.o[axis][lane]) * packet.inv[axis][lane];
+                    if (!(tPlane[lane] < lo[lane])) near_mask |= 1u << lane;
+                    if (!(tPlane[lane] > hi[lane])) far_mask |= 1u << lane;
+                }
+            }
+
+            if (far_mask != 0){
+                PacketToDo& entry = todo[curr++];
+                entry.node = farChild;
+                entry.mask = far_mask;
+                for (uint32_t m = far_mask; m; m &= m - 1){
+                    int lane = __builtin_ctz(m);
+                    entry.lo[lane] = decided ? lo[lane] : std::max(lo[lane], tPlane[lane]);
+                    entry.hi[lane] = hi[lane];
+                }
+            }
+            if (near_mask != 0){
+                if (!decided){
+                    for (uint32_t m = near_mask; m; m &= m - 1){
+                        int lane = __builtin_ctz(m);
+                        hi[lane] = std::min(hi[lane], tPlane[lane]);
+                    }
+                }
+                node = nearChild;
+                active = near_mask;
+                continue;
+            }
+        } else if (active != 0){
+            int nPrimitives = node->numPrimitives();
+            for (int i = 0; i < nPrimitives; i++){
+                int index = nPrimitives == 1 ? node->one_prim : tri_indices[node->index_offset + i];
+                for (uint32_t m = active; m; m &= m - 1){
+                    int lane = __builtin_ctz(m);
+                    if (prim_hit(index, packet.ray(lane), interval(t_min, closest[lane]), recs[lane])){
+                        closest[lane] = recs[lane].t;
+                        hits |= 1u << lane;
+                    }
+                }
+            }
+        }
+
+        if (curr == 0){
+            break;
+        }
+        curr--;
+        node = todo[curr].node;
+        active = todo[curr].mask;
+        for (uint32_t m = active; m; m &= m - 1){
+            int lane = __builtin_ctz(m);
+            lo[lane] = todo[curr].lo[lane];
+            hi[lane] = todo[curr].hi[lane];
+        }
+    }
+    return hits;
+}
+
+/*
+Interleaved closest hit traversal (same node layout and results as kd_traverse)
+
+The lanes of a packet are independent rays (no shared direction signs needed), each one a small state machine
+(current node, segment, ToDo stack). A step visits one node of one ray, prefetches the node that ray needs next
+and moves on to the next ray, so by the time a ray is stepped again its node is (hopefully) in cache:
+with W rays in flight up to W node loads overlap instead of every load stalling its ray
+*/
+
+template <typename PrimHit>
+uint32_t kd_traverse_interleaved(const KD_Node* nodes, const int* tri_indices, const Bounds& bounds, const RayPacket& packet, uint32_t mask,
+                                 double t_min, double* closest, hit_record* recs, const PrimHit& prim_hit){
+    struct RayState {
+        Ray r;
+        vec3 invDir;
+        const KD_Node* node;
+        double tMin, tMax;
+        int curr;
+        ToDo arr[64];
+    };
+    RayState states[RayPacket::max_size];
+
+    uint32_t running = 0;
+    for (uint32_t m = mask; m; m &= m - 1){
+        int lane = __builtin_ctz(m);
+        RayState& state = states[lane];
+        state.r = packet.ray(lane);
+        double tMin, tMax;
+        if (!bounds.intersect(state.r, tMin, tMax)){
+            continue;
+        }
+        state.tMin = std::max(tMin, t_min);
+        state.tMax = std::min(tMax, closest[lane]);
+        if (state.tMin > state.tMax){
+            continue;
+        }
+        state.invDir = 1.0 / state.r.direction();
+        state.node = &nodes[0];
+        state.curr = 0;
+        running |= 1u << lane;
+    }
+
+    uint32_t hits = 0;
+    while (running != 0){
+        for (uint32_t m = running; m; m &= m - 1){
+            int lane = __builtin_ctz(m);
+            RayState& state = states[lane];
+            const KD_Node* node = state.node;
+
+            //a hit in front of this node also beats everything still on the stack
+            if (closest[lane] < state.tMin){
+                running &= ~(1u << lane);
+                continue;
+            }
+
+            if (!node->isLeaf()){
+                int axis = node->splitAxis();
+                double orig = getCoord(state.r.origin(), axis);
+                double tPlane = (node->splitPos() - orig) * getCoord(state.invDir, axis);
+                int belowFirst = (orig < node->splitPos()) || (orig == node->splitPos() && getCoord(state.r.direction(), axis) <= 0);
+                const KD_Node* firstChild = belowFirst ? node + 1 : &nodes[node->aboveChild()];
+                const KD_Node* secondChild = belowFirst ? &nodes[node->aboveChild()] : node + 1;
+
+                if (tPlane > state.tMax || tPlane <= 0){
+                    state.node = firstChild;
+                } else if (tPlane < state.tMin){
+                    state.node = secondChild;
+                } else {
+                    ToDo& entry = state.arr[state.curr++];
+                    entry.node = secondChild;
+                    entry.tMin = tPlane;
+                    entry.tMax = state.tMax;
+                    state.node = firstChild;
+                    state.tMax = tPlane;
+                }
+                __builtin_prefetch(state.node);
+                continue;
+            }
+
+            int nPrimitives = node->numPrimitives();
+            for (int i = 0; i < nPrimitives; i++){
+                int index = nPrimitives == 1 ? node->one_prim : tri_indices[node->index_offset + i];
+                if (prim_hit(index, state.r, interval(t_min, closest[lane]), recs[lane])){
+                    closest[lane] = recs[lane].t;
+                    hits |= 1u << lane;
+                }
+            }
+
+            if (state.curr == 0){
+                running &= ~(1u << lane);
+                continue;
+            }
+            state.curr--;
+            state.node = state.arr[state.curr].node;
+            state.tMin = state.arr[state.curr].tMin;
+            state.tMax = state.arr[state.curr].tMax;
+            __builtin_prefetch(state.node);
+        }
+    }
+    return hits;
+}
+
 /*
 Class for KD tree (acceleration structure)
+Also a hittable, so a tree can be put in a hittable_list (e.g. the camera's world) in place of its triangles
 */
 
-class KDTree {
+class KDTree : public hittable {
 
     public:
 
+        //packet queries use interval culling (see kd_traverse_packet)
+        bool interval_culling = false;
+        //trace packets whose rays point in different directions (bounces) as interleaved rays with prefetching
+        //(kd_traverse_interleaved) instead of one ray after the other, off as it measured slower on the dragon
+        bool interleaved_traversal = false;
+
+
         //constructor
         KDTree(const hittable_list& world, int isectCost = 80, int traversalCost = 1, int maxPrims = 1, int maxDepth = -1) : isectCost(isectCost), traversalCost(traversalCost), maxPrims(maxPrims), world(world){
             allocated_nodes = 0;
@@ -101,11 +543,12 @@ class KDTree {
             }
 
             //store bounding boxes for each primitive
-            std::vector<Bounds> primBounds;
-            primBounds.reserve(primSize);
-            for (const auto& object : world.objects){
-                primBounds.push_back(object->BoundingBox());
-            }
+            std::vector<Bounds> primBounds(primSize, Bounds(point3(0), point3(0)));
+            ThreadPool::global().parallel_for(0, primSize, 4096, [&](int64_t lo, int64_t hi) {
+                for (int64_t i = lo; i < hi; i++){
+                    primBounds[i] = world.objects[i]->BoundingBox();
+                }
+            });
 
             //create an indices vector
             std::vector<int> primNums(primSize);
@@ -123,8 +566,8 @@ class KDTree {
             std::vector<int> prims2((maxDepth+1)*primSize);
 
             
-            buildTree(0, bounds, primBounds, primNums, primSize, maxDepth, edges, prims1, prims2, 0);
-            std::cerr << "Tree built";
+            buildTree(0, bounds, primBounds, primNums.data(), primSize, maxDepth, edges, prims1.data(), prims2.data(), 0);
+            nodes.resize(next_free);
         }
 
 
@@ -136,89 +579,46 @@ class KDTree {
 
         //method to check intersection with the ray
         bool intersect(const Ray& r, hit_record& rec) const {
-            double tMin, tMax;
-            if(!bounds.intersect(r, tMin, tMax)){
-                return false;
-            }
-
-
-            vec3 invDir = 1.0 / r.direction();
-            ToDo arr[64];
-            int curr = 0;
-
-            bool hit = false;
-            const KD_Node* node = &nodes[0];
-
-            while (node != nullptr){
-                if (!node->isLeaf()){
-
-                    int axis = node->splitAxis();
-
-                    double orig = getCoord(r.origin(), axis);
-                    double r_dir = getCoord(point3(r.direction()), axis);
-                    double inv_dir = getCoord(invDir, axis);
-                    float tPlane = (node->splitPos() - orig) * inv_dir;
+            return intersect(r, interval(0, infinity), rec);
+        }
 
-                    //get children pointers
-                    const KD_Node* firstChild, *secondChild;
-                    int belowFirst = (orig < node->splitPos()) || (orig == node->splitPos() && r_dir <= 0);
-                    if (belowFirst){
-                        firstChild = node + 1;
-                        secondChild = &nodes[node->aboveChild()];
-                    } else {
-                        firstChild = &nodes[node->aboveChild()];
-                        secondChild = node + 1;
-                    }
+        bool intersect(const Ray& r, interval ray_t, hit_record& rec) const {
+            return kd_traverse(nodes.data(), tri_indices.data(), bounds, r, ray_t, rec,
+                [this](int prim, const Ray& r, interval ray_t, hit_record& rec) {
+                    return world.objects[prim]->hit(r, ray_t, rec);
+                });
+        }
 
-                    if (tPlane > tMax || tPlane <= 0){
-                        node = firstChild;
-                    } else if (tPlane < tMin){
-                        node = secondChild;
-                    } else {
-                        arr[curr].node = secondChild;
-                        arr[curr].tMin = tPlane;
-                        arr[curr].tMax = tMax;
-                        curr++;
-                        node = firstChild;
-                        tMax = tPlane;
+        bool hit(const Ray& r, interval ray_t, hit_record& rec) const override {
+            return intersect(r, ray_t, rec);
+        }
 
-                    }
-                } else {
-                    int nPrimitives = node->numPrimitives();
-                    if (nPrimitives == 1){
-                        const std::shared_ptr<hittable> &p = world.objects[node->one_prim];
-                        if(p->hit(r, interval(tMin, tMax), rec)){
-                            hit = true;
-                        } else {
-                            for (int i = 0; i < nPrimitives; i++){
-                                hit_record temp_rec;
-                                auto closest = tMax;
-                                int index = tri_indices[node->index_offset + i];
-                                const std::shared_ptr<hittable> &p = world.objects[index];
-                                if(p->hit(r, interval(tMin, closest), temp_rec)){
-                                    hit = true;
-                                    closest = temp_rec.t;
-                                    rec = temp_rec; 
-                                }
-                            }
-                        }
-                    }
-                }
+        bool occluded(const Ray& r, interval ray_t) const override {
+            return kd_occluded(nodes.data(), tri_indices.data(), bounds, r, ray_t,
+                [this](int prim, const Ray& r, interval ray_t) {
+                    return world.objects[prim]->occluded(r, ray_t);
+                });
+        }
 
-                if (curr > 0){
-                    curr--;
-                    node = arr[curr].node;
-                    tMin = arr[curr].tMin;
-                    tMax = arr[curr].tMax;
-                } else{
-                    break;
-                }
+        uint32_t hit_packet(const RayPacket& packet, uint32_t mask, double t_min, double* closest, hit_record* recs) const override {
+            auto prim_hit = [this](int prim, const Ray& r, interval ray_t, hit_record& rec) {
+                return world.objects[prim]->hit(r, ray_t, rec);
+            };
+            if (interleaved_traversal && mask != 0 && !packet.same_octant(mask)){
+                return kd_traverse_interleaved(nodes.data(), tri_indices.data(), bounds, packet, mask, t_min, closest, recs, prim_hit);
             }
-            return hit;
-
+            return kd_traverse_packet(nodes.data(), tri_indices.data(), bounds, packet, mask, t_min, closest, recs, prim_hit, interval_culling);
+        }
 
+        Bounds3f BoundingBox() const override {
+            return bounds;
         }
 
+        //flattened tree, used when the tree is copied somewhere else (e.g. shared memory)
+        const std::vector<KD_Node>& nodeList() const { return nodes; }
+        const std::vector<int>& triIndices() const { return tri_indices; }
+        const Bounds& treeBounds() const { return bounds; }
+
 
     private:
         const int isectCost, traversalCost, maxPrims;
@@ -231,10 +631,10 @@ class KDTree {
         
 
         //method to build the tree
-        void buildTree(int node_offset, const Bounds& node_bounds, const std::vector<Bounds>& allBounds, std::vector<int>& primNums, int num_prims, int depth, std::unique_ptr<BoundEdge[]> edges[3], std::vector<int>& prims0, std::vector<int>& prims1, int badRefines){
+        void buildTree(int node_offset, const Bounds& node_bounds, const std::vector<Bounds>& allBounds, const int* primNums, int num_prims, int depth, std::unique_ptr<BoundEdge[]> edges[3], int* prims0, int* prims1, int badRefines){
             if (next_free == allocated_nodes){
                 int newNum = std::max(allocated_nodes*2, 512);
-                if (nodes.size() < newNum){
+                if (int(nodes.size()) < newNum){
                     nodes.resize(newNum);
                 }
                 allocated_nodes = newNum;
@@ -242,8 +642,9 @@ class KDTree {
             next_free++;
 
             //initialize leaf node
-            if (num_prims < maxPrims || depth == 0){
+            if (num_prims <= maxPrims || depth == 0){
                 nodes[node_offset].initLeaf(primNums, num_prims, tri_indices);
+                return;
             }
 
             //split axis
@@ -341,7 +742,6 @@ class KDTree {
                     prims1[n1++] = edges[bestAxis][i].num_prims;
                 }
             }
-            // std::cerr << n0 << ' ' << n1 << '\n';
             float split = edges[bestAxis][bestOffset].t;
             Bounds bounds0 = node_bounds, bounds1 = node_bounds;
             switch(bestAxis){
@@ -360,13 +760,13 @@ class KDTree {
                 default: throw std::runtime_error("Invalid axis");
             }
 
-            std::vector<int> tail(prims1.begin() + num_prims, prims1.end());
             //recursively build children node
-            buildTree(node_offset + 1, bounds0, allBounds, prims0, n0, depth-1, edges, prims0, tail, badRefines);
+            //prims1 + num_prims keeps the above child's primitives alive while the below child reuses the scratch space
+            buildTree(node_offset + 1, bounds0, allBounds, prims0, n0, depth-1, edges, prims0, prims1 + num_prims, badRefines);
 
             int aboveChild = next_free;
-            nodes[node_offset].initInterior(bestAxis, aboveChild, split);
-            buildTree(aboveChild, bounds1, allBounds, prims1, n1, depth-1, edges, prims0, tail, badRefines);
+            nodes[node_offset].initInterior(split, bestAxis, aboveChild);
+            buildTree(aboveChild, bounds1, allBounds, prims1, n1, depth-1, edges, prims0, prims1 + num_prims, badRefines);
         }
 };
 
@@ -0,0 +1,89 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+AliasTable class
+
+Picks index i with probability weight[i] / sum of weights in constant time (Walker / Vose alias method)
+Every bin holds the probability of keeping its own index and the index it hands the rest to,
+so sampling is one bin lookup and one comparison whatever the number of entries
+
+sample : u uniform in [0, 1) picks the bin (integer part of u * size) and decides between it and its alias (fraction)
+pmf    : probability of index i
+*/
+
+class AliasTable {
+    public:
+        AliasTable() {}
+
+        AliasTable(const std::vector<double>& weights){
+            size_t n = weights.size();
+            bins.resize(n);
+            probabilities.resize(n);
+            double total = 0;
+            for (double w : weights){
+                total += w;
+            }
+            if (n == 0 || total <= 0){
+                bins.clear();
+                probabilities.clear();
+                return;
+            }
+
+            //scaled so an average entry has 1, then small entries are topped up from large ones
+            std::vector<double> scaled(n);
+            std::vector<uint32_t> small, large;
+            for (size_t i = 0; i < n; i++){
+                probabilities[i] = weights[i] / total;
+                scaled[i] = probabilities[i] * n;
+                (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+            }
+            while (!small.empty() && !large.empty()){
+                uint32_t s = small.back(), l = large.back();
+                small.pop_back();
+                bins[s] = Bin{scaled[s], l};
+                scaled[l] -= 1.0 - scaled[s];
+                if (scaled[l] < 1.0){
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            //whatever is left is 1 up to rounding
+            for (uint32_t i : small){
+                bins[i] = Bin{1.0, i};
+            }
+            for (uint32_t i : large){
+                bins[i] = Bin{1.0, i};
+            }
+        }
+
+        bool empty() const { return bins.empty(); }
+        size_t size() const { return bins.size(); }
+
+        uint32_t sample(double u, double& pmf) const {
+            double scaled = u * bins.size();
+            size_t bin = std::min(size_t(scaled), bins.size() - 1);
+            uint32_t i = (scaled - bin) < bins[bin].keep ? uint32_t(bin) : bins[bin].alias;
+            pmf = probabilities[i];
+            return i;
+        }
+
+        double pmf(uint32_t i) const {
+            return probabilities[i];
+        }
+
+    private:
+        struct Bin {
+            double keep;
+            uint32_t alias;
+        };
+
+        std::vector<Bin> bins;
+        std::vector<double> probabilities;
+};
+
+#endif
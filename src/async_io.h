@@ -0,0 +1,595 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+AsyncFile class
+
+Asynchronous positional reads and writes on a file descriptor
+Uses Linux io_uring (raw syscalls, no liburing needed) when the kernel allows it
+Falls back to a couple of pread/pwrite threads when io_uring_setup fails (old kernel, seccomp, etc)
+or the ring cannot do plain reads and writes (IORING_OP_READ / WRITE, kernels before 5.6)
+Operations that do not fit in a full ring wait in a backlog instead of blocking the caller,
+an operation the kernel refuses to take (out of memory, too busy) is done with pread/pwrite on the spot
+One thread at a time waits in the kernel for completions, without the lock, so the others keep queueing meanwhile
+
+Members
+- fd           : file descriptor the operations run on
+- ops          : in-flight operations keyed by ticket (user_data for io_uring)
+- ring         : io_uring state (submission/completion rings mapped from the kernel)
+- backlog      : operations waiting for a free ring entry
+- workers      : fallback pread/pwrite threads (only used when ring_fd < 0)
+
+Methods
+- read         : queue a read into buf, returns a ticket
+- wait         : block until the read for the ticket completes, returns bytes read (or -errno)
+- write        : queue a write, the data is owned by the operation so the caller can drop it straight away
+- flush        : block until every queued write is on its way to the file (completed by the kernel)
+*/
+
+class AsyncFile {
+    private:
+        enum class OpType { Read, Write };
+
+        struct Op {
+            OpType type;
+            char* buf;
+            size_t len;
+            off_t offset;
+            size_t done = 0;
+            std::string owned;
+            bool complete = false;
+            ssize_t result = 0;
+        };
+
+        int fd = -1;
+        bool own_fd = false;
+        uint64_t next_ticket = 1;
+        std::unordered_map<uint64_t, std::unique_ptr<Op>> ops;
+        size_t pending_writes = 0;
+        std::mutex io_mutex;
+        std::condition_variable io_cv;
+
+        //io_uring state
+        int ring_fd = -1;
+        unsigned ring_entries = 0;
+        unsigned in_flight = 0;
+        void* sq_ptr = nullptr;
+        void* cq_ptr = nullptr;
+        size_t sq_size = 0, cq_size = 0;
+        io_uring_sqe* sqes = nullptr;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        io_uring_cqe* cqes = nullptr;
+        std::queue<uint64_t> backlog;
+        bool reaping = false;   //a thread waits in io_uring_enter for completions (io_mutex released)
+
+        //times a submission the kernel is too busy for is retried before it is done with pread/pwrite
+        static constexpr int submit_attempts = 8;
+
+        //fallback state
+        std::vector<std::thread> workers;
+        std::queue<uint64_t> work;
+        bool stop = false;
+
+    public:
+        AsyncFile(const char* path, int flags, mode_t mode = 0644, unsigned queue_depth = 64) : own_fd(true) {
+            fd = ::open(path, flags | O_CLOEXEC, mode);
+            if (fd < 0){
+                throw std::runtime_error(std::string("Could not open ") + path + ": " + std::strerror(errno));
+            }
+            setup(queue_depth);
+        }
+
+        //wrap an existing descriptor (e.g. STDOUT_FILENO), it is not closed on destruction
+        AsyncFile(int existing_fd, unsigned queue_depth = 64) : fd(existing_fd), own_fd(false) {
+            setup(queue_depth);
+        }
+
+        AsyncFile(const AsyncFile&) = delete;
+        AsyncFile& operator=(const AsyncFile&) = delete;
+
+        ~AsyncFile() {
+            flush();
+            if (ring_fd >= 0){
+                //reads nobody waited for still point into caller buffers, let them land first
+                std::unique_lock<std::mutex> lock(io_mutex);
+                while (in_flight > 0){
+                    reap(lock, true);
+                }
+                lock.unlock();
+                munmap(sqes, ring_entries * sizeof(io_uring_sqe));
+                if (cq_ptr != sq_ptr){
+                    munmap(cq_ptr, cq_size);
+                }
+                munmap(sq_ptr, sq_size);
+                ::close(ring_fd);
+            } else {
+                {
+                    std::unique_lock<std::mutex> lock(io_mutex);
+                    stop = true;
+                }
+                io_cv.notify_all();
+                for (auto& worker : workers){
+                    worker.join();
+                }
+            }
+            if (own_fd){
+                ::close(fd);
+            }
+        }
+
+        int descriptor() const { return fd; }
+        bool uses_io_uring() const { return ring_fd >= 0; }
+
+        //queue a read of len bytes at offset into buf (buf must stay alive until wait returns)
+        uint64_t read(void* buf, size_t len, off_t offset){
+            std::unique_lock<std::mutex> lock(io_mutex);
+            auto op = std::make_unique<Op>();
+            op->type = OpType::Read;
+            op->buf = static_cast<char*>(buf);
+            op->len = len;
+            op->offset = offset;
+            return submit(lock, std::move(op));
+        }
+
+        //wait for a read to complete and return the number of bytes read
+        ssize_t wait(uint64_t ticket){
+            std::unique_lock<std::mutex> lock(io_mutex);
+            auto it = ops.find(ticket);
+            if (it == ops.end()){
+                return -EINVAL;
+            }
+            Op* op = it->second.get();
+            while (!op->complete){
+                if (ring_fd >= 0){
+                    reap(lock, true);
+                } else {
+                    io_cv.wait(lock);
+                }
+            }
+            //erased by ticket, operations added while the lock was released may have moved the iterator's bucket
+            ssize_t result = op->result;
+            ops.erase(ticket);
+            return result;
+        }
+
+        //queue a write of data at offset, ownership of the bytes moves into the operation
+        void write(std::string data, off_t offset){
+            if (data.empty()){
+                return;
+            }
+            std::unique_lock<std::mutex> lock(io_mutex);
+            auto op = std::make_unique<Op>();
+            op->type = OpType::Write;
+            op->owned = std::move(data);
+            op->buf = op->owned.data();
+            op->len = op->owned.size();
+            op->offset = offset;
+            pending_writes++;
+            submit(lock, std::move(op));
+        }
+
+        //block until all queued writes have completed
+        void flush(){
+            std::unique_lock<std::mutex> lock(io_mutex);
+            while (pending_writes > 0){
+                if (ring_fd >= 0){
+                    reap(lock, true);
+                } else {
+                    io_cv.wait(lock);
+                }
+            }
+        }
+
+        size_t size() const {
+            struct stat st;
+            if (fstat(fd, &st) != 0){
+                return 0;
+            }
+            return st.st_size;
+        }
+
+    private:
+
+        void setup(unsigned queue_depth){
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            ring_fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+            if (ring_fd >= 0 && supports_read_write() && map_rings(params)){
+                ring_entries = params.sq_entries;
+                return;
+            }
+            if (ring_fd >= 0){
+                ::close(ring_fd);
+                ring_fd = -1;
+            }
+
+            //fallback: a couple of threads doing blocking pread/pwrite
+            for (int i = 0; i < 2; i++){
+                workers.emplace_back([this] { worker_loop(); });
+            }
+        }
+
+        //whether the ring knows IORING_OP_READ and IORING_OP_WRITE (kernels that cannot be probed predate them)
+        bool supports_read_write() const {
+            const unsigned count = 256;
+            std::vector<char> storage(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+            auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+            if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, count) < 0){
+                return false;
+            }
+            auto supported = [&](unsigned op){
+                return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+            };
+            return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+        }
+
+        bool map_rings(const io_uring_params& p){
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap){
+                sq_size = cq_size = std::max(sq_size, cq_size);
+            }
+
+            sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            if (sq_ptr == MAP_FAILED){
+                return false;
+            }
+            cq_ptr = sq_ptr;
+            if (!single_mmap){
+                cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+                if (cq_ptr == MAP_FAILED){
+                    munmap(sq_ptr, sq_size);
+                    return false;
+                }
+            }
+            void* sqe_ptr = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+            if (sqe_ptr == MAP_FAILED){
+                if (cq_ptr != sq_ptr){
+                    munmap(cq_ptr, cq_size);
+                }
+                munmap(sq_ptr, sq_size);
+                return false;
+            }
+            sqes = static_cast<io_uring_sqe*>(sqe_ptr);
+
+            char* sq = static_cast<char*>(sq_ptr);
+            sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+            char* cq = static_cast<char*>(cq_ptr);
+            cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+            return true;
+        }
+
+        //register the operation and hand it to the backend (called with io_mutex held)
+        uint64_t submit(std::unique_lock<std::mutex>& lock, std::unique_ptr<Op> op){
+            uint64_t ticket = next_ticket++;
+            Op* raw = op.get();
+            ops.emplace(ticket, std::move(op));
+            if (ring_fd >= 0){
+                push_sqe(lock, ticket, raw);
+            } else {
+                work.push(ticket);
+                lock.unlock();
+                io_cv.notify_all();
+                lock.lock();
+            }
+            return ticket;
+        }
+
+        //hand an operation to the kernel (called with io_mutex held)
+        //a full ring puts it in the backlog (reap submits it once entries are free) so callers never block on the disk here,
+        //a submission the kernel refuses is taken back out of the ring, retried after some completions if the kernel
+        //was only short of resources, and otherwise done with pread/pwrite so nobody waits for a completion that never comes
+        void push_sqe(std::unique_lock<std::mutex>& lock, uint64_t ticket, Op* op){
+            if (in_flight >= ring_entries){
+                reap(lock, false);
+            }
+            if (in_flight >= ring_entries){
+                backlog.push(ticket);
+                return;
+            }
+
+            for (int attempt = 0; attempt < submit_attempts; attempt++){
+                unsigned tail = *sq_tail;
+                unsigned index = tail & *sq_mask;
+                io_uring_sqe* sqe = &sqes[index];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = (op->type == OpType::Read) ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe->fd = fd;
+                sqe->addr = reinterpret_cast<uint64_t>(op->buf + op->done);
+                sqe->len = op->len - op->done;
+                sqe->off = op->offset + op->done;
+                sqe->user_data = ticket;
+                sq_array[index] = index;
+                __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+                in_flight++;
+
+                int ret;
+                do {
+                    ret = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+                } while (ret < 0 && errno == EINTR);
+                if (ret > 0){
+                    return;
+                }
+
+                //the kernel took nothing (the entry is still the only one past its head), take it back
+                int error = ret < 0 ? errno : EAGAIN;
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                in_flight--;
+                if (error != EAGAIN && error != EBUSY){
+                    break;
+                }
+                //let operations that are already in the kernel complete before trying again
+                if (in_flight > 0){
+                    reap(lock, true);
+                } else {
+                    lock.unlock();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    lock.lock();
+                }
+            }
+            finish(ops.find(ticket), transfer(op));
+        }
+
+        //drain the completion queue (called with io_mutex held), optionally blocking until at least one completion arrives
+        //the blocking wait in the kernel releases io_mutex, and while a thread is in it only that thread takes completions
+        //(so the one it waits for cannot be taken from under it), the others wait on io_cv until it has drained the queue
+        void reap(std::unique_lock<std::mutex>& lock, bool block){
+            if (reaping){
+                if (block){
+                    io_cv.wait(lock);
+                }
+                return;
+            }
+            if (block && in_flight > 0 && __atomic_load_n(cq_head, __ATOMIC_ACQUIRE) == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+                reaping = true;
+                lock.unlock();
+                int ret;
+                do {
+                    ret = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                } while (ret < 0 && errno == EINTR);
+                lock.lock();
+                reaping = false;
+                io_cv.notify_all();
+            }
+
+            unsigned head = __atomic_load_n(cq_head, __ATOMIC_ACQUIRE);
+            std::vector<std::pair<uint64_t, Op*>> resubmit;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+                io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                uint64_t ticket = cqe->user_data;
+                int res = cqe->res;
+                head++;
+                in_flight--;
+
+                auto it = ops.find(ticket);
+                if (it == ops.end()){
+                    continue;
+                }
+                Op* op = it->second.get();
+                if (res > 0 && op->done + res < op->len){
+                    //short transfer, queue the remainder
+                    op->done += res;
+                    resubmit.emplace_back(ticket, op);
+                    continue;
+                }
+                finish(it, res);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            for (auto& [ticket, op] : resubmit){
+                push_sqe(lock, ticket, op);
+            }
+            while (!backlog.empty() && in_flight < ring_entries){
+                uint64_t ticket = backlog.front();
+                backlog.pop();
+                push_sqe(lock, ticket, ops[ticket].get());
+            }
+        }
+
+        void finish(std::unordered_map<uint64_t, std::unique_ptr<Op>>::iterator it, ssize_t res){
+            Op* op = it->second.get();
+            op->result = (res < 0) ? res : ssize_t(op->done + res);
+            op->complete = true;
+            if (op->type == OpType::Write){
+                if (res < 0){
+                    std::cerr << "AsyncFile: write failed: " << std::strerror(-res) << '\n';
+                }
+                pending_writes--;
+                ops.erase(it);
+            }
+            io_cv.notify_all();
+        }
+
+        void worker_loop(){
+            while (true){
+                uint64_t ticket;
+                Op* op;
+                {
+                    std::unique_lock<std::mutex> lock(io_mutex);
+                    io_cv.wait(lock, [this] {
+                        return !work.empty() || stop;
+                    });
+                    if (stop && work.empty()){
+                        return;
+                    }
+                    ticket = work.front();
+                    work.pop();
+                    op = ops[ticket].get();
+                }
+
+                //blocking transfer outside the lock
+                ssize_t res = transfer(op);
+
+                std::unique_lock<std::mutex> lock(io_mutex);
+                auto it = ops.find(ticket);
+                finish(it, res);
+            }
+        }
+
+        //the rest of an operation with blocking pread/pwrite, looping over short reads/writes
+        //returns what finish expects: 0 once done (or at end of file), -errno on failure
+        ssize_t transfer(Op* op){
+            while (op->done < op->len){
+                ssize_t res;
+                if (op->type == OpType::Read){
+                    res = ::pread(fd, op->buf + op->done, op->len - op->done, op->offset + op->done);
+                } else {
+                    res = ::pwrite(fd, op->buf + op->done, op->len - op->done, op->offset + op->done);
+                }
+                if (res < 0 && errno == EINTR){
+                    continue;
+                }
+                if (res < 0){
+                    return -errno;
+                }
+                if (res == 0){
+                    break;
+                }
+                op->done += res;
+            }
+            return 0;
+        }
+};
+
+
+/*
+LineReader class
+
+Replacement for std::getline over an std::ifstream
+Keeps `depth` aligned chunks of the file in flight so the parser never waits on the disk
+Each time a chunk is consumed, a read for the next unread chunk is issued into the same buffer
+
+Members
+- file    : AsyncFile used for the reads
+- chunks  : ring of aligned buffers and their read tickets
+- current : index of the chunk being parsed, pos is the position inside it
+*/
+
+class LineReader {
+    private:
+        struct Chunk {
+            std::unique_ptr<char, decltype(&std::free)> data{nullptr, &std::free};
+            uint64_t ticket = 0;
+            ssize_t length = 0;
+            bool issued = false;
+        };
+
+        //chunks is declared first so the file (and its in-flight reads) goes away before the buffers
+        std::vector<Chunk> chunks;
+        std::unique_ptr<AsyncFile> file;
+        size_t chunk_size;
+        size_t file_size = 0;
+        off_t next_offset = 0;
+        size_t current = 0;
+        size_t pos = 0;
+        bool loaded = false;
+
+    public:
+        static constexpr size_t alignment = 4096;
+
+        LineReader(const char* path, size_t chunk_size = 1 << 20, int depth = 4) : chunk_size((chunk_size + alignment - 1) / alignment * alignment) {
+            try {
+                file = std::make_unique<AsyncFile>(path, O_RDONLY);
+            } catch (const std::runtime_error& e){
+                std::cerr << e.what() << '\n';
+                return;
+            }
+            file_size = file->size();
+            chunks.resize(std::max(depth, 1));
+            for (auto& chunk : chunks){
+                chunk.data.reset(static_cast<char*>(std::aligned_alloc(alignment, this->chunk_size)));
+                issue(chunk);
+            }
+        }
+
+        bool is_open() const { return file != nullptr; }
+
+        //read the next line (without the newline) into line, false once the file is exhausted
+        bool getline(std::string& line){
+            line.clear();
+            if (!file){
+                return false;
+            }
+            bool got_any = false;
+            while (true){
+                Chunk& chunk = chunks[current];
+                if (!loaded){
+                    if (!chunk.issued){
+                        return got_any;
+                    }
+                    chunk.length = file->wait(chunk.ticket);
+                    chunk.issued = false;
+                    if (chunk.length <= 0){
+                        return got_any;
+                    }
+                    loaded = true;
+                    pos = 0;
+                }
+
+                const char* begin = chunk.data.get() + pos;
+                const char* end = chunk.data.get() + chunk.length;
+                const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+                if (newline != nullptr){
+                    line.append(begin, newline);
+                    pos = newline - chunk.data.get() + 1;
+                    if (pos == size_t(chunk.length)){
+                        advance();
+                    }
+                    return true;
+                }
+
+                //line continues in the next chunk
+                line.append(begin, end);
+                got_any = true;
+                advance();
+            }
+        }
+
+    private:
+        void issue(Chunk& chunk){
+            if (size_t(next_offset) >= file_size){
+                return;
+            }
+            chunk.ticket = file->read(chunk.data.get(), chunk_size, next_offset);
+            chunk.issued = true;
+            next_offset += chunk_size;
+        }
+
+        //current chunk fully consumed, reuse its buffer for the next unread part of the file
+        void advance(){
+            issue(chunks[current]);
+            current = (current + 1) % chunks.size();
+            loaded = false;
+        }
+};
+
+#endif
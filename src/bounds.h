@@ -69,7 +69,8 @@ class Bounds {
         }
 };
 
-
+//the name the hittables use
+using Bounds3f = Bounds;
 
 Bounds Union(const Bounds& b1, const Bounds& b2){
     double newMinX = std::min({b1.min.x, b2.min.x});
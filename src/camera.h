@@ -5,6 +5,18 @@
 #include "threadpool.h"
 #include "material.h"
 #include "KDTree.h"
+#include "image_writer.h"
+#include "tiles.h"
+#include "framebuffer.h"
+#include "numa.h"
+#include "sampler.h"
+#include "path_tracer.h"
+#include "wavefront.h"
+#include "restir.h"
+#include "light_tracing.h"
+#include "preview.h"
+#include <array>
+#include <map>
 
 
 using namespace std::chrono;
@@ -15,11 +27,12 @@ Camera class
 Contains all viewport, image related parameters
 Contains methods for intializing all the parameters
 Contains render method (thread pool, normal multithreading, normal)
-Contains ray_colour (method to compute colour given the pixel ray and hittable objects list)
+Contains ray_colour (colour of a camera ray, from the path tracer the camera is (path_tracer.h) or a preview (preview.h))
+The other integrators live next to their data and render through it: restir.h, light_tracing.h, wavefront.h
 */
 
 
-class Camera {
+class Camera : public PathTracer {
     public:
 
         //aspect ratio + image width + samples_per_pixel (antialiasing)
@@ -27,10 +40,50 @@ class Camera {
         int image_width;
         int samples_per_pixel;
         int image_height;
-        int max_depth;
+
+        //resampled direct lighting (restir.h, progressive rendering only): primary hits reuse the light samples of neighbours
+        bool resampled_lighting = false;
+        int resampling_candidates = 8;
+        int resampling_neighbours = 5;
+        int resampling_radius = 10;         //pixels
+        int resampling_history = 20;        //cap on the last pass's candidates, relative to resampling_candidates
+
+        //caustics through glass and mirrors from light_paths light paths per frame (light_tracing.h), plain renders only
+        bool light_tracing = false;
+        int light_paths = 1 << 20;
+
+        //preview integrator for layout checks (preview.h), camera rays only
+        Preview preview = Preview::None;
+        int ao_rays = 16;
+        double ao_distance = 10;
+        double depth_range = 100;           //distance shown as white in Depth
+
+        //square tiles handed to the thread pool, in the order of a space filling curve
+        int tile_size = 16;
+        TileOrder tile_order = TileOrder::Hilbert;
+
+        //progressive rendering: passes of pass_samples (min_samples first) while a pixel's relative error is above error_threshold
+        bool adaptive = false;
+        int min_samples = 8;
+        int pass_samples = 4;
+        double error_threshold = 0.02;
+
+        //wall clock seconds render may take (0 = no limit), implies progressive rendering
+        double time_budget = 0;
+        //absolute end of the time budget instead, e.g. program start + budget (time_point{} = time_budget from render)
+        steady_clock::time_point deadline{};
+
+        //render with the wavefront integrator (wavefront.h), wavefront_batch paths per wave (not for progressive renders)
+        bool wavefront = false;
+        int wavefront_batch = 1 << 16;
+        //sort the secondary rays of every wave (octant + origin Morton code) before tracing them
+        bool sort_rays = false;
+
+        //primary rays of 2x2 or 4x2 pixel blocks traced as one packet (4 or 8, KDTree only), 1 = one ray at a time
+        //the wavefront integrator also hands its extend stage to the world in groups of packet_size rays
+        int packet_size = 1;
 
 
-        
         //function to initialize all the needed parameters
         void initialize() {
 
@@ -61,28 +114,94 @@ class Camera {
         }
 
         // const KDTree& tree
-        void render(const hittable_list& world, std::vector<std::vector<colour>>& image){
+        void render(const hittable_list& world, Framebuffer& image){
+            render(NumaReplicated<hittable_list>::single(world), image);
+        }
+
+        //worlds holds a copy of the scene per NUMA node, every tile is traced against the copy local to its worker
+        void render(const NumaReplicated<hittable_list>& worlds, Framebuffer& image){
+            //every frame streams one image to stdout (redirected to image.ppm by the makefile), header first,
+            //so initialize can run again between frames without writing a second header into the output
+            writer = std::make_unique<ImageWriter>(STDOUT_FILENO, image_width, image_height);
+            //previews do not light the scene, so none of the lighting below is prepared for them
+            bool lighting = preview == Preview::None;
+            bool progressive = adaptive || time_budget > 0;
+            render_start = steady_clock::now();
+            budget_end = deadline != steady_clock::time_point{} ? deadline
+                         : render_start + duration_cast<steady_clock::duration>(duration<double>(time_budget));
+            prepare(worlds.local(), lighting, progressive);
+            //kept from the last frame when the image size is the same (the samples are evaluated again at the new hits)
+            resampler.reset();
+            if (resampled_lighting && lighting && progressive){
+                if (reservoirs == nullptr || reservoirs->width != image_width || reservoirs->height != image_height){
+                    reservoirs = std::make_shared<ReservoirImage>(image_width, image_height);
+                }
+                resampler = std::make_unique<ResampledLighting>(*this, *reservoirs, resampling_candidates, resampling_neighbours,
+                                                                resampling_radius, resampling_history);
+            } else {
+                if (resampled_lighting && lighting){
+                    std::clog << "Resampled lighting reuses reservoirs between progressive passes, set adaptive or time_budget as well (rendering without)\n";
+                }
+                reservoirs.reset();
+            }
+            light_image.reset();
+            if (light_tracing && lighting){
+                if (progressive || photon_mapping || irradiance_caching){
+                    std::clog << "Light tracing splats whole frames and would count the caustics of photons or cached records twice, it needs a plain render without them (rendering without)\n";
+                } else {
+                    light_image = LightTracer(*this, center, pixel00_loc, pixel_delta_u, pixel_delta_v, image_width, image_height)
+                                      .trace(worlds.local(), light_paths);
+                }
+            }
+            light_traced_caustics = light_image != nullptr;
+            previewer = PreviewIntegrator{preview, ao_rays, ao_distance, depth_range};
 
-            //format for ppm file
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            if (progressive){
+                render_progressive(worlds, image);
+                return;
+            }
+            //the wavefront integrator does not leave the caustics to the light paths and has no previews,
+            //tiles are traced one path at a time then
+            if (wavefront && light_image == nullptr && lighting){
+                WavefrontIntegrator(*this, samples_per_pixel, wavefront_batch, sort_rays, packet_size)
+                    .render(worlds, image, [this](int i, int j, Sampler& sampler){ return getRay(i, j, sampler); },
+                            [this, &image](int row){ writer->write_row(row, image); });
+                return;
+            }
 
             #define MT 2
             //multithreaded approach using a threadpool
             #if MT == 2
-                ThreadPool pool(std::thread::hardware_concurrency());
-                for (int j = 0; j < image_height; j++){
-                    //&world
-                    pool.enqueue([=, &image, &world]{
-                        for (int i = 0; i < image_width; i++){
-                            colour pixel_colour(0, 0, 0);
-                            for (int s = 0; s < samples_per_pixel; s++){
-                                Ray r = getRay(i, j);
-                                pixel_colour += ray_colour(r, max_depth, world);
-                            }
-                            image[j][i] = sample_scale * pixel_colour;
-                        }
+                //one task per tile, neighbouring tasks cover neighbouring parts of the image (and the scene)
+                //small tiles also keep one expensive row through the mesh from becoming the last task to finish
+                //the pool is shared and stays alive between renders, so wait on this frame's tasks only
+                ThreadPool& pool = ThreadPool::global();
+                TaskGroup frame;
+                NodeStats stats[max_nodes];
+                std::atomic<uint64_t> merge_ns{0};
+                //tasks only have room for a few captures, so everything shared by the frame goes through one reference
+                FrameContext context{worlds, image, stats, merge_ns};
+                for (const Tile& tile : make_tiles(image_width, image_height, tile_size, tile_order)){
+                    pool.enqueue(frame, [=, &context]{
+                        auto start = steady_clock::now();
+                        context.merge_ns.fetch_add(render_tile(tile, context.worlds.local(), context.image), std::memory_order_relaxed);
+                        auto busy = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+                        NodeStats& node = context.stats[Topology::current_node() % max_nodes];
+                        node.tiles.fetch_add(1, std::memory_order_relaxed);
+                        node.samples.fetch_add(uint64_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samples_per_pixel, std::memory_order_relaxed);
+                        node.busy_ns.fetch_add(busy, std::memory_order_relaxed);
                     });
                 }
+                pool.wait(frame);
+                //one node has nothing to compare with
+                if (Topology::get().num_nodes > 1){
+                    report_nodes(stats);
+                }
+                if (light_image != nullptr){
+                    std::clog << "Light tracing: splats added to the tiles in " << merge_ns.load() * 1e-6 << " thread-ms\n";
+                }
+                report_irradiance_cache();
 
                 
 
@@ -96,13 +215,9 @@ class Camera {
                 for (double i = 0; i < image_width; i++){horizontalIter.push_back(i);}
                 for (double i = 0; i < image_height; i++){verticalIter.push_back(i);}
                 std::for_each(std::execution::par_unseq, verticalIter.begin(), verticalIter.end(), [&](double y) {
+                        auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
                         for (int i = 0; i < image_width; i++){
-                            colour pixel_colour(0, 0, 0);
-                            for (int s = 0; s < samples_per_pixel; s++){
-                                Ray r = getRay(i, y);
-                                pixel_colour += ray_colour(r, world);
-                            }
-                            image[y][i] = sample_scale * pixel_colour;
+                            image(i, y) = render_pixel(i, y, worlds.local(), *sampler);
                         }
                     
                 });
@@ -111,6 +226,8 @@ class Camera {
 
             //normal approach
             #else 
+                const hittable_list& world = worlds.local();
+                auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
                 for (int j = 0; j < image_height; j++){
                     std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
                     for (int i = 0; i < image_width; i++){
@@ -118,38 +235,134 @@ class Camera {
                         //calculate the pixel center and ray direction
                         //from the first pixel location, find the offset using i or j * the offset vectors for the direction and add
                         //ray direction: to get vector AB, we do (B-A)
-                        colour pixel_colour(0, 0, 0);
-                            for (int s = 0; s < samples_per_pixel; s++){
-                                Ray r = getRay(i, j);
-                                pixel_colour += ray_colour(r, max_depth, world);
-                            }
-                            image[j][i] = sample_scale * pixel_colour;
-                        
+                        image(i, j) = render_pixel(i, j, world, *sampler);
                     }
+                    writer->write_row(j, image);
                 }
             #endif
         }
 
 
-        //function for writing colours to file
-        //separated it out of render function to give thread pool enough time to join all the threads
-        //destructor is called when the thread pool goes out of scope (which joins all the threads)
-        void writeToFile(const std::vector<std::vector<colour>>& image) {
+        //passes over the tiles that still have unconverged pixels, until there are none (or the time budget runs out)
+        //a tile is written out as soon as all its pixels have converged, the rest by writeToFile
+        void render_progressive(const NumaReplicated<hittable_list>& worlds, Framebuffer& image){
+            ThreadPool& pool = ThreadPool::global();
+            TiledBuffer<PixelEstimate> estimates(image_width, image_height, tile_size);
+            std::vector<Tile> active = make_tiles(image_width, image_height, tile_size, tile_order);
+            std::vector<char> unconverged;
+            std::atomic<uint64_t> samples{0};
+            std::atomic<uint64_t> pending{0};
+            std::atomic<uint64_t> wanted{0};
+            std::atomic<uint64_t> write_ns{0};
+            std::atomic<uint64_t> written{0};
+
+            //with a deadline the first pass is a single sample per pixel, so there is an image as early as possible
+            auto start = steady_clock::now();
+            int limit = time_budget > 0 ? 1 : samples_per_pixel;
+            double seconds_per_sample = 0;
+            //cost of writing a pixel out, from formatting one tile's worth of pixels here (the write itself is queued)
+            //and from the tiles actually written once there are any
+            double write_seconds_per_pixel = 0;
+            if (time_budget > 0){
+                std::vector<colour> pixels(size_t(tile_size) * tile_size, colour(0.5, 0.5, 0.5));
+                auto format_start = steady_clock::now();
+                std::string bytes = ImageWriter::format(int(pixels.size()), pixels.data());
+                write_seconds_per_pixel = duration<double>(steady_clock::now() - format_start).count() / pixels.size();
+            }
 
-            auto start = high_resolution_clock::now();
-            //buffer for storing pixel files to be flushed to std::cout
-            std::ostringstream buffer;
+            int pass = 0;
+            for (; !active.empty(); pass++){
+                if (time_budget > 0 && pass > 0){
+                    //cost of the next pass predicted from the throughput of the previous one,
+                    //shrink the pass (fewer samples per pixel) if the full one would not fit in what is left of the budget
+                    //once 5% of it is kept as a margin and the tiles not written yet are reserved time to be written
+                    uint64_t unwritten = 0;
+                    for (const Tile& tile : active){
+                        unwritten += uint64_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+                    }
+                    if (written.load() > 0){
+                        write_seconds_per_pixel = write_ns.load() * 1e-9 / written.load();
+                    }
+                    auto now = steady_clock::now();
+                    double left = duration<double>(budget_end - now).count() - 0.05 * duration<double>(budget_end - render_start).count()
+                                  - unwritten * write_seconds_per_pixel;
+                    double predicted = wanted.load() * seconds_per_sample;
+                    limit = samples_per_pixel;
+                    if (predicted > left){
+                        uint64_t pixels = pending.load();
+                        limit = pixels > 0 ? int(left / (pixels * seconds_per_sample)) : 0;
+                        if (limit < 1){
+                            std::clog << "\nTime budget: next pass needs ~" << predicted << " s, " << std::max(left, 0.0) << " s left, stopping";
+                            break;
+                        }
+                    }
+                }
 
-            //reduced the time taken to write to file by storing pixel values in a buffer
-            //flushing the buffer to std::cout once all the values are written
-            //note: only written for multithreading approach (since for normal nested loop, we can write as the pixel is being processed)
-            for(int j = 0; j < image_height; j++){
-                for (int i = 0; i < image_width; i++){
-                    write_colour(buffer, image[j][i]);
+                //with reservoirs every pixel takes one sample per pass, the candidates of all of them come first
+                //(a pixel reuses its neighbours' in the second half, ResampledLighting::sample)
+                if (resampler != nullptr){
+                    limit = 1;
                 }
+
+                TaskGroup group;
+                unconverged.assign(active.size(), 0);
+                uint64_t before = samples.load();
+                pending = 0;
+                wanted = 0;
+                auto pass_start = steady_clock::now();
+                PassContext context{worlds, image, estimates, active, unconverged, samples, pending, wanted, write_ns, written, limit, pass == 0};
+                if (resampler != nullptr){
+                    for (size_t k = 0; k < active.size(); k++){
+                        pool.enqueue(group, [this, k, &context]{
+                            resample_tile(context.active[k], context);
+                        });
+                    }
+                    pool.wait(group);
+                }
+                for (size_t k = 0; k < active.size(); k++){
+                    pool.enqueue(group, [this, k, &context]{
+                        context.unconverged[k] = render_tile_pass(context.active[k], context);
+                    });
+                }
+                pool.wait(group);
+                double pass_time = duration<double>(steady_clock::now() - pass_start).count();
+                seconds_per_sample = pass_time / std::max<uint64_t>(1, samples.load() - before);
+                if (guide != nullptr){
+                    guide->end_pass(pass);
+                }
+
+                size_t kept = 0;
+                for (size_t k = 0; k < active.size(); k++){
+                    if (unconverged[k]){
+                        active[kept++] = active[k];
+                    }
+                }
+                active.resize(kept);
+                std::clog << "\rPass " << pass + 1 << ": " << active.size() << " tiles not converged " << std::flush;
+            }
+            std::clog << "\nProgressive: " << pass << " passes in " << duration<double>(steady_clock::now() - start).count() << " s, "
+                      << double(samples.load()) / (image_width * image_height) << " samples per pixel on average (cap "
+                      << samples_per_pixel << ")\n";
+            report_irradiance_cache();
+            if (guide != nullptr){
+                std::clog << "Path guiding: " << guide->regions() << " regions, guided with probability " << guide->mean_selection() << " on average\n";
             }
+        }
+
+
+        //function for writing colours to file
+        //render only returns once every tile is done (it waits on its task group), so the image is complete here
+        //rows are already streamed by render as they finish, so this only writes rows that weren't (MT == 1)
+        //and waits for the outstanding writes, the time printed is the i/o that was not hidden behind rendering
+        void writeToFile(const Framebuffer& image) {
+
+            auto start = high_resolution_clock::now();
 
-            std::cout << buffer.str();            
+            if (writer == nullptr){
+                writer = std::make_unique<ImageWriter>(STDOUT_FILENO, image_width, image_height);
+            }
+            writer->finish(image);
+            writer.reset();
 
             auto stop = high_resolution_clock::now();
             auto duration = duration_cast<milliseconds>(stop - start);
@@ -163,14 +376,271 @@ class Camera {
         vec3 pixel_delta_v;
         point3 pixel00_loc;
         double sample_scale;
+        std::unique_ptr<ImageWriter> writer;
+        //per pixel reservoirs of resampled_lighting, kept between frames of the same size
+        shared_ptr<ReservoirImage> reservoirs;
+        //resampled lighting on reservoirs, created by render when it is on
+        std::unique_ptr<ResampledLighting> resampler;
+        //splats of this frame's light paths (light_tracing), added to every tile before it is written
+        shared_ptr<SplatBuffer> light_image;
+        //this frame's preview and its parameters
+        PreviewIntegrator previewer{Preview::None, 0, 0, 0};
+        //when render was called and when its time budget runs out
+        steady_clock::time_point render_start, budget_end;
+
+        //per NUMA node work counters, used to compare throughput between nodes and sockets
+        //(with sub-NUMA clustering a socket holds several nodes, report_nodes adds them up per socket)
+        static constexpr int max_nodes = 64;
+        struct NodeStats {
+            std::atomic<uint64_t> tiles{0};
+            std::atomic<uint64_t> samples{0};
+            std::atomic<uint64_t> busy_ns{0};
+        };
+
+        struct FrameContext {
+            const NumaReplicated<hittable_list>& worlds;
+            Framebuffer& image;
+            NodeStats* stats;
+            std::atomic<uint64_t>& merge_ns;    //adding the light paths' splats to the tiles, summed over workers
+        };
+
+        struct PassContext {
+            const NumaReplicated<hittable_list>& worlds;
+            Framebuffer& image;
+            TiledBuffer<PixelEstimate>& estimates;
+            const std::vector<Tile>& active;
+            std::vector<char>& unconverged;
+            std::atomic<uint64_t>& samples;
+            std::atomic<uint64_t>& pending; //pixels still unconverged after this pass
+            std::atomic<uint64_t>& wanted;  //samples those pixels ask for in the next pass
+            std::atomic<uint64_t>& write_ns;    //writing converged tiles out, summed over workers
+            std::atomic<uint64_t>& written;     //pixels of those tiles
+            int limit;                      //most samples a pixel may take in this pass
+            bool first;
+        };
+        void report_nodes(const NodeStats* stats) const {
+            const Topology& topology = Topology::get();
+            std::map<int, std::array<uint64_t, 3>> sockets;     //package -> tiles, samples, busy_ns
+            for (int node = 0; node < max_nodes; node++){
+                uint64_t samples = stats[node].samples.load();
+                if (samples == 0){
+                    continue;
+                }
+                int package = topology.package_of_node(node);
+                auto& socket = sockets[package];
+                socket[0] += stats[node].tiles.load();
+                socket[1] += samples;
+                socket[2] += stats[node].busy_ns.load();
+
+                double busy = stats[node].busy_ns.load() * 1e-9;
+                std::clog << "Node " << node << " (socket " << package << "): " << stats[node].tiles.load() << " tiles, "
+                          << samples / 1e6 << " Msamples in " << busy << " thread-s ("
+                          << samples / busy / 1e6 << " Msamples/s per thread)\n";
+            }
+            for (const auto& [package, socket] : sockets){
+                double busy = socket[2] * 1e-9;
+                std::clog << "Socket " << package << ": " << socket[0] << " tiles, "
+                          << socket[1] / 1e6 << " Msamples in " << busy << " thread-s ("
+                          << socket[1] / busy / 1e6 << " Msamples/s per thread)\n";
+            }
+        }
+
+
+
+        //render every pixel of a tile, then hand its rows to the writer so disk time overlaps with the remaining tiles
+        //with light tracing the tile's splats are added first, returns the nanoseconds that took
+        int64_t render_tile(const Tile& tile, const hittable_list& world, Framebuffer& image) const {
+            auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+            if (packet_size > 1){
+                render_tile_packets(tile, world, image, *sampler);
+            } else {
+                for (int j = tile.y0; j < tile.y1; j++){
+                    for (int i = tile.x0; i < tile.x1; i++){
+                        image(i, j) = render_pixel(i, j, world, *sampler);
+                    }
+                }
+            }
+            int64_t merge_ns = 0;
+            if (light_image != nullptr){
+                auto start = steady_clock::now();
+                for (int j = tile.y0; j < tile.y1; j++){
+                    for (int i = tile.x0; i < tile.x1; i++){
+                        image(i, j) += (*light_image)(i, j);
+                    }
+                }
+                merge_ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+            }
+            for (int j = tile.y0; j < tile.y1; j++){
+                writer->write_span(j, tile.x0, tile.x1 - tile.x0, &image(tile.x0, j));
+            }
+            return merge_ns;
+        }
+
+        //same image as render_pixel over the tile, but the camera rays of each pixel block (one sample index at a time)
+        //go through world.hit_packet together, the rest of every path is traced one ray at a time
+        void render_tile_packets(const Tile& tile, const hittable_list& world, Framebuffer& image, Sampler& sampler) const {
+            int size = std::min(packet_size, RayPacket::max_size);
+            int block_w = size >= 8 ? 4 : std::min(size, 2);
+            int block_h = std::max(1, size / block_w);
 
+            for (int j = tile.y0; j < tile.y1; j++){
+                for (int i = tile.x0; i < tile.x1; i++){
+                    image(i, j) = colour(0, 0, 0);
+                }
+            }
 
+            RayPacket packet;
+            hit_record recs[RayPacket::max_size];
+            double closest[RayPacket::max_size];
+            int lane_i[RayPacket::max_size], lane_j[RayPacket::max_size];
+            uint32_t dimension[RayPacket::max_size];
+
+            for (int s = 0; s < samples_per_pixel; s++){
+                for (int by = tile.y0; by < tile.y1; by += block_h){
+                    for (int bx = tile.x0; bx < tile.x1; bx += block_w){
+                        packet.size = 0;
+                        for (int j = by; j < std::min(by + block_h, tile.y1); j++){
+                            for (int i = bx; i < std::min(bx + block_w, tile.x1); i++){
+                                int lane = packet.size++;
+                                sampler.start_pixel_sample(i, j, s);
+                                packet.set(lane, getRay(i, j, sampler));
+                                dimension[lane] = sampler.current_dimension();
+                                closest[lane] = infinity;
+                                lane_i[lane] = i;
+                                lane_j[lane] = j;
+                            }
+                        }
+
+                        uint32_t hits = max_depth > 0 ? world.hit_packet(packet, packet.full_mask(), ray_epsilon, closest, recs) : 0;
+
+                        for (int lane = 0; lane < packet.size; lane++){
+                            int i = lane_i[lane], j = lane_j[lane];
+                            colour sample(0, 0, 0);
+                            if (max_depth > 0){
+                                seed_sample(seed, i, j, s);
+                                sampler.start_pixel_sample(i, j, s);
+                                sampler.set_dimension(dimension[lane]);
+                                Ray r = packet.ray(lane);
+                                if (preview != Preview::None){
+                                    sample = previewer.colour_of(r, (hits >> lane & 1) ? &recs[lane] : nullptr, world, sampler);
+                                } else {
+                                    sample = (hits >> lane & 1) ? shade(r, recs[lane], max_depth, world, sampler) : background(r);
+                                }
+                            }
+                            image(i, j) += sample;
+                        }
+                    }
+                }
+            }
+
+            for (int j = tile.y0; j < tile.y1; j++){
+                for (int i = tile.x0; i < tile.x1; i++){
+                    image(i, j) = sample_scale * image(i, j);
+                }
+            }
+        }
+
+        //one progressive pass over a tile: more samples for every pixel that has not converged yet
+        //returns whether any pixel still needs samples, otherwise the tile is final and goes to the writer
+        bool render_tile_pass(const Tile& tile, PassContext& context) const {
+            const hittable_list& world = context.worlds.local();
+            auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+            bool unconverged = false;
+            uint64_t taken = 0, pending = 0, wanted = 0;
+            for (int j = tile.y0; j < tile.y1; j++){
+                for (int i = tile.x0; i < tile.x1; i++){
+                    PixelEstimate& estimate = context.estimates(i, j);
+                    if (context.first){
+                        estimate.reset();
+                    }
+                    if (converged(estimate)){
+                        continue;
+                    }
+
+                    int count = std::min(next_samples(estimate), context.limit);
+                    for (int s = estimate.samples, end = estimate.samples + count; s < end; s++){
+                        estimate.add(resampler != nullptr ? resampler->sample(i, j, s, world, *sampler) : render_sample(i, j, s, world, *sampler));
+                    }
+                    taken += count;
+                    context.image(i, j) = estimate.mean();
+                    if (!converged(estimate)){
+                        unconverged = true;
+                        pending++;
+                        wanted += next_samples(estimate);
+                    }
+                }
+            }
+            context.samples.fetch_add(taken, std::memory_order_relaxed);
+            context.pending.fetch_add(pending, std::memory_order_relaxed);
+            context.wanted.fetch_add(wanted, std::memory_order_relaxed);
+
+            if (!unconverged){
+                auto write_start = steady_clock::now();
+                for (int j = tile.y0; j < tile.y1; j++){
+                    writer->write_span(j, tile.x0, tile.x1 - tile.x0, &context.image(tile.x0, j));
+                }
+                context.write_ns.fetch_add(duration_cast<nanoseconds>(steady_clock::now() - write_start).count(), std::memory_order_relaxed);
+                context.written.fetch_add(uint64_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0), std::memory_order_relaxed);
+            }
+            return unconverged;
+        }
+
+        //samples an unconverged pixel takes in its next pass
+        int next_samples(const PixelEstimate& estimate) const {
+            int count = estimate.samples < min_samples ? min_samples - estimate.samples : pass_samples;
+            return std::min(count, samples_per_pixel - estimate.samples);
+        }
+
+        bool converged(const PixelEstimate& estimate) const {
+            if (estimate.samples >= samples_per_pixel){
+                return true;
+            }
+            return estimate.samples >= min_samples && estimate.relative_error() <= error_threshold;
+        }
+
+        //average of samples_per_pixel samples
+        colour render_pixel(int i, int j, const hittable_list& world, Sampler& sampler) const {
+            colour pixel_colour(0, 0, 0);
+            for (int s = 0; s < samples_per_pixel; s++){
+                pixel_colour += render_sample(i, j, s, world, sampler);
+            }
+            return sample_scale * pixel_colour;
+        }
+
+        //sample s of pixel (i, j), restarts the sampler (and reseeds the thread's generator)
+        //so it only depends on the camera seed, the pixel and s, not on the thread or the order pixels are rendered in
+        colour render_sample(int i, int j, int s, const hittable_list& world, Sampler& sampler) const {
+            seed_sample(seed, i, j, s);
+            sampler.start_pixel_sample(i, j, s);
+            Ray r = getRay(i, j, sampler);
+            return ray_colour(r, max_depth, world, sampler);
+        }
+        //first half of a resampled pass over a tile: camera ray of every pixel taking a sample this pass,
+        //its primary hit and reservoir are found by ResampledLighting::resample
+        void resample_tile(const Tile& tile, PassContext& context) const {
+            const hittable_list& world = context.worlds.local();
+            auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+            for (int j = tile.y0; j < tile.y1; j++){
+                for (int i = tile.x0; i < tile.x1; i++){
+                    const PixelEstimate& estimate = context.estimates(i, j);
+                    if (!context.first && converged(estimate)){
+                        continue;
+                    }
+                    int s = context.first ? 0 : estimate.samples;
+                    //candidates get their own random sequence, the path of the sample goes on with the usual one
+                    seed_sample(seed ^ ResampledLighting::salt, i, j, s);
+                    sampler->start_pixel_sample(i, j, s);
+                    Ray r = getRay(i, j, *sampler);
+                    resampler->resample(i, j, r, world, *sampler);
+                }
+            }
+        }
 
         //function to return the ray from the camera to the pixel
         //calculate an offset between 0 and 1 and subtract 0.5 (because we are already at the center of the pixel)
         //add the offsets to i and j to get samples within the pixel square
-        Ray getRay(int i, int j) const{
-            auto offset = bound();
+        Ray getRay(int i, int j, Sampler& sampler) const{
+            auto offset = sampler.get_pixel_2D() - 0.5;
             auto sample = pixel00_loc + ((double(i) + offset.x) * pixel_delta_u) + ((double(j) + offset.y) * pixel_delta_v);
             auto ray_dir = sample - center;
             return Ray(center, ray_dir);
@@ -178,34 +648,20 @@ class Camera {
 
         // gradient to get interpolation between blue and white depending on ray's y coordinate
         //if sphere is hit, then shade based on normal vector's components
-        colour ray_colour(const Ray& r, int depth, const hittable_list& world) const{
+        colour ray_colour(const Ray& r, int depth, const hittable_list& world, Sampler& sampler) const{
             if (depth <= 0){
                 return colour(0, 0, 0);
             }
             hit_record rec;
-            if (world.hit(r, interval(0, infinity), rec)){
-            // if(tree.intersect(r, rec)){
-                Ray scattered;
-                colour attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered)){
-                    return attenuation * ray_colour(scattered, depth - 1, world);
-                }
-                //return colour(0,0,0);
-
-                return 0.5 * (rec.normal + colour(1, 1, 1));
+            bool hit = world.hit(r, interval(ray_epsilon, infinity), rec);            if (preview != Preview::None){
+                return previewer.colour_of(r, hit ? &rec : nullptr, world, sampler);
+            }
+            if (hit){
+                return shade(r, rec, depth, world, sampler);
             }
-            
-            vec3 unit_direction = glm::normalize(r.direction());
-            //scale from [-1, 1] to [0, 1]
-            auto a = 0.5*(unit_direction.y + 1.0);
-            return double(1.0 - a)*colour(1.0, 1.0, 1.0) + double(a)*colour(0.5, 0.7, 1.0);
-        }
 
-        vec3 bound() const {
-            return vec3(random_double(0.0, 0.9999) - 0.5, random_double(0.0, 0.9999) - 0.5, 0);
-        }
-};
+            return background(r);
+        }};
 
 
 #endif
-
@@ -8,6 +8,10 @@
 
 using colour = glm::dvec3;
 
+inline double luminance(const colour& c){
+    return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
 interval intensity(0.000, 0.999);
 
 //takes in reference to output stream and pixel_colour
@@ -26,4 +30,21 @@ void write_colour(std::ostringstream& buffer, const colour& pixel_colour){
     buffer << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
 }
 
+//fixed width version ("rrr ggg bbb\n", always 12 bytes) so pixel offsets in the file are known up front
+//clamped with intensity since a byte wider than 3 digits would break the layout
+void write_colour(char* out, const colour& pixel_colour){
+    int bytes[3] = {
+        int(255.99 * intensity.clamp(pixel_colour.x)),
+        int(255.99 * intensity.clamp(pixel_colour.y)),
+        int(255.99 * intensity.clamp(pixel_colour.z))
+    };
+
+    for (int c = 0; c < 3; c++){
+        out[4*c] = '0' + bytes[c] / 100;
+        out[4*c + 1] = '0' + (bytes[c] / 10) % 10;
+        out[4*c + 2] = '0' + bytes[c] % 10;
+        out[4*c + 3] = (c == 2) ? '\n' : ' ';
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,229 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "helper.h"
+#include "alias_table.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+EnvironmentMap class
+
+HDR light from infinitely far away, stored as a lat-long image (.pfm or Radiance .hdr)
+    column u = azimuth around +y, row v = angle from +y (row 0 straight up)
+Rays that escape the scene look it up (radiance), and next event estimation samples it like a light:
+an alias table over the pixels, weighted by luminance * sin(theta) (the solid angle a row covers),
+picks a pixel in constant time and the direction is uniform inside it
+
+sample : direction towards a pixel picked in proportion to its power, pdf per unit solid angle
+pdf    : density sample has for a given direction
+scale  : multiplies every pixel
+*/
+
+class EnvironmentMap {
+    public:
+        EnvironmentMap(const std::string& path, double scale = 1.0){
+            std::string extension = path.substr(path.find_last_of('.') + 1);
+            std::ifstream file(path, std::ios::binary);
+            if (!file){
+                throw std::runtime_error("Could not open environment map " + path);
+            }
+            if (extension == "pfm" || extension == "PFM"){
+                load_pfm(file, path);
+            } else if (extension == "hdr" || extension == "HDR"){
+                load_hdr(file, path);
+            } else {
+                throw std::runtime_error("Unknown environment map format (expected .pfm or .hdr): " + path);
+            }
+            for (colour& c : pixels){
+                c *= scale;
+            }
+            build_distribution();
+        }
+
+        //lat-long image given directly, row major from the top
+        EnvironmentMap(int width, int height, std::vector<colour> pixels) : width(width), height(height), pixels(std::move(pixels)) {
+            build_distribution();
+        }
+
+        colour radiance(const vec3& direction) const {
+            int x, y;
+            pixel_of(glm::normalize(direction), x, y);
+            return pixels[size_t(y) * width + x];
+        }
+
+        //u picks the pixel, uv the point inside it
+        bool sample(double u, glm::dvec2 uv, vec3& direction, double& pdf) const {
+            if (distribution.empty()){
+                return false;
+            }
+            double pmf;
+            uint32_t pixel = distribution.sample(u, pmf);
+            double s = (pixel % width + uv.x) / width;
+            double t = (pixel / width + uv.y) / height;
+            double theta = pi * t;
+            double phi = 2.0 * pi * s - pi;
+            double sin_theta = std::sin(theta);
+            if (sin_theta <= 0){
+                return false;
+            }
+            direction = vec3(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+            pdf = pmf * (double(width) * height) / (2.0 * pi * pi * sin_theta);
+            return true;
+        }
+
+        double pdf(const vec3& direction) const {
+            if (distribution.empty()){
+                return 0;
+            }
+            vec3 d = glm::normalize(direction);
+            double sin_theta = std::sqrt(std::max(0.0, 1.0 - d.y * d.y));
+            if (sin_theta <= 0){
+                return 0;
+            }
+            int x, y;
+            pixel_of(d, x, y);
+            return distribution.pmf(uint32_t(y * width + x)) * (double(width) * height) / (2.0 * pi * pi * sin_theta);
+        }
+
+    private:
+        int width = 0, height = 0;
+        std::vector<colour> pixels;
+        AliasTable distribution;
+
+        void pixel_of(const vec3& d, int& x, int& y) const {
+            double s = (std::atan2(d.z, d.x) + pi) / (2.0 * pi);
+            double t = std::acos(std::clamp(d.y, -1.0, 1.0)) / pi;
+            x = std::clamp(int(s * width), 0, width - 1);
+            y = std::clamp(int(t * height), 0, height - 1);
+        }
+
+        void build_distribution(){
+            std::vector<double> weights(pixels.size());
+            for (int y = 0; y < height; y++){
+                double sin_theta = std::sin(pi * (y + 0.5) / height);
+                for (int x = 0; x < width; x++){
+                    weights[size_t(y) * width + x] = luminance(pixels[size_t(y) * width + x]) * sin_theta;
+                }
+            }
+            distribution = AliasTable(weights);
+        }
+
+        //portable float map: "PF" (rgb) or "Pf" (grey), size, scale (negative = little endian), rows bottom to top
+        void load_pfm(std::ifstream& file, const std::string& path){
+            std::string magic;
+            double endian_scale;
+            file >> magic >> width >> height >> endian_scale;
+            file.get();
+            int channels = magic == "PF" ? 3 : magic == "Pf" ? 1 : 0;
+            if (channels == 0 || !file || width <= 0 || height <= 0){
+                throw std::runtime_error("Not a PFM file: " + path);
+            }
+
+            std::vector<float> data(size_t(width) * height * channels);
+            file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+            if (!file){
+                throw std::runtime_error("Truncated PFM file: " + path);
+            }
+            bool little_endian_host = [] { uint16_t one = 1; char first; std::memcpy(&first, &one, 1); return first == 1; }();
+            if ((endian_scale < 0) != little_endian_host){
+                for (float& f : data){
+                    uint32_t bits;
+                    std::memcpy(&bits, &f, 4);
+                    bits = __builtin_bswap32(bits);
+                    std::memcpy(&f, &bits, 4);
+                }
+            }
+
+            pixels.resize(size_t(width) * height);
+            for (int y = 0; y < height; y++){
+                const float* row = &data[size_t(height - 1 - y) * width * channels];
+                for (int x = 0; x < width; x++){
+                    const float* p = row + x * channels;
+                    pixels[size_t(y) * width + x] = channels == 3 ? colour(p[0], p[1], p[2]) : colour(p[0]);
+                }
+            }
+        }
+
+        //Radiance RGBE: text header ending in a blank line, "-Y height +X width", then flat or run length encoded scanlines
+        void load_hdr(std::ifstream& file, const std::string& path){
+            std::string line;
+            std::getline(file, line);
+            if (line.rfind("#?", 0) != 0){
+                throw std::runtime_error("Not a Radiance HDR file: " + path);
+            }
+            while (std::getline(file, line) && !line.empty()){
+                if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe"){
+                    throw std::runtime_error("Unsupported HDR pixel format (" + line + "): " + path);
+                }
+            }
+            std::getline(file, line);
+            char y_axis[3], x_axis[3];
+            if (std::sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &height, x_axis, &width) != 4
+                || std::strcmp(y_axis, "-Y") != 0 || std::strcmp(x_axis, "+X") != 0 || width <= 0 || height <= 0){
+                throw std::runtime_error("Unsupported HDR orientation (" + line + "): " + path);
+            }
+
+            pixels.resize(size_t(width) * height);
+            std::vector<uint8_t> scanline(size_t(width) * 4);
+            for (int y = 0; y < height; y++){
+                read_hdr_scanline(file, scanline, path);
+                for (int x = 0; x < width; x++){
+                    const uint8_t* rgbe = &scanline[size_t(x) * 4];
+                    double f = rgbe[3] ? std::ldexp(1.0, int(rgbe[3]) - (128 + 8)) : 0.0;
+                    pixels[size_t(y) * width + x] = colour(rgbe[0] * f, rgbe[1] * f, rgbe[2] * f);
+                }
+            }
+        }
+
+        void read_hdr_scanline(std::ifstream& file, std::vector<uint8_t>& scanline, const std::string& path){
+            uint8_t start[4];
+            if (!file.read(reinterpret_cast<char*>(start), 4)){
+                throw std::runtime_error("Truncated HDR file: " + path);
+            }
+            bool rle = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width;
+            if (!rle){
+                std::memcpy(scanline.data(), start, 4);
+                if (!file.read(reinterpret_cast<char*>(scanline.data()) + 4, scanline.size() - 4)){
+                    throw std::runtime_error("Truncated HDR file: " + path);
+                }
+                return;
+            }
+
+            //new style: the four channels one after the other, each as runs (count > 128) or literals
+            for (int channel = 0; channel < 4; channel++){
+                int x = 0;
+                while (x < width){
+                    int count = file.get();
+                    if (count == EOF){
+                        throw std::runtime_error("Truncated HDR file: " + path);
+                    }
+                    bool run = count > 128;
+                    if (run){
+                        count -= 128;
+                    }
+                    if (count == 0 || x + count > width){
+                        throw std::runtime_error("Corrupt HDR scanline: " + path);
+                    }
+                    if (run){
+                        int value = file.get();
+                        for (int k = 0; k < count; k++){
+                            scanline[size_t(x++) * 4 + channel] = uint8_t(value);
+                        }
+                    } else {
+                        for (int k = 0; k < count; k++){
+                            scanline[size_t(x++) * 4 + channel] = uint8_t(file.get());
+                        }
+                    }
+                }
+            }
+            if (!file){
+                throw std::runtime_error("Truncated HDR file: " + path);
+            }
+        }
+};
+
+#endif
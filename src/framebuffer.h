@@ -0,0 +1,132 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "helper.h"
+#include <atomic>
+#include <vector>
+
+/*
+TiledBuffer class
+
+Per pixel values stored tile by tile instead of row by row (tile_size x tile_size pixels per tile, row major inside a tile)
+- a tile row is contiguous, so finished tiles can be handed to the writer span by span
+- each tile is padded to whole pages and the storage is never written on allocation,
+  so the pages of a tile are placed on the NUMA node of the worker that renders it (first touch)
+  (T has to be trivial, the task that owns a tile initialises its pixels)
+
+Use the same tile_size as the camera so one render task owns whole pages
+
+Framebuffer   : final colour of every pixel
+PixelEstimate : running sums of the samples of one pixel, for progressive rendering
+SplatBuffer   : colour added to any pixel by any thread (light tracing), read once every splat is in
+*/
+
+template <typename T>
+class TiledBuffer {
+    public:
+        const int width, height, tile_size;
+
+        TiledBuffer(int width, int height, int tile_size) : width(width), height(height), tile_size(tile_size) {
+            tiles_x = (width + tile_size - 1) / tile_size;
+            int tiles_y = (height + tile_size - 1) / tile_size;
+            size_t bytes = size_t(tile_size) * tile_size * sizeof(T);
+            tile_bytes = (bytes + page_size - 1) / page_size * page_size;
+            storage.reset(static_cast<char*>(std::aligned_alloc(page_size, tile_bytes * tiles_x * tiles_y)));
+            if (!storage){
+                throw std::bad_alloc();
+            }
+        }
+
+        T& operator()(int i, int j){
+            return *pixel(i, j);
+        }
+
+        const T& operator()(int i, int j) const {
+            return *pixel(i, j);
+        }
+
+    private:
+        static constexpr size_t page_size = 4096;
+
+        std::unique_ptr<char, decltype(&std::free)> storage{nullptr, &std::free};
+        size_t tile_bytes;
+        int tiles_x;
+
+        T* pixel(int i, int j) const {
+            int tile = (j / tile_size) * tiles_x + (i / tile_size);
+            char* base = storage.get() + tile_bytes * tile;
+            return reinterpret_cast<T*>(base) + (j % tile_size) * tile_size + (i % tile_size);
+        }
+};
+
+using Framebuffer = TiledBuffer<colour>;
+
+
+struct PixelEstimate {
+    colour sum;
+    double luminance_sum;
+    double luminance_squares;
+    int samples;
+
+    void reset(){
+        sum = colour(0, 0, 0);
+        luminance_sum = luminance_squares = 0;
+        samples = 0;
+    }
+
+    void add(const colour& c){
+        double y = luminance(c);
+        sum += c;
+        luminance_sum += y;
+        luminance_squares += y * y;
+        samples++;
+    }
+
+    colour mean() const {
+        return samples > 0 ? sum / double(samples) : colour(0, 0, 0);
+    }
+
+    //standard error of the mean luminance relative to the mean (floored so near black pixels don't need endless samples)
+    double relative_error() const {
+        if (samples < 2){
+            return infinity;
+        }
+        double mean = luminance_sum / samples;
+        double variance = std::max(0.0, (luminance_squares - luminance_sum * mean) / (samples - 1));
+        return std::sqrt(variance / samples) / std::max(mean, 0.01);
+    }
+};
+
+
+/*
+SplatBuffer class
+
+Light paths land on whatever pixel they project to, so every worker adds to the whole image at once
+- every channel is an atomic float added to with a compare exchange loop (relaxed order, nothing else is published through it),
+  so there are no locks and no per thread copies of the image to allocate and merge (one float3 per pixel for any number of workers)
+- contention only costs something where many splats hit the same pixels at the same time (bright caustics)
+- read it after the task group that splats has been waited on
+*/
+class SplatBuffer {
+    public:
+        const int width, height;
+
+        SplatBuffer(int width, int height) : width(width), height(height), values(size_t(width) * height * 3) {}
+
+        void add(int i, int j, const colour& c){
+            std::atomic<float>* pixel = &values[(size_t(j) * width + i) * 3];
+            atomic_add(pixel[0], float(c.x));
+            atomic_add(pixel[1], float(c.y));
+            atomic_add(pixel[2], float(c.z));
+        }
+
+        colour operator()(int i, int j) const {
+            const std::atomic<float>* pixel = &values[(size_t(j) * width + i) * 3];
+            return colour(pixel[0].load(std::memory_order_relaxed), pixel[1].load(std::memory_order_relaxed), pixel[2].load(std::memory_order_relaxed));
+        }
+
+    private:
+        std::vector<std::atomic<float>> values;
+};
+
+#endif
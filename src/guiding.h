@@ -0,0 +1,449 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "helper.h"
+#include "bounds.h"
+#include "colour.h"
+#include "sampler.h"
+#include "material.h"
+#include <array>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+/*
+Path guiding (Müller et al., Practical Path Guiding): a spatio-directional tree (SD-tree) of the light arriving in the scene,
+learned from the paths of one progressive pass and sampled by the diffuse bounces of the next
+
+GuideField     : binary tree over the scene box (split in the middle, axes in turn) whose leaves are regions,
+                 a region splits once a training iteration put more than split_samples samples into it
+GuideLeaf      : one region, two DirectionTrees of the same kind
+                 sampling = what the current pass draws directions from (read only during the pass),
+                 building = what the current pass splats its samples into (atomic adds, no locks),
+                 and the probability alpha of drawing from sampling instead of the material,
+                 learned by gradient descent on the KL divergence between the mixture and the light * bsdf product
+DirectionTree  : quadtree over the square the sphere maps to (cylindrical, preserves area), every node keeps the energy of
+                 its four quadrants, refined after each pass so quadrants with more than 1% of the energy get split
+GuideSite      : the region a diffuse hit is in and its alpha, draws the bounce from there (scatter)
+GuidedPath     : the diffuse vertices of one camera path, the light found further along is credited to each of them and
+                 splatted when the path ends (commit)
+
+training runs in iterations of 1, 2, 4, 8, ... passes, so every new distribution is learned from as many samples as
+all the earlier ones together, between passes (no other thread uses the field then):
+    learn  : one Adam step on alpha per pass
+    refine : at the end of an iteration, splits busy regions, makes every building tree the new sampling tree
+             and restructures the building trees after the energy just learned
+*/
+
+//unit direction <-> point of the unit square, z = 2u - 1 and phi = 2 pi v (area preserving, density = square density / 4 pi)
+inline glm::dvec2 direction_to_square(const vec3& d){
+    double phi = std::atan2(d.y, d.x);
+    if (phi < 0){
+        phi += 2.0 * pi;
+    }
+    return glm::dvec2(std::clamp(0.5 * (d.z + 1.0), 0.0, one_minus_epsilon), std::clamp(phi / (2.0 * pi), 0.0, one_minus_epsilon));
+}
+
+inline vec3 square_to_direction(glm::dvec2 s){
+    double z = 2.0 * s.x - 1.0;
+    double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+    double phi = 2.0 * pi * s.y;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+
+class DirectionTree {
+    public:
+        DirectionTree() : nodes(1) {}
+
+        //lock free, from any thread
+        void splat(glm::dvec2 s, float value){
+            uint32_t n = 0;
+            while (true){
+                int q = quadrant(s);
+                atomic_add(nodes[n].sum[q], value);
+                if (nodes[n].child[q] == 0){
+                    return;
+                }
+                n = nodes[n].child[q];
+            }
+        }
+
+        //energy of the whole sphere (0 = nothing learned)
+        double total() const {
+            double sum = 0;
+            for (const auto& s : nodes[0].sum){
+                sum += s.load(std::memory_order_relaxed);
+            }
+            return sum;
+        }
+
+        //point of the square drawn in proportion to the energy, density on the square
+        glm::dvec2 sample(glm::dvec2 u, double& pdf) const {
+            glm::dvec2 origin(0, 0);
+            double size = 1.0;
+            pdf = 1.0;
+            uint32_t n = 0;
+            while (true){
+                double s[4];
+                for (int q = 0; q < 4; q++){
+                    s[q] = nodes[n].sum[q].load(std::memory_order_relaxed);
+                }
+                double total = s[0] + s[1] + s[2] + s[3];
+                if (total <= 0){
+                    break;
+                }
+                //x half from the marginal, then y half given it, u reused after rescaling
+                double left = s[0] + s[2];
+                int x = u.x < left / total ? 0 : 1;
+                u.x = x == 0 ? u.x * total / left : (u.x - left / total) * total / (total - left);
+                double column = x == 0 ? left : s[1] + s[3];
+                int y = u.y < s[x] / column ? 0 : 1;
+                u.y = y == 0 ? u.y * column / s[x] : (u.y - s[x] / column) * column / (column - s[x]);
+                u = glm::min(u, glm::dvec2(one_minus_epsilon));
+                int q = x + 2 * y;
+                pdf *= 4.0 * s[q] / total;
+                size *= 0.5;
+                origin += size * glm::dvec2(x, y);
+                if (nodes[n].child[q] == 0){
+                    break;
+                }
+                n = nodes[n].child[q];
+            }
+            return origin + size * u;
+        }
+
+        double pdf(glm::dvec2 s) const {
+            double pdf = 1.0;
+            uint32_t n = 0;
+            while (true){
+                int q = quadrant(s);
+                double total = 0;
+                for (const auto& sum : nodes[n].sum){
+                    total += sum.load(std::memory_order_relaxed);
+                }
+                if (total <= 0){
+                    return pdf;
+                }
+                pdf *= 4.0 * nodes[n].sum[q].load(std::memory_order_relaxed) / total;
+                if (nodes[n].child[q] == 0){
+                    return pdf;
+                }
+                n = nodes[n].child[q];
+            }
+        }
+
+        //empty tree whose leaves each hold at most threshold of this tree's energy (where it can tell, max_depth levels at most)
+        DirectionTree refined(double threshold, int max_depth) const {
+            DirectionTree out;
+            out.nodes.clear();
+            double energy[4];
+            for (int q = 0; q < 4; q++){
+                energy[q] = nodes[0].sum[q].load(std::memory_order_relaxed);
+            }
+            rebuild(out, 0, energy, threshold * total(), 1, max_depth);
+            return out;
+        }
+
+        size_t size() const { return nodes.size(); }
+
+    private:
+        struct Node {
+            std::array<std::atomic<float>, 4> sum;
+            std::array<uint32_t, 4> child;      //0 = the quadrant is a leaf (the root is nobody's child)
+
+            Node(){
+                for (int q = 0; q < 4; q++){
+                    sum[q].store(0, std::memory_order_relaxed);
+                    child[q] = 0;
+                }
+            }
+
+            Node(const Node& other){
+                *this = other;
+            }
+
+            Node& operator=(const Node& other){
+                for (int q = 0; q < 4; q++){
+                    sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    child[q] = other.child[q];
+                }
+                return *this;
+            }
+        };
+
+        std::vector<Node> nodes;
+
+        //quadrant of s in the current node, s rescaled to the quadrant
+        static int quadrant(glm::dvec2& s){
+            int x = s.x < 0.5 ? 0 : 1;
+            int y = s.y < 0.5 ? 0 : 1;
+            s = glm::min(2.0 * s - glm::dvec2(x, y), glm::dvec2(one_minus_epsilon));
+            return x + 2 * y;
+        }
+
+        //old = node of this tree covering the same square (-1 = none, its energy is spread evenly)
+        uint32_t rebuild(DirectionTree& out, int64_t old, const double energy[4], double limit, int depth, int max_depth) const {
+            uint32_t n = uint32_t(out.nodes.size());
+            out.nodes.emplace_back();
+            for (int q = 0; q < 4; q++){
+                if (limit <= 0 || energy[q] <= limit || depth >= max_depth){
+                    continue;
+                }
+                int64_t old_child = old >= 0 && nodes[old].child[q] != 0 ? int64_t(nodes[old].child[q]) : -1;
+                double sub[4];
+                for (int c = 0; c < 4; c++){
+                    sub[c] = old_child >= 0 ? nodes[old_child].sum[c].load(std::memory_order_relaxed) : energy[q] / 4;
+                }
+                uint32_t child = rebuild(out, old_child, sub, limit, depth + 1, max_depth);
+                out.nodes[n].child[q] = child;
+            }
+            return n;
+        }
+};
+
+
+class GuideLeaf {
+    public:
+        DirectionTree sampling, building;
+        std::atomic<uint32_t> samples{0};
+
+        GuideLeaf() {}
+
+        //copy for the other half of a split region (learning statistics start over)
+        GuideLeaf(const GuideLeaf& other) : sampling(other.sampling), building(other.building),
+            trained(other.trained), theta(other.theta), probability(other.probability), m(other.m), v(other.v), steps(other.steps) {}
+
+        //probability of drawing from sampling, 0 until something has been learned
+        double selection() const {
+            return probability;
+        }
+
+        vec3 sample(glm::dvec2 u) const {
+            double pdf;
+            return square_to_direction(sampling.sample(u, pdf));
+        }
+
+        //density per unit solid angle
+        double pdf(const vec3& direction) const {
+            return sampling.pdf(direction_to_square(glm::normalize(direction))) / (4.0 * pi);
+        }
+
+        //one sample of the light arriving from direction, radiance is its luminance, pdf the mixture density it was drawn with
+        //product = radiance * bsdf * cosine (the density alpha should match), alpha, guide_pdf and bsdf_pdf as drawn
+        void record(const vec3& direction, double radiance, double pdf, double product, double alpha, double guide_pdf, double bsdf_pdf){
+            samples.fetch_add(1, std::memory_order_relaxed);
+            if (radiance > 0 && pdf > 0){
+                building.splat(direction_to_square(glm::normalize(direction)), float(product / pdf));
+            }
+            if (alpha > 0 && pdf > 0){
+                //d KL / d theta, with the product as the (unnormalised) target and alpha = sigmoid(theta)
+                double gradient = -(product / pdf) * (guide_pdf - bsdf_pdf) / pdf * alpha * (1.0 - alpha);
+                atomic_add(gradient_sum, float(gradient));
+                gradient_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        //between passes, at the end of a training iteration
+        void refine(){
+            if (building.total() > 0){
+                sampling = building;
+                building = sampling.refined(0.01, 20);
+                trained = true;
+                probability = 1.0 / (1.0 + std::exp(-theta));
+            }
+            samples.store(0, std::memory_order_relaxed);
+        }
+
+        //between passes, one Adam step on theta with the mean gradient of the pass
+        void learn(){
+            uint32_t count = gradient_count.exchange(0, std::memory_order_relaxed);
+            double g = gradient_sum.exchange(0, std::memory_order_relaxed);
+            if (count > 0 && std::isfinite(g)){
+                g /= count;
+                steps++;
+                m = 0.9 * m + 0.1 * g;
+                v = 0.999 * v + 0.001 * g * g;
+                double m_hat = m / (1.0 - std::pow(0.9, steps));
+                double v_hat = v / (1.0 - std::pow(0.999, steps));
+                //alpha kept within [0.05, 0.95], the material always gets a share of the directions
+                theta = std::clamp(theta - 0.2 * m_hat / (std::sqrt(v_hat) + 1e-8), -3.0, 3.0);
+                if (trained){
+                    probability = 1.0 / (1.0 + std::exp(-theta));
+                }
+            }
+        }
+
+    private:
+        bool trained = false;
+        double theta = 0, probability = 0;     //sigmoid(theta), what selection returns during the next pass
+        double m = 0, v = 0;
+        int steps = 0;
+        std::atomic<float> gradient_sum{0};
+        std::atomic<uint32_t> gradient_count{0};
+};
+
+
+//guiding at one diffuse hit: its region and the probability of drawing from the learned distribution
+struct GuideSite {
+    GuideLeaf* leaf = nullptr;
+    double alpha = 0;
+
+    //density of the mixture, given the material's
+    double pdf(double bsdf_pdf, const vec3& direction) const {
+        return alpha > 0 ? alpha * leaf->pdf(direction) + (1.0 - alpha) * bsdf_pdf : bsdf_pdf;
+    }
+
+    //bounce from the site's diffuse hit: the learned distribution with probability alpha, the material otherwise,
+    //false when the material scatters nothing, else wi = unit direction of scattered and its densities under both and the mixture
+    bool scatter(const Ray& r, const hit_record& rec, Sampler& sampler, Ray& scattered, vec3& wi,
+                 double& guide_pdf, double& bsdf_pdf, double& mixture_pdf) const {
+        colour attenuation;
+        if (sampler.get_1D() < alpha){
+            scattered = Ray(rec.p, leaf->sample(sampler.get_2D()));
+        } else if (!rec.mat->scatter(r, rec, attenuation, scattered, sampler)){
+            return false;
+        }
+        wi = glm::normalize(scattered.direction());
+        bsdf_pdf = rec.mat->pdf(rec, wi);
+        guide_pdf = alpha > 0 ? leaf->pdf(wi) : 0;
+        mixture_pdf = alpha * guide_pdf + (1.0 - alpha) * bsdf_pdf;
+        return true;
+    }
+};
+
+
+class GuideField {
+    public:
+        GuideField(const Bounds& scene, uint32_t split_samples = 4000) : box(scene), split_samples(split_samples) {
+            //a little larger, so points on the boundary are inside
+            vec3 margin = 1e-3 * (scene.max - scene.min) + vec3(1e-6);
+            box = Bounds(scene.min - margin, scene.max + margin);
+            nodes.push_back(Node{0, 0, 0});
+            leaves.emplace_back();
+        }
+
+        GuideSite site(const point3& p){
+            GuideLeaf& leaf = leaves[locate(p)];
+            return GuideSite{&leaf, leaf.selection()};
+        }
+
+        //after pass (counted from 0), no other thread may use the field then
+        void end_pass(int pass){
+            for (GuideLeaf& leaf : leaves){
+                leaf.learn();
+            }
+            //iterations end after passes 0, 2, 6, 14, ...
+            if (((pass + 2) & (pass + 1)) == 0){
+                refine();
+            }
+        }
+
+        size_t regions() const { return leaves.size(); }
+
+        double mean_selection() const {
+            double sum = 0;
+            for (const GuideLeaf& leaf : leaves){
+                sum += leaf.selection();
+            }
+            return sum / leaves.size();
+        }
+
+    private:
+        struct Node {
+            uint32_t child;     //index of the first of two children, 0 = leaf
+            uint32_t leaf;
+            uint8_t depth;      //split axis is depth % 3
+        };
+
+        static constexpr int max_depth = 60;
+
+        Bounds box;
+        uint32_t split_samples;
+        std::vector<Node> nodes;
+        std::deque<GuideLeaf> leaves;
+
+        uint32_t locate(const point3& p) const {
+            point3 lo = box.min, hi = box.max;
+            uint32_t n = 0;
+            while (nodes[n].child != 0){
+                int axis = nodes[n].depth % 3;
+                double middle = 0.5 * (lo[axis] + hi[axis]);
+                if (p[axis] < middle){
+                    hi[axis] = middle;
+                    n = nodes[n].child;
+                } else {
+                    lo[axis] = middle;
+                    n = nodes[n].child + 1;
+                }
+            }
+            return nodes[n].leaf;
+        }
+
+        void refine(){
+            //new halves are visited as well, until every region had at most split_samples (assuming they divide evenly)
+            for (size_t n = 0; n < nodes.size(); n++){
+                if (nodes[n].child != 0 || leaves[nodes[n].leaf].samples.load() <= split_samples || nodes[n].depth >= max_depth){
+                    continue;
+                }
+                //the region splits in the middle, both halves start from what it learned
+                uint32_t first = uint32_t(nodes.size());
+                uint32_t copy = uint32_t(leaves.size());
+                leaves.emplace_back(leaves[nodes[n].leaf]);
+                uint32_t half = leaves[nodes[n].leaf].samples.load() / 2;
+                leaves[nodes[n].leaf].samples.store(half);
+                leaves[copy].samples.store(half);
+                nodes.push_back(Node{0, nodes[n].leaf, uint8_t(nodes[n].depth + 1)});
+                nodes.push_back(Node{0, copy, uint8_t(nodes[n].depth + 1)});
+                nodes[n].child = first;
+            }
+            for (GuideLeaf& leaf : leaves){
+                leaf.refine();
+            }
+        }
+};
+
+
+//the guided vertices of one path, radiance found later along the path is divided by the throughput up to and including
+//each vertex's bounce (so it is the light arriving there), vertices past capacity are not learned from
+class GuidedPath {
+    public:
+        void add_vertex(GuideLeaf* leaf, const vec3& direction, const colour& throughput, double pdf, double bsdf_value,
+                        double alpha, double guide_pdf, double bsdf_pdf){
+            if (count < capacity){
+                vertices[count++] = Vertex{leaf, direction, throughput, colour(0, 0, 0), pdf, bsdf_value, alpha, guide_pdf, bsdf_pdf};
+            }
+        }
+
+        //contribution already times the throughput of the whole path
+        void add(const colour& contribution){
+            for (int k = 0; k < count; k++){
+                const colour& t = vertices[k].throughput;
+                vertices[k].radiance += colour(t.x > 0 ? contribution.x / t.x : 0, t.y > 0 ? contribution.y / t.y : 0, t.z > 0 ? contribution.z / t.z : 0);
+            }
+        }
+
+        void commit(){
+            for (int k = 0; k < count; k++){
+                const Vertex& v = vertices[k];
+                double radiance = luminance(v.radiance);
+                v.leaf->record(v.direction, radiance, v.pdf, radiance * v.bsdf_value, v.alpha, v.guide_pdf, v.bsdf_pdf);
+            }
+            count = 0;
+        }
+
+    private:
+        struct Vertex {
+            GuideLeaf* leaf;
+            vec3 direction;
+            colour throughput;
+            colour radiance;
+            double pdf, bsdf_value, alpha, guide_pdf, bsdf_pdf;
+        };
+
+        static constexpr int capacity = 32;
+        Vertex vertices[capacity];
+        int count = 0;
+};
+
+#endif
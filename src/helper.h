@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <chrono>
 #include <algorithm>
+#include <atomic>
 #include <execution>
 #include <thread>
 #include <functional>
@@ -16,6 +17,8 @@
 #include <sstream>
 #include <string>
 #include <iterator>
+#include "async_io.h"
+#include "rng.h"
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/norm.hpp>
 
@@ -35,8 +38,16 @@ inline double degrees_to_radians(double degrees){
     return degrees * pi / 180.0;
 }
 
+//thread local generator (rng.h), no shared state between pool workers
 inline double random_double(double min, double max) {
-    return min + (max-min)*(std::rand() / (RAND_MAX +  1.0));
+    return min + (max-min)*thread_rng().uniform();
+}
+
+//floats have no fetch_add before C++20, relaxed: nothing else is published through the value
+inline void atomic_add(std::atomic<float>& target, float value){
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)){
+    }
 }
 
 
@@ -63,6 +74,14 @@ inline vec3 reflect(const vec3& v, const vec3& n){
     return v - 2*glm::dot(v, n)*n;
 }
 
+//unit direction uv refracted through a surface with normal n (facing uv's side), eta = index outside / index inside
+inline vec3 refract(const vec3& uv, const vec3& n, double eta){
+    auto cos_theta = std::min(glm::dot(-uv, n), 1.0);
+    vec3 perpendicular = eta * (uv + cos_theta * n);
+    vec3 parallel = -std::sqrt(std::fabs(1.0 - glm::dot(perpendicular, perpendicular))) * n;
+    return perpendicular + parallel;
+}
+
 double getCoord(const point3& p, int axis){
     switch(axis){
         case 0: return p.x;
@@ -76,10 +95,10 @@ double getCoord(const point3& p, int axis){
 inline void parse_obj(const char* file_vert, const char* file_faces){
     std::vector<point3> vertices;
     
-    std::ifstream file(file_vert);
+    LineReader file(file_vert);
 
     std::string line;
-    while(std::getline(file, line)){
+    while(file.getline(line)){
         if(line.empty())
             continue;
 
@@ -88,15 +107,14 @@ inline void parse_obj(const char* file_vert, const char* file_faces){
         iss >> x >> y >> z;
         vertices.push_back(point3(x, y, z));
     }
-    file.close();
 
 
 
-    std::ifstream file2(file_faces);
+    LineReader file2(file_faces);
     std::string line2;
 
     std::ostringstream buffer;
-    while(std::getline(file2, line2)){
+    while(file2.getline(line2)){
         if(line2.empty())
             continue;
         int v1, v2, v3;
@@ -104,7 +122,6 @@ inline void parse_obj(const char* file_vert, const char* file_faces){
         iss >> v1 >> v2 >> v3;
         buffer << vertices[v1-1].x << ' ' <<  vertices[v1-1].y << ' ' << vertices[v1-1].z << ' ' << vertices[v2-1].x << ' ' <<  vertices[v2-1].y << ' ' << vertices[v2-1].z << ' ' << vertices[v3-1].x << ' ' <<  vertices[v3-1].y << ' ' << vertices[v3-1].z << '\n';
     }
-    file2.close();
     
     std::ofstream outFile("assets/dragon.txt");
     outFile << buffer.str();
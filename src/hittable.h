@@ -6,8 +6,10 @@
 #include "helper.h"
 #include <stdbool.h>
 #include "bounds.h"
+#include "packet.h"
 
 class material;
+class hittable;
 
 //class to store hit details - t value of ray, normal of surface
 class hit_record {
@@ -15,6 +17,7 @@ class hit_record {
         point3 p;
         vec3 normal;
         shared_ptr<material> mat;
+        const hittable* object = nullptr;   //primitive that was hit (lights are recognised by it), nullptr for mesh triangles without an object
         double t;
         bool front_face;
 
@@ -26,6 +29,25 @@ class hit_record {
         }
 };
 
+//point on the surface of an area light picked by hittable::sample_surface
+//pdf is per unit solid angle as seen from the point the light was sampled for
+struct surface_sample {
+    point3 p;
+    vec3 normal;
+    double pdf;
+    const material* mat;
+};
+
+//what a light hierarchy needs to know about an area light besides its bounding box
+//every surface normal lies within acos(cos_theta_o) of axis (-1 = any direction)
+struct emitter_shape {
+    double area;
+    vec3 axis;
+    double cos_theta_o;
+    bool two_sided;         //emits from both sides of every normal
+    const material* mat;
+};
+
 //virtual lets you override a base class method 
 class hittable {
     public:
@@ -34,6 +56,49 @@ class hittable {
 
         virtual bool hit(const Ray& r, interval ray_t, hit_record& rec) const = 0;
         virtual Bounds3f BoundingBox() const = 0;
+
+        //any hit in ray_t (shadow / visibility rays): may stop at the first intersection found and never fills a hit_record
+        //primitives and accelerators override it with a cheaper test, this fallback runs a closest hit query
+        virtual bool occluded(const Ray& r, interval ray_t) const {
+            hit_record rec;
+            return hit(r, ray_t, rec);
+        }
+
+        //closest hit for every lane of a packet in mask, lane l only accepts hits in (t_min, closest[l])
+        //closest and recs are updated for the lanes that hit, returns the mask of those lanes
+        //accelerators override this to traverse with the whole packet, everything else tests one lane at a time
+        virtual uint32_t hit_packet(const RayPacket& packet, uint32_t mask, double t_min, double* closest, hit_record* recs) const {
+            uint32_t hits = 0;
+            for (uint32_t m = mask; m; m &= m - 1){
+                int lane = __builtin_ctz(m);
+                if (hit(packet.ray(lane), interval(t_min, closest[lane]), recs[lane])){
+                    closest[lane] = recs[lane].t;
+                    hits |= 1u << lane;
+                }
+            }
+            return hits;
+        }
+
+        //shapes that can be area lights: pick a point of the surface visible from ref (u uniform in [0, 1)^2)
+        //returns false if the shape can't be sampled or the sample is useless (seen edge on)
+        virtual bool sample_surface(const point3&, glm::dvec2, surface_sample&) const {
+            return false;
+        }
+
+        //density (per solid angle) sample_surface has for choosing rec.p when called from ref
+        virtual double surface_pdf(const point3&, const hit_record&) const {
+            return 0;
+        }
+
+        //uniform point on the whole surface (density 1 / area) with its outward normal, for emitting photons
+        virtual bool sample_point(glm::dvec2, point3&, vec3&) const {
+            return false;
+        }
+
+        //area, normals and material of shapes that can be area lights, false for everything else
+        virtual bool describe_emitter(emitter_shape&) const {
+            return false;
+        }
 };
 
 
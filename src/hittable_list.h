@@ -71,7 +71,28 @@ class hittable_list : public hittable {
             return hit_anything;
         }
 
+        bool occluded(const Ray& r, interval ray_t) const override {
+            for (const auto& object : objects){
+                if (object->occluded(r, ray_t)){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        uint32_t hit_packet(const RayPacket& packet, uint32_t mask, double t_min, double* closest, hit_record* recs) const override {
+            uint32_t hits = 0;
+            for (const auto& object : objects){
+                hits |= object->hit_packet(packet, mask, t_min, closest, recs);
+            }
+            return hits;
+        }
+
+        //an empty list has an empty box at the origin
         Bounds3f BoundingBox() const override {
+            if (objects.empty()){
+                return Bounds3f(point3(0), point3(0));
+            }
             Bounds3f box = objects[0]->BoundingBox();
             for (const auto& object : objects){
                 box = Union(box, object->BoundingBox());
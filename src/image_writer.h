@@ -0,0 +1,144 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "helper.h"
+#include "async_io.h"
+#include "framebuffer.h"
+#include <atomic>
+
+/*
+ImageWriter class
+
+Streams a P3 ppm to a file descriptor while the image is still being rendered
+Every pixel is written with a fixed width ("rrr ggg bbb\n", 12 bytes) so the byte offset of any pixel is known up front
+That lets finished spans (rows, parts of rows) be written at their final position as soon as they are done
+
+- seekable output (regular file, e.g. ./raytracer > image.ppm) : spans go straight to AsyncFile writes at their offset
+- anything else (pipe, terminal)                               : rows are staged and written in order once complete
+
+Methods
+- format     : the bytes of count pixels
+- write_span : write count pixels of row j starting at column i
+- write_row  : write a whole row of a framebuffer (one span per tile)
+- finish     : write rows that were never streamed, wait for all writes and move the fd position past the image
+*/
+
+class ImageWriter {
+    public:
+        static constexpr size_t pixel_bytes = 12;
+
+        ImageWriter(int fd, int width, int height) : width(width), height(height), file(fd), written(height) {
+            std::ostringstream header;
+            header << "P3\n" << width << ' ' << height << "\n255\n";
+            header_bytes = header.str().size();
+            row_bytes = pixel_bytes * width;
+
+            struct stat st;
+            base = ::lseek(fd, 0, SEEK_CUR);
+            seekable = base >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+            if (seekable){
+                file.write(header.str(), base);
+            } else {
+                staged.resize(height);
+                header_pending = header.str();
+            }
+            for (auto& count : written){
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        ~ImageWriter(){
+            file.flush();
+        }
+
+        static std::string format(int count, const colour* pixels){
+            std::string bytes(pixel_bytes * count, ' ');
+            for (int k = 0; k < count; k++){
+                write_colour(&bytes[pixel_bytes * k], pixels[k]);
+            }
+            return bytes;
+        }
+
+        void write_span(int j, int i, int count, const colour* pixels){
+            std::string bytes = format(count, pixels);
+
+            if (seekable){
+                file.write(std::move(bytes), base + header_bytes + row_bytes * j + pixel_bytes * i);
+                written[j].fetch_add(count, std::memory_order_relaxed);
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(stage_mutex);
+            if (staged[j].empty()){
+                staged[j].assign(row_bytes, ' ');
+            }
+            staged[j].replace(pixel_bytes * i, bytes.size(), bytes);
+            written[j].fetch_add(count, std::memory_order_relaxed);
+            flush_ready_rows();
+        }
+
+        void write_row(int j, const Framebuffer& image){
+            for (int i = 0; i < width; i += image.tile_size){
+                write_span(j, i, std::min(image.tile_size, width - i), &image(i, j));
+            }
+        }
+
+        bool row_written(int j) const {
+            return written[j].load(std::memory_order_relaxed) >= width;
+        }
+
+        //write any rows the renderer did not stream, then wait for the writes to land
+        void finish(const Framebuffer& image){
+            for (int j = 0; j < height; j++){
+                if (!row_written(j)){
+                    write_row(j, image);
+                }
+            }
+            file.flush();
+            if (seekable){
+                ::lseek(file.descriptor(), base + header_bytes + row_bytes * height, SEEK_SET);
+            }
+        }
+
+    private:
+        int width, height;
+        AsyncFile file;
+        std::vector<std::atomic<int>> written;
+        size_t header_bytes = 0;
+        size_t row_bytes = 0;
+        off_t base = 0;
+        bool seekable = false;
+
+        //in-order fallback
+        std::mutex stage_mutex;
+        std::vector<std::string> staged;
+        std::string header_pending;
+        int next_row = 0;
+
+        //write the longest run of complete rows starting at next_row (called with stage_mutex held)
+        void flush_ready_rows(){
+            std::string out = std::move(header_pending);
+            header_pending.clear();
+            while (next_row < height && row_written(next_row)){
+                out += staged[next_row];
+                std::string().swap(staged[next_row]);
+                next_row++;
+            }
+            const char* data = out.data();
+            size_t left = out.size();
+            while (left > 0){
+                ssize_t n = ::write(file.descriptor(), data, left);
+                if (n < 0 && errno == EINTR){
+                    continue;
+                }
+                if (n <= 0){
+                    std::cerr << "ImageWriter: write failed: " << std::strerror(errno) << '\n';
+                    return;
+                }
+                data += n;
+                left -= n;
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "helper.h"
+#include "sampler.h"
+#include "hittable_list.h"
+#include "material.h"
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+/*
+IrradianceCache class
+
+Irradiance at sparse points on diffuse surfaces (Ward's irradiance caching), reused by the diffuse hits around them
+Every record keeps the irradiance arriving at its point and normal and a radius R, the harmonic mean distance to
+the surfaces its rays hit: close to walls and corners the light changes quickly and a record only covers a small area,
+in the middle of an open floor it covers a large one
+
+lookup : weighted average of the records valid at (p, n), false if there is none (the caller then computes one and inserts it)
+         record i counts with weight 1 / (|p - p_i| / R_i + sqrt(1 - n . n_i)) when that error is below accuracy
+         and p is not behind it, so accuracy trades bias (larger = blurrier, fewer records) against cost
+insert : add a record, from any thread, while others look up
+radiance : all light leaving a diffuse hit, from the records around it or a new one traced on the spot with the
+           renderer's path tracer (PathTracer, without the cache so a record never reads other records)
+
+records live in a hash grid of cubes of the largest validity radius, a record is listed in every cell its validity sphere
+overlaps so a lookup only reads the cell p is in
+the grid is an open addressing table of cells (fixed number of slots) holding lists of records, lookups take no lock:
+inserts are rare, serialised by a mutex and publish every cell and list node with a release store after writing it,
+records and nodes sit in deques so they never move once readers can see them
+*/
+
+class IrradianceCache {
+    public:
+        struct Record {
+            point3 p;
+            vec3 normal;
+            colour irradiance;
+            double radius;      //harmonic mean distance of the surfaces seen from p, clamped to [min, max]
+        };
+
+        //slots bounds the number of grid cells (power of two), records that find the table full are not kept
+        IrradianceCache(double accuracy, double min_radius, double max_radius, size_t slots = size_t(1) << 20)
+            : accuracy(accuracy), min_radius(min_radius), max_radius(max_radius), cell_size(std::max(accuracy * max_radius, 1e-9)),
+              mask(slots - 1), table(new Slot[slots]()) {}
+
+        //radius of a new record at a point whose rays hit surfaces at the given harmonic mean distance
+        double clamp_radius(double harmonic_mean) const {
+            return std::clamp(harmonic_mean, min_radius, max_radius);
+        }
+
+        bool lookup(const point3& p, const vec3& normal, colour& irradiance) const {
+            lookups.fetch_add(1, std::memory_order_relaxed);
+            const Slot* slot = find(key(cell_of(p)));
+            if (slot == nullptr){
+                return false;
+            }
+            colour sum(0, 0, 0);
+            double total = 0;
+            for (const Node* node = slot->head.load(std::memory_order_acquire); node != nullptr; node = node->next){
+                double w = weight(*node->record, p, normal);
+                if (w > 0){
+                    sum += w * node->record->irradiance;
+                    total += w;
+                }
+            }
+            if (total <= 0){
+                return false;
+            }
+            hits.fetch_add(1, std::memory_order_relaxed);
+            irradiance = sum / total;
+            return true;
+        }
+
+        void insert(const Record& record){
+            double reach = accuracy * record.radius;
+            glm::ivec3 lo = cell_of(record.p - vec3(reach)), hi = cell_of(record.p + vec3(reach));
+            std::lock_guard lock(mutex);
+            const Record* stored = &records.emplace_back(record);
+            for (int x = lo.x; x <= hi.x; x++){
+                for (int y = lo.y; y <= hi.y; y++){
+                    for (int z = lo.z; z <= hi.z; z++){
+                        Slot* slot = claim(key(glm::ivec3(x, y, z)));
+                        if (slot != nullptr){
+                            Node* node = &nodes.emplace_back(Node{stored, slot->head.load(std::memory_order_relaxed)});
+                            slot->head.store(node, std::memory_order_release);
+                        }
+                    }
+                }
+            }
+        }
+
+        size_t size() const {
+            std::lock_guard lock(mutex);
+            return records.size();
+        }
+
+        //share of lookups answered from the cache so far
+        double hit_rate() const {
+            uint64_t n = lookups.load(std::memory_order_relaxed);
+            return n == 0 ? 0.0 : double(hits.load(std::memory_order_relaxed)) / n;
+        }
+
+        //all light (direct and indirect) leaving a diffuse hit where a path ends, depth hits were left to the path
+        template <class Tracer>
+        colour radiance(const Tracer& tracer, const hit_record& rec, const material& mat, int depth, const hittable_list& world){
+            //a path with one hit left gets nothing more here either (see PathTracer::shade)
+            if (depth <= 1){
+                return colour(0, 0, 0);
+            }
+            colour irradiance;
+            if (!lookup(rec.p, rec.normal, irradiance)){
+                Record record = trace_record(tracer, rec, depth, world);
+                insert(record);
+                irradiance = record.irradiance;
+            }
+            //eval along the normal is the diffuse bsdf (cosine 1)
+            return mat.eval(rec, rec.normal) * irradiance;
+        }
+
+    private:
+        struct Node {
+            const Record* record;
+            const Node* next;
+        };
+
+        //key 0 = free, a claimed slot keeps its key for good
+        struct Slot {
+            std::atomic<uint64_t> key;
+            std::atomic<const Node*> head;
+        };
+
+        double accuracy, min_radius, max_radius, cell_size;
+        size_t mask;
+        std::unique_ptr<Slot[]> table;
+
+        mutable std::mutex mutex;
+        std::deque<Record> records;
+        std::deque<Node> nodes;
+        mutable std::atomic<uint64_t> lookups{0}, hits{0};
+
+        //new record at a diffuse hit: the light a white diffuse surface there would reflect,
+        //from tracer.irradiance_cache_rays cosine weighted paths (without the cache) that also sample the lights, times pi
+        //its random numbers come from its position, so a record at the same point always gets the same value
+        template <class Tracer>
+        Record trace_record(const Tracer& tracer, const hit_record& rec, int depth, const hittable_list& world) const {
+            const int rays = tracer.irradiance_cache_rays;
+            uint64_t bits[3];
+            std::memcpy(bits, &rec.p, sizeof(bits));
+            auto sampler = make_sampler(tracer.sampler_type, rays, hash_sample(tracer.seed, bits[0] ^ mix_bits(bits[1]), bits[2]));
+            const lambertian white(colour(1, 1, 1));
+            colour sum(0, 0, 0);
+            double inverse_distance = 0;
+            for (int i = 0; i < rays; i++){
+                sampler->start_pixel_sample(0, 0, i);
+                if (tracer.direct_lighting()){
+                    Ray shadow;
+                    interval range;
+                    colour contribution;
+                    if (tracer.sample_direct(rec, white, colour(1, 1, 1), *sampler, shadow, range, contribution) && !world.occluded(shadow, range)){
+                        sum += contribution;
+                    }
+                }
+
+                //bsdf * cosine / pdf is 1 for cosine weighted directions on a white surface
+                vec3 direction = rec.normal + sample_unit_sphere(sampler->get_2D());
+                if (near_zero(direction)){
+                    direction = rec.normal;
+                }
+                Ray r(rec.p, glm::normalize(direction));
+                double pdf = white.pdf(rec, r.direction());
+                hit_record hit;
+                if (!world.hit(r, interval(Tracer::ray_epsilon, infinity), hit)){
+                    sum += tracer.environment_weight(r, pdf) * tracer.background(r);
+                    continue;
+                }
+                inverse_distance += 1.0 / hit.t;
+                if (hit.mat->emissive){
+                    sum += tracer.emission_weight(r, rec.normal, hit, pdf) * hit.mat->emitted();
+                    continue;
+                }
+                sum += tracer.shade(r, hit, depth - 1, world, *sampler, false);
+            }
+            colour irradiance = sum * (pi / rays);
+            double radius = clamp_radius(inverse_distance > 0 ? rays / inverse_distance : infinity);
+            return Record{rec.p, rec.normal, irradiance, radius};
+        }
+
+        const Slot* find(uint64_t key) const {
+            for (size_t i = mix_bits(key) & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++){
+                uint64_t k = table[i].key.load(std::memory_order_acquire);
+                if (k == key){
+                    return &table[i];
+                }
+                if (k == 0){
+                    return nullptr;
+                }
+            }
+            return nullptr;
+        }
+
+        //slot of the cell, taken if it has none yet (mutex held), nullptr when the table is full
+        Slot* claim(uint64_t key){
+            for (size_t i = mix_bits(key) & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++){
+                uint64_t k = table[i].key.load(std::memory_order_relaxed);
+                if (k == key){
+                    return &table[i];
+                }
+                if (k == 0){
+                    table[i].key.store(key, std::memory_order_release);
+                    return &table[i];
+                }
+            }
+            return nullptr;
+        }
+
+        //Ward's weight, 0 where the record is not valid
+        double weight(const Record& record, const point3& p, const vec3& normal) const {
+            vec3 offset = p - record.p;
+            double cosine = glm::dot(normal, record.normal);
+            if (cosine <= 0){
+                return 0;
+            }
+            //p in front of the record's surface only (a record behind a corner sees different light)
+            if (glm::dot(offset, normal + record.normal) < -0.1 * record.radius){
+                return 0;
+            }
+            double error = glm::length(offset) / record.radius + std::sqrt(std::max(0.0, 1.0 - cosine));
+            if (error >= accuracy){
+                return 0;
+            }
+            return 1.0 / std::max(error, 1e-6);
+        }
+
+        glm::ivec3 cell_of(const point3& p) const {
+            return glm::ivec3(glm::floor(p / cell_size));
+        }
+
+        //21 bits per axis, never 0 (the free key)
+        static uint64_t key(const glm::ivec3& c){
+            return (uint64_t(1) << 63) | (uint64_t(uint32_t(c.x) & 0x1fffff) << 42) | (uint64_t(uint32_t(c.y) & 0x1fffff) << 21) | uint64_t(uint32_t(c.z) & 0x1fffff);
+        }
+};
+
+#endif
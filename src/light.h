@@ -0,0 +1,407 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "hittable.h"
+#include "material.h"
+#include "alias_table.h"
+#include <unordered_map>
+#include <vector>
+
+/*
+Light hierarchy
+
+LightBounds : what a group of lights looks like from far away
+    bounds + total power + a cone around axis holding every emitting normal (theta_o) widened by how far off the normal
+    the lights still emit (theta_e, pi/2 for area lights)
+    importance(p, n) is a conservative estimate of the light the group sends to a point p with normal n (distance,
+    the best angle anything inside the bounds can have towards p, and the cosine at p)
+
+LightList class
+
+Area lights (spheres / triangles with a diffuse_light material) the integrator samples directly at every diffuse hit
+(next event estimation). The same objects have to be in the world too, so rays that hit them by scattering see them
+and the two ways of finding a light are weighted against each other (multiple importance sampling)
+
+The lights are kept in a binary tree of LightBounds (a light BVH) split by the surface area orientation heuristic
+choose walks it from the root, picking a child with probability proportional to its importance for the shading point,
+so a light is chosen roughly in proportion to what it contributes at a cost logarithmic in the number of lights
+pmf repeats that walk along the path to a given light (stored as one bit per level) to get the probability for MIS
+sample_emitter picks a light in proportion to its power alone (where photons start)
+
+build() has to run after the last add and before choose / pmf (PathTracer::prepare calls it)
+
+LightSample : a point on an area light (area measure) or a direction of the environment map (solid angle)
+*/
+
+//cone of unit directions around w, cos_theta = cosine of the half angle (-1 = every direction)
+struct DirectionCone {
+    vec3 w;
+    double cos_theta;
+};
+
+inline double safe_sqrt(double x){
+    return std::sqrt(std::max(0.0, x));
+}
+
+inline double safe_acos(double x){
+    return std::acos(std::clamp(x, -1.0, 1.0));
+}
+
+//angle between unit vectors (accurate for nearly parallel ones as well)
+inline double angle_between(const vec3& a, const vec3& b){
+    if (glm::dot(a, b) < 0){
+        return pi - 2.0 * std::asin(std::min(1.0, glm::length(a + b) / 2.0));
+    }
+    return 2.0 * std::asin(std::min(1.0, glm::length(b - a) / 2.0));
+}
+
+//smallest cone holding both cones
+inline DirectionCone cone_union(const DirectionCone& a, const DirectionCone& b){
+    if (a.cos_theta <= -1){
+        return a;
+    }
+    if (b.cos_theta <= -1){
+        return b;
+    }
+    double theta_a = safe_acos(a.cos_theta);
+    double theta_b = safe_acos(b.cos_theta);
+    double theta_d = angle_between(a.w, b.w);
+    if (std::min(theta_d + theta_b, pi) <= theta_a){
+        return a;
+    }
+    if (std::min(theta_d + theta_a, pi) <= theta_b){
+        return b;
+    }
+
+    double theta_o = (theta_a + theta_d + theta_b) / 2.0;
+    vec3 axis = glm::cross(a.w, b.w);
+    if (theta_o >= pi || glm::length2(axis) == 0){
+        return DirectionCone{a.w, -1};
+    }
+
+    //rotate a.w towards b.w by theta_o - theta_a (Rodrigues, axis is perpendicular to a.w)
+    double theta_r = theta_o - theta_a;
+    axis = glm::normalize(axis);
+    vec3 w = a.w * std::cos(theta_r) + glm::cross(axis, a.w) * std::sin(theta_r);
+    return DirectionCone{glm::normalize(w), std::cos(theta_o)};
+}
+
+//cos(theta_a - theta_b) and sin(theta_a - theta_b), clamped to an angle of 0 when theta_a < theta_b
+inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b){
+    return cos_a > cos_b ? 1.0 : cos_a * cos_b + sin_a * sin_b;
+}
+
+inline double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b){
+    return cos_a > cos_b ? 0.0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+struct LightBounds {
+    Bounds bounds;
+    DirectionCone normals;
+    double phi;             //power
+    double cos_theta_e;
+    bool two_sided;
+
+    LightBounds(const Bounds& bounds, const DirectionCone& normals, double phi, double cos_theta_e, bool two_sided)
+        : bounds(bounds), normals(normals), phi(phi), cos_theta_e(cos_theta_e), two_sided(two_sided) {}
+
+    point3 centroid() const {
+        return (bounds.min + bounds.max) * 0.5;
+    }
+
+    double importance(const point3& p, const vec3& n) const {
+        point3 pc = centroid();
+        vec3 to_p = p - pc;
+        double dist2 = glm::length2(to_p);
+        //distances inside the bounds say nothing, don't let them blow up
+        double d2 = std::max(dist2, glm::length(bounds.max - bounds.min) / 2.0);
+
+        //angle between the cone axis and the direction to p, minus what the cone and the bounds can make up for
+        vec3 wi = dist2 > 0 ? to_p / std::sqrt(dist2) : normals.w;
+        double cos_w = glm::dot(normals.w, wi);
+        if (two_sided){
+            cos_w = std::fabs(cos_w);
+        }
+        double sin_w = safe_sqrt(1.0 - cos_w*cos_w);
+
+        //cone from p around the direction to pc that holds the bounds (through their bounding sphere)
+        double radius2 = glm::length2(bounds.max - pc);
+        double cos_b = dist2 < radius2 ? -1.0 : safe_sqrt(1.0 - radius2 / dist2);
+        double sin_b = safe_sqrt(1.0 - cos_b*cos_b);
+
+        double cos_o = normals.cos_theta;
+        double sin_o = safe_sqrt(1.0 - cos_o*cos_o);
+        double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+        double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+        double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+        if (cos_p <= cos_theta_e){
+            return 0;
+        }
+
+        double importance = phi * cos_p / d2;
+        if (n != vec3(0, 0, 0)){
+            double cos_i = std::fabs(glm::dot(wi, n));
+            double sin_i = safe_sqrt(1.0 - cos_i*cos_i);
+            importance *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+        }
+        return std::max(importance, 0.0);
+    }
+};
+
+inline LightBounds light_bounds_union(const LightBounds& a, const LightBounds& b){
+    return LightBounds(Union(a.bounds, b.bounds), cone_union(a.normals, b.normals), a.phi + b.phi,
+                       std::min(a.cos_theta_e, b.cos_theta_e), a.two_sided || b.two_sided);
+}
+
+struct LightSample {
+    point3 p;               //point on the light, or the direction for the environment
+    vec3 normal;
+    colour emitted;
+    bool environment;
+};
+
+class LightList {
+    public:
+        void add(shared_ptr<hittable> light){
+            lights.push_back(light);
+            nodes.clear();
+        }
+
+        bool empty() const { return lights.empty(); }
+        size_t size() const { return lights.size(); }
+
+        void build(){
+            nodes.clear();
+            trails.clear();
+            std::vector<std::pair<int, LightBounds>> items;
+            std::vector<double> power(lights.size(), 0.0);
+            for (size_t k = 0; k < lights.size(); k++){
+                emitter_shape shape;
+                if (!lights[k]->describe_emitter(shape)){
+                    std::cerr << "Light " << k << " is not a shape that can be sampled, ignored\n";
+                    continue;
+                }
+                double phi = pi * shape.area * luminance(shape.mat->emitted()) * (shape.two_sided ? 2.0 : 1.0);
+                power[k] = phi;
+                if (phi > 0){
+                    items.emplace_back(int(k), LightBounds(lights[k]->BoundingBox(), DirectionCone{shape.axis, shape.cos_theta_o},
+                                                           phi, std::cos(pi / 2.0), shape.two_sided));
+                }
+            }
+            if (!items.empty()){
+                nodes.reserve(2 * items.size() - 1);
+                build_node(items, 0, int(items.size()), 0, 0);
+            }
+            by_power = AliasTable(power);
+        }
+
+        //u uniform in [0, 1), nullptr if no light emits anything
+        const hittable* sample_emitter(double u, double& pmf) const {
+            if (by_power.empty()){
+                pmf = 0;
+                return nullptr;
+            }
+            return lights[by_power.sample(u, pmf)].get();
+        }
+
+        //u uniform in [0, 1), nullptr if no light can reach p
+        const hittable* choose(const point3& p, const vec3& n, double u, double& pmf) const {
+            pmf = 0;
+            if (nodes.empty()){
+                return nullptr;
+            }
+            int node = 0;
+            double probability = 1;
+            while (nodes[node].light < 0){
+                double first = nodes[node + 1].bounds.importance(p, n);
+                double second = nodes[nodes[node].second].bounds.importance(p, n);
+                if (first == 0 && second == 0){
+                    return nullptr;
+                }
+                double p_first = first / (first + second);
+                if (u < p_first){
+                    node = node + 1;
+                    u = std::min(u / p_first, one_minus_epsilon);
+                    probability *= p_first;
+                } else {
+                    node = nodes[node].second;
+                    u = std::min((u - p_first) / (1.0 - p_first), one_minus_epsilon);
+                    probability *= 1.0 - p_first;
+                }
+            }
+            //a single light (no siblings to compare with) still has to be able to reach p
+            if (node == 0 && nodes[0].bounds.importance(p, n) == 0){
+                return nullptr;
+            }
+            pmf = probability;
+            return lights[nodes[node].light].get();
+        }
+
+        //whether light is one of the lights that emit anything (sample_emitter can return it)
+        bool contains(const hittable* light) const {
+            return trails.count(light) > 0;
+        }
+
+        //probability choose(p, n, ...) returns light
+        double pmf(const point3& p, const vec3& n, const hittable* light) const {
+            auto found = trails.find(light);
+            if (found == trails.end()){
+                return 0;
+            }
+            uint64_t trail = found->second;
+            int node = 0;
+            double probability = 1;
+            while (nodes[node].light < 0){
+                double first = nodes[node + 1].bounds.importance(p, n);
+                double second = nodes[nodes[node].second].bounds.importance(p, n);
+                if (first == 0 && second == 0){
+                    return 0;
+                }
+                if (trail & 1){
+                    probability *= second / (first + second);
+                    node = nodes[node].second;
+                } else {
+                    probability *= first / (first + second);
+                    node = node + 1;
+                }
+                trail >>= 1;
+            }
+            if (node == 0 && nodes[0].bounds.importance(p, n) == 0){
+                return 0;
+            }
+            return probability;
+        }
+
+    private:
+        //first child directly follows its parent, light >= 0 marks a leaf (one light per leaf)
+        struct Node {
+            LightBounds bounds;
+            int second;
+            int light;
+        };
+
+        static constexpr int buckets = 12;
+
+        std::vector<shared_ptr<hittable>> lights;
+        std::vector<Node> nodes;
+        AliasTable by_power;
+        //path from the root to every light's leaf, bit d = took the second child at depth d
+        std::unordered_map<const hittable*, uint64_t> trails;
+
+        int build_node(std::vector<std::pair<int, LightBounds>>& items, int begin, int end, uint64_t trail, int depth){
+            int index = int(nodes.size());
+            if (end - begin == 1){
+                nodes.push_back(Node{items[begin].second, -1, items[begin].first});
+                trails[lights[items[begin].first].get()] = trail;
+                return index;
+            }
+
+            LightBounds total = items[begin].second;
+            Bounds centroids(total.centroid(), total.centroid());
+            for (int k = begin + 1; k < end; k++){
+                total = light_bounds_union(total, items[k].second);
+                centroids = Union(centroids, Bounds(items[k].second.centroid(), items[k].second.centroid()));
+            }
+
+            int mid = split(items, begin, end, total.bounds, centroids, depth);
+            nodes.push_back(Node{total, -1, -1});
+            build_node(items, begin, mid, trail, depth + 1);
+            int second = build_node(items, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+            nodes[index].second = second;
+            return index;
+        }
+
+        //surface area orientation heuristic over buckets of centroids on every axis, returns where the second child starts
+        //(the median past depth 32 so trails always fit 64 bits)
+        int split(std::vector<std::pair<int, LightBounds>>& items, int begin, int end, const Bounds& bounds, const Bounds& centroids, int depth) const {
+            double best_cost = infinity;
+            int best_axis = -1, best_bucket = -1;
+            vec3 extent = centroids.max - centroids.min;
+            if (depth < 32){
+                for (int axis = 0; axis < 3; axis++){
+                    if (extent[axis] <= 0){
+                        continue;
+                    }
+                    //bounds of every bucket, then of every run of buckets below / above each split
+                    std::vector<Group> bucket(buckets, Group{false, items[begin].second});
+                    for (int k = begin; k < end; k++){
+                        merge(bucket[bucket_of(items[k].second, centroids, axis)], Group{true, items[k].second});
+                    }
+                    std::vector<Group> below(bucket), above(bucket);
+                    for (int b = 1; b < buckets; b++){
+                        merge(below[b], below[b - 1]);
+                        merge(above[buckets - 1 - b], above[buckets - b]);
+                    }
+                    for (int b = 0; b < buckets - 1; b++){
+                        double cost = group_cost(below[b], bounds, axis) + group_cost(above[b + 1], bounds, axis);
+                        if (cost < best_cost){
+                            best_cost = cost;
+                            best_axis = axis;
+                            best_bucket = b;
+                        }
+                    }
+                }
+            }
+
+            if (best_axis < 0){
+                int mid = (begin + end) / 2;
+                int axis = bounds.largest();
+                std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [axis](const auto& a, const auto& b){
+                    return a.second.centroid()[axis] < b.second.centroid()[axis];
+                });
+                return mid;
+            }
+            auto middle = std::partition(items.begin() + begin, items.begin() + end, [&](const auto& item){
+                return bucket_of(item.second, centroids, best_axis) <= best_bucket;
+            });
+            int mid = int(middle - items.begin());
+            return (mid == begin || mid == end) ? (begin + end) / 2 : mid;
+        }
+
+        static int bucket_of(const LightBounds& b, const Bounds& centroids, int axis){
+            double offset = (b.centroid()[axis] - centroids.min[axis]) / (centroids.max[axis] - centroids.min[axis]);
+            return std::clamp(int(buckets * offset), 0, buckets - 1);
+        }
+
+        //LightBounds of a possibly empty group of lights
+        struct Group {
+            bool any;
+            LightBounds side;
+        };
+
+        static void merge(Group& into, const Group& other){
+            if (other.any){
+                into.side = into.any ? light_bounds_union(into.side, other.side) : other.side;
+                into.any = true;
+            }
+        }
+
+        //cost of a group: power * solid angle measure of the cone * surface area, stretched for thin splits of wide nodes
+        static double group_cost(const Group& group, const Bounds& bounds, int axis){
+            if (!group.any){
+                return 0;
+            }
+            const LightBounds& side = group.side;
+
+            double theta_o = safe_acos(side.normals.cos_theta);
+            double theta_e = safe_acos(side.cos_theta_e);
+            double theta_w = std::min(theta_o + theta_e, pi);
+            double sin_o = safe_sqrt(1.0 - side.normals.cos_theta * side.normals.cos_theta);
+            double m_omega = 2.0 * pi * (1.0 - side.normals.cos_theta)
+                           + pi / 2.0 * (2.0 * theta_w * sin_o - std::cos(theta_o - 2.0 * theta_w) - 2.0 * theta_o * sin_o + side.normals.cos_theta);
+
+            vec3 diagonal = bounds.max - bounds.min;
+            double regularise = diagonal[axis] > 0 ? std::max({diagonal.x, diagonal.y, diagonal.z}) / diagonal[axis] : 1.0;
+            return side.phi * m_omega * regularise * side.bounds.SurfaceArea();
+        }
+};
+
+//weight of a sample taken with density a when density b could also have produced it (power heuristic, exponent 2)
+inline double power_heuristic(double a, double b){
+    if (a <= 0){
+        return 0;
+    }
+    return a*a / (a*a + b*b);
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef LIGHT_TRACING_H
+#define LIGHT_TRACING_H
+
+#include "path_tracer.h"
+#include "framebuffer.h"
+#include <atomic>
+
+/*
+LightTracer class
+
+Caustics by light tracing: paths start on the area lights like photons (photon_map.h), and every diffuse hit they make after
+passing through glass or mirrors is connected to the (pinhole) camera and splatted onto the pixel it projects to (SplatBuffer)
+Camera paths leave exactly those paths to them (PathTracer::light_traced_caustics), the camera adds the splats to every tile
+before writing it
+
+The camera's geometry is given as in Camera: its center, the center of pixel (0, 0) and the steps between pixels
+*/
+
+class LightTracer {
+    public:
+        //separates the random sequence of the light paths from the camera paths' of the same sample index
+        static constexpr uint64_t salt = 0xbf58476d1ce4e5b9ull;
+
+        LightTracer(const PathTracer& tracer, const point3& center, const point3& pixel00_loc, const vec3& pixel_delta_u, const vec3& pixel_delta_v,
+                    int width, int height)
+            : tracer(tracer), center(center), pixel00_loc(pixel00_loc), pixel_delta_u(pixel_delta_u), pixel_delta_v(pixel_delta_v),
+              width(width), height(height) {}
+
+        //shoot this frame's light paths (paths of them) from the tracer's (already built) light list and splat their camera connections
+        shared_ptr<SplatBuffer> trace(const hittable_list& world, int paths) const {
+            auto start = steady_clock::now();
+            auto image = std::make_shared<SplatBuffer>(width, height);
+            std::atomic<uint64_t> splats{0};
+            ThreadPool::global().parallel_for(0, paths, 1024, [&](int64_t lo, int64_t hi){
+                auto sampler = make_sampler(tracer.sampler_type, paths, tracer.seed ^ salt);
+                uint64_t count = 0;
+                for (int64_t k = lo; k < hi; k++){
+                    sampler->start_pixel_sample(0, 0, int(k));
+                    count += trace_path(world, paths, *sampler, *image);
+                }
+                splats.fetch_add(count, std::memory_order_relaxed);
+            });
+            double seconds = duration<double>(steady_clock::now() - start).count();
+            std::clog << "Light tracing: " << paths << " paths, " << splats.load() << " splats in " << 1e3 * seconds << " ms ("
+                      << splats.load() / seconds / 1e6 << " Msplats/s)\n";
+            return image;
+        }
+
+    private:
+        const PathTracer& tracer;
+        point3 center;
+        point3 pixel00_loc;
+        vec3 pixel_delta_u;
+        vec3 pixel_delta_v;
+        int width, height;
+
+        //one light path, started on a light like a photon (photon_map.h), power already divided by paths
+        //once it has passed through glass or mirrors every diffuse hit is connected to the camera (splat),
+        //a path that reaches a diffuse surface straight from the light is left to the camera paths
+        //the light counts as one of the max_depth hits of a camera path, so a connection is made from at most max_depth - 1 hits
+        //returns the number of splats
+        int trace_path(const hittable_list& world, int paths, Sampler& sampler, SplatBuffer& image) const {
+            double u = sampler.get_1D();
+            glm::dvec2 u_point = sampler.get_2D();
+            glm::dvec2 u_direction = sampler.get_2D();
+            double u_side = sampler.get_1D();
+
+            double pmf;
+            const hittable* light = tracer.lights.sample_emitter(u, pmf);
+            emitter_shape shape;
+            point3 origin;
+            vec3 normal;
+            if (light == nullptr || !light->describe_emitter(shape) || !light->sample_point(u_point, origin, normal)){
+                return 0;
+            }
+            if (shape.two_sided && u_side < 0.5){
+                normal = -normal;
+            }
+            vec3 direction = normal + sample_unit_sphere(u_direction);
+            if (near_zero(direction)){
+                direction = normal;
+            }
+            colour power = shape.mat->emitted() * (shape.area * pi * (shape.two_sided ? 2.0 : 1.0) / (pmf * paths));
+            Ray r(origin, direction);
+
+            bool specular = false;
+            int splats = 0;
+            for (int depth = 1; depth < tracer.max_depth; depth++){
+                hit_record rec;
+                if (!world.hit(r, interval(PathTracer::ray_epsilon, infinity), rec) || rec.mat->emissive || rec.mat->absorbs){
+                    return splats;
+                }
+                if (rec.mat->diffuse){
+                    if (!specular){
+                        return splats;
+                    }
+                    splats += splat(rec, power, world, image);
+                } else {
+                    specular = true;
+                }
+
+                Ray scattered;
+                colour attenuation;
+                if (!rec.mat->scatter(r, rec, attenuation, scattered, sampler)){
+                    return splats;
+                }
+                //Russian roulette on the attenuation keeps the path's power about constant
+                double survive = std::min(1.0, std::max({attenuation.x, attenuation.y, attenuation.z}));
+                if (sampler.get_1D() >= survive){
+                    return splats;
+                }
+                power *= attenuation / survive;
+                r = scattered;
+            }
+            return splats;
+        }
+
+        //connect a diffuse hit of a light path to the camera: the pixel it projects to gets
+        //power * bsdf * cosine * focal^2 / (pixel area * cos^3 off the view axis * squared distance), if nothing is in between
+        //(the light the hit sends towards the camera, averaged over the pixel like the camera rays of Camera::getRay)
+        int splat(const hit_record& rec, const colour& power, const hittable_list& world, SplatBuffer& image) const {
+            vec3 to_camera = center - rec.p;
+            double distance2 = glm::dot(to_camera, to_camera);
+            vec3 wo = to_camera / std::sqrt(distance2);
+            vec3 forward = glm::normalize(glm::cross(pixel_delta_u, pixel_delta_v));
+            double cos_theta = -glm::dot(wo, forward);
+            if (cos_theta <= 0){
+                return 0;
+            }
+
+            //where the ray from the camera to the hit crosses the image plane, in pixels
+            double focal = glm::dot(pixel00_loc - center, forward);
+            vec3 film = center - wo * (focal / cos_theta) - pixel00_loc;
+            double x = glm::dot(film, pixel_delta_u) / glm::dot(pixel_delta_u, pixel_delta_u) + 0.5;
+            double y = glm::dot(film, pixel_delta_v) / glm::dot(pixel_delta_v, pixel_delta_v) + 0.5;
+            if (x < 0 || y < 0 || x >= width || y >= height){
+                return 0;
+            }
+
+            colour f = rec.mat->eval(rec, wo);
+            if (f == colour(0, 0, 0) || world.occluded(Ray(rec.p, to_camera), interval(PathTracer::shadow_epsilon, 1 - PathTracer::shadow_epsilon))){
+                return 0;
+            }
+            double pixel_area = glm::length(pixel_delta_u) * glm::length(pixel_delta_v);
+            double importance = focal * focal / (pixel_area * cos_theta * cos_theta * cos_theta * distance2);
+            image.add(int(x), int(y), power * f * importance);
+            return 1;
+        }
+};
+
+
+#endif
@@ -7,6 +7,7 @@
 #include "threadpool.h"
 #include "material.h"
 #include "KDTree.h"
+#include "shared_scene.h"
 
 /*
 Base raytracer followed from Ray Tracing in One Weekend
@@ -14,11 +15,12 @@ Modified for multithreading + parsing objs + efficient file writing using buffer
 */
 
 inline void create_mesh(const char* file, hittable_list& world){
-    std::ifstream mesh(file);
+    //reads are issued ahead of the parser in large aligned chunks (see async_io.h)
+    LineReader mesh(file);
     auto no_material = make_shared<absorbing>();
 
     std::string line;
-    while(std::getline(mesh, line)){
+    while(mesh.getline(line)){
         if(line.empty())
             continue;
         double x1, y1, z1, x2, y2, z2, x3, y3, z3;
@@ -28,7 +30,72 @@ inline void create_mesh(const char* file, hittable_list& world){
     }
 }
 
-int main(){
+//--time-budget <seconds>: wall clock limit for the whole run (loading + rendering), 0 = none, samples_per_pixel stays the cap
+//--environment <file.pfm|file.hdr>: lat-long HDR map lighting the scene instead of the sky gradient
+//--preview <ao|albedo|normal|depth>: fast preview of what the camera sees instead of the full render (Camera::preview)
+struct Options {
+    double time_budget = 0;
+    std::string environment;
+    Preview preview = Preview::None;
+};
+
+inline Options parse_options(int argc, char** argv){
+    Options options;
+    for (int k = 1; k < argc; k++){
+        std::string arg = argv[k];
+        auto value_of = [&](const std::string& name, std::string& value){
+            if (arg == name && k + 1 < argc){
+                value = argv[++k];
+                return true;
+            }
+            if (arg.rfind(name + "=", 0) == 0){
+                value = arg.substr(name.size() + 1);
+                return true;
+            }
+            return false;
+        };
+
+        std::string value;
+        if (value_of("--time-budget", value)){
+            double seconds = -1;
+            try {
+                seconds = std::stod(value);
+            } catch (const std::exception&){
+            }
+            //inf or nan would overflow the deadline's clock ticks
+            if (!std::isfinite(seconds) || seconds < 0){
+                std::cerr << "Invalid time budget: " << value << '\n';
+                std::exit(2);
+            }
+            options.time_budget = seconds;
+        } else if (value_of("--environment", value)){
+            options.environment = value;
+        } else if (value_of("--preview", value)){
+            if (value == "ao"){
+                options.preview = Preview::AmbientOcclusion;
+            } else if (value == "albedo"){
+                options.preview = Preview::Albedo;
+            } else if (value == "normal"){
+                options.preview = Preview::Normal;
+            } else if (value == "depth"){
+                options.preview = Preview::Depth;
+            } else {
+                std::cerr << "Invalid preview: " << value << " (ao, albedo, normal or depth)\n";
+                std::exit(2);
+            }
+        } else {
+            std::cerr << "Unknown argument: " << arg << "\nUsage: raytracer [--time-budget <seconds>] [--environment <map.pfm|map.hdr>] [--preview <ao|albedo|normal|depth>] > image.ppm\n";
+            std::exit(2);
+        }
+    }
+    return options;
+}
+
+int main(int argc, char** argv){
+
+    auto program_start = steady_clock::now();
+    Options options = parse_options(argc, argv);
+    double time_budget = options.time_budget;
 
     #define parse 0
 
@@ -36,11 +103,40 @@ int main(){
         parse_obj("assets/dragon_vertices.obj", "assets/dragon_faces.obj");
     #endif
     
-    //make a list of hittable objects
-    hittable_list world;
-    create_mesh("dragon/dragon.txt", world);
+    #define shared_scene 0
+    #define numa 0
+    #define kdtree 0
 
-    //KDTree tree(world);
+    //make a list of hittable objects
+    #if shared_scene == 1
+        //first process loads the mesh + builds the tree and publishes them, later processes map them read-only
+        hittable_list world(SharedScene::attach_or_publish("/raytracer-dragon", make_shared<absorbing>(),
+            [](hittable_list& mesh) { create_mesh("dragon/dragon.txt", mesh); }));
+    #elif numa == 1
+        //pin one worker per physical core (round robin over sockets), load the mesh once and give every NUMA node
+        //its own copy of the triangles (and of the KD-Tree over them), allocated by a thread running on that node
+        ThreadPool::configure_global(Topology::get().pinned_cpus(true));
+        hittable_list loaded;
+        create_mesh("dragon/dragon.txt", loaded);
+        NumaReplicated<hittable_list> world([&loaded] {
+            hittable_list mesh;
+            for (const auto& object : loaded.objects){
+                mesh.add(make_shared<triangle>(static_cast<const triangle&>(*object)));
+            }
+            #if kdtree == 1
+                return hittable_list(make_shared<KDTree>(mesh));
+            #else
+                return mesh;
+            #endif
+        });
+    #else
+        hittable_list world;
+        create_mesh("dragon/dragon.txt", world);
+        #if kdtree == 1
+            //trace against a KD-Tree over the mesh instead of every triangle (needed for packet traversal, see packet_size)
+            world = hittable_list(make_shared<KDTree>(world));
+        #endif
+    #endif
 
     auto absorb = make_shared<absorbing>();
 
@@ -56,6 +152,12 @@ int main(){
     // world.add(make_shared<sphere>(point3( 0.0,    0.0, -1.2),   0.5, material_center));
     // world.add(make_shared<sphere>(point3(-1.0,    0.0, -1.0),   0.5, material_left));
     // world.add(make_shared<sphere>(point3( 1.0,    0.0, -1.0),   0.5, material_right));
+
+    //area light: in the world so rays can hit it, and in cam.lights (below) so every diffuse hit samples it
+    // auto light = make_shared<sphere>(point3(25, 20, 60), 5, make_shared<diffuse_light>(colour(10, 10, 10)));
+    // world.add(light);
+    //glass sphere for the light paths to focus into caustics
+    // world.add(make_shared<sphere>(point3(35, -25, 55), 10, make_shared<dielectric>(1.5)));
     
 
 
@@ -64,10 +166,42 @@ int main(){
     cam.image_width = 100;
     cam.max_depth = 1;
     cam.samples_per_pixel = 1;
+    // cam.lights.add(light);
+    //caustics and indirect light from photons shot by cam.lights (photon_map.h)
+    // cam.photon_mapping = true;
+    //diffuse interreflection from cached irradiance records instead of deeper bounces
+    // cam.irradiance_caching = true;
+    //diffuse bounces sampled from the light learned in earlier passes (needs adaptive or --time-budget)
+    // cam.path_guiding = true;
+    //direct light resampled from the candidates of neighbouring pixels and earlier passes (needs adaptive or --time-budget)
+    // cam.resampled_lighting = true;
+    //caustics through glass and mirrors from light paths splatted onto the image (plain renders only)
+    // cam.light_tracing = true;
+    //ambient occlusion, albedo, normal or depth of the camera rays' hits only, for quick layout checks (also --preview)
+    // cam.preview = Preview::AmbientOcclusion;
+    if (options.preview != Preview::None){
+        cam.preview = options.preview;
+    }
+
+    if (!options.environment.empty()){
+        try {
+            cam.environment = make_shared<EnvironmentMap>(options.environment);
+        } catch (const std::runtime_error& e){
+            std::cerr << e.what() << '\n';
+            return 2;
+        }
+    }
+
+    //the budget covers the whole job, so whatever loading the scene took is not available for rendering
+    //passes stop at samples_per_pixel as well, raise it for budgets long enough to take more
+    if (time_budget > 0){
+        cam.time_budget = time_budget;
+        cam.deadline = program_start + duration_cast<steady_clock::duration>(duration<double>(time_budget));
+    }
     cam.initialize();
 
-    //2d vector for storing colours
-    std::vector<std::vector<colour>> image(cam.image_height, std::vector<colour>(cam.image_width));
+    //framebuffer for storing colours (tiled like the renderer so each tile's pages are first touched by its worker)
+    Framebuffer image(cam.image_width, cam.image_height, cam.tile_size);
     auto start = high_resolution_clock::now();
 
     //cam.render(tree, image);
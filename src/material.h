@@ -2,6 +2,7 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "sampler.h"
 
 /*
 Abstract class for materials that an object/primitive will refer to
@@ -12,10 +13,40 @@ class material {
         //virtual destructor with default behaviour
         virtual ~material() = default;
 
-        //function to get scattering of ray
-        virtual bool scatter(const Ray& r, const hit_record& rec, colour& attenuation, Ray& scattered) const {
+        //never scatters, so integrators end the path here without calling scatter
+        bool absorbs = false;
+
+        //light source: the path ends here and picks up emitted()
+        bool emissive = false;
+
+        //has a bsdf that can be evaluated for any direction (eval / pdf), so light is sampled directly at its hits
+        //materials without one (mirrors) only scatter into the direction scatter picks
+        bool diffuse = false;
+
+        //function to get scattering of ray, random directions take their numbers from the sampler of the current path
+        virtual bool scatter(const Ray&, const hit_record&, colour&, Ray&, Sampler&) const {
             return false;
         }
+
+        //radiance leaving an emissive surface (both sides)
+        virtual colour emitted() const {
+            return colour(0, 0, 0);
+        }
+
+        //bsdf * cosine for light arriving from the unit direction wi
+        virtual colour eval(const hit_record&, const vec3&) const {
+            return colour(0, 0, 0);
+        }
+
+        //density (per solid angle) of scatter choosing direction wi (any length)
+        virtual double pdf(const hit_record&, const vec3&) const {
+            return 0;
+        }
+
+        //share of white light the surface reflects (albedo), for previews
+        virtual colour base_colour() const {
+            return colour(0, 0, 0);
+        }
 };
 
 
@@ -24,10 +55,13 @@ Randomly scatter light with some attenuation
 */
 class lambertian : public material {
     public:
-        lambertian(const colour& albedo) : albedo(albedo) {}
+        lambertian(const colour& albedo) : albedo(albedo) {
+            diffuse = true;
+        }
 
-        bool scatter(const Ray& r, const hit_record& rec, colour& attentuation, Ray& scattered) const override {
-            auto dir = rec.normal + rand_unit_vector();
+        bool scatter(const Ray&, const hit_record& rec, colour& attentuation, Ray& scattered, Sampler& sampler) const override {
+            //normal + uniform point on the unit sphere = cosine weighted direction
+            auto dir = rec.normal + sample_unit_sphere(sampler.get_2D());
 
             //method to avoid 0 direction
             if (near_zero(dir)){
@@ -39,6 +73,18 @@ class lambertian : public material {
             return true;
         }
 
+        colour eval(const hit_record& rec, const vec3& wi) const override {
+            return albedo * (std::max(0.0, glm::dot(rec.normal, wi)) / pi);
+        }
+
+        double pdf(const hit_record& rec, const vec3& wi) const override {
+            return std::max(0.0, glm::dot(rec.normal, glm::normalize(wi))) / pi;
+        }
+
+        colour base_colour() const override {
+            return albedo;
+        }
+
     private:
         colour albedo;
 };
@@ -46,7 +92,7 @@ class lambertian : public material {
 class metal: public material {
     public:
         metal(const colour& albedo) : albedo(albedo) {}
-        bool scatter(const Ray& r, const hit_record& rec, colour& attentuation, Ray& scattered) const override {
+        bool scatter(const Ray& r, const hit_record& rec, colour& attentuation, Ray& scattered, Sampler&) const override {
             
             vec3 reflected = reflect(r.direction(), rec.normal);
 
@@ -55,15 +101,79 @@ class metal: public material {
             return true;
         }
 
+        colour base_colour() const override {
+            return albedo;
+        }
+
     private:
         colour albedo;
         
 };
 
+/*
+Glass: reflects with the Fresnel probability (Schlick's approximation) and refracts otherwise,
+refraction_index is that of the inside relative to the outside (about 1.5 for glass)
+*/
+class dielectric : public material {
+    public:
+        dielectric(double refraction_index) : refraction_index(refraction_index) {}
+
+        bool scatter(const Ray& r, const hit_record& rec, colour& attenuation, Ray& scattered, Sampler& sampler) const override {
+            double eta = rec.front_face ? 1.0 / refraction_index : refraction_index;
+            vec3 unit_direction = glm::normalize(r.direction());
+            double cos_theta = std::min(glm::dot(-unit_direction, rec.normal), 1.0);
+            double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
+
+            //always takes the number, so the dimensions of the rest of the path do not depend on the choice
+            double u = sampler.get_1D();
+            if (eta * sin_theta > 1.0 || reflectance(cos_theta, eta) > u){
+                scattered = Ray(rec.p, reflect(unit_direction, rec.normal));
+            } else {
+                scattered = Ray(rec.p, refract(unit_direction, rec.normal, eta));
+            }
+            attenuation = colour(1, 1, 1);
+            return true;
+        }
+
+        colour base_colour() const override {
+            return colour(1, 1, 1);
+        }
+
+    private:
+        double refraction_index;
+
+        static double reflectance(double cosine, double eta){
+            auto r0 = (1 - eta) / (1 + eta);
+            r0 = r0*r0;
+            return r0 + (1 - r0)*std::pow(1 - cosine, 5);
+        }
+};
+
+/*
+Area light: put it on spheres or triangles and add those to the camera's lights as well as to the world
+*/
+class diffuse_light : public material {
+    public:
+        diffuse_light(const colour& emission) : emission(emission) {
+            emissive = true;
+        }
+
+        colour emitted() const override {
+            return emission;
+        }
+
+    private:
+        colour emission;
+};
+
 //absorbing material
 class absorbing : public material {
     public:
-        bool scatter(const Ray& r, const hit_record& rec, colour& attenuation, Ray& scattered) const override {
+        absorbing(){
+            absorbs = true;
+        }
+
+        bool scatter(const Ray&, const hit_record&, colour&, Ray&, Sampler&) const override {
             return false;
         }
     };
@@ -0,0 +1,261 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+CPU topology + NUMA helpers (Linux, read from /sys)
+
+Topology
+- cpus        : every online cpu with its socket (package), physical core and NUMA node
+- pinned_cpus : cpu list for pinning workers, spread over sockets, optionally one cpu per physical core (no SMT siblings)
+- current_node: NUMA node of the cpu the calling thread is running on
+- package_of_node: socket a NUMA node belongs to (one socket has several nodes with sub-NUMA clustering)
+
+NumaReplicated<T>
+- one copy of a read-only object per NUMA node, each built by a thread pinned to that node
+  so its memory is first touched (and allocated) on that node
+- local() returns the copy for the node the calling thread runs on
+*/
+
+struct CpuInfo {
+    int cpu;
+    int package;
+    int core;
+    int node;
+};
+
+//parse a cpulist like "0-3,8,10-11"
+inline std::vector<int> parse_cpu_list(const std::string& list){
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size()){
+        size_t comma = list.find(',', pos);
+        std::string range = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+            for (int c = first; c <= last; c++){
+                cpus.push_back(c);
+            }
+        } catch (const std::exception&){
+            //blank or malformed entry, skip it
+        }
+        if (comma == std::string::npos){
+            break;
+        }
+        pos = comma + 1;
+    }
+    return cpus;
+}
+
+inline std::string read_sys_file(const std::string& path){
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    return value;
+}
+
+class Topology {
+    public:
+        std::vector<CpuInfo> cpus;
+        int num_nodes = 1;
+
+        static const Topology& get(){
+            static Topology topology = detect();
+            return topology;
+        }
+
+        static Topology detect(){
+            Topology topology;
+            std::vector<int> online = parse_cpu_list(read_sys_file("/sys/devices/system/cpu/online"));
+            if (online.empty()){
+                for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++){
+                    online.push_back(c);
+                }
+            }
+
+            //cpu -> node from the node directories (missing on kernels without NUMA, everything is node 0 then)
+            std::vector<int> node_of(*std::max_element(online.begin(), online.end()) + 1, 0);
+            for (int node = 0; node < 1024; node++){
+                std::string list = read_sys_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                if (list.empty()){
+                    if (node > 0){
+                        break;
+                    }
+                    continue;
+                }
+                topology.num_nodes = node + 1;
+                for (int cpu : parse_cpu_list(list)){
+                    if (cpu < int(node_of.size())){
+                        node_of[cpu] = node;
+                    }
+                }
+            }
+
+            for (int cpu : online){
+                std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+                CpuInfo info{cpu, 0, cpu, node_of[cpu]};
+                std::string package = read_sys_file(base + "physical_package_id");
+                std::string core = read_sys_file(base + "core_id");
+                if (!package.empty()) info.package = std::stoi(package);
+                if (!core.empty()) info.core = std::stoi(core);
+                topology.cpus.push_back(info);
+            }
+            return topology;
+        }
+
+        //cpus to pin workers to: round robin over sockets so a partial pool still uses every socket's memory bandwidth
+        //skip_smt keeps only the first hardware thread of each physical core
+        std::vector<int> pinned_cpus(bool skip_smt) const {
+            std::vector<std::vector<int>> per_package;
+            std::vector<std::pair<int, int>> seen_cores;
+            for (const CpuInfo& info : cpus){
+                if (skip_smt){
+                    auto key = std::make_pair(info.package, info.core);
+                    if (std::find(seen_cores.begin(), seen_cores.end(), key) != seen_cores.end()){
+                        continue;
+                    }
+                    seen_cores.push_back(key);
+                }
+                if (info.package >= int(per_package.size())){
+                    per_package.resize(info.package + 1);
+                }
+                per_package[info.package].push_back(info.cpu);
+            }
+
+            std::vector<int> order;
+            for (size_t k = 0; order.size() < cpus.size(); k++){
+                bool any = false;
+                for (const auto& package : per_package){
+                    if (k < package.size()){
+                        order.push_back(package[k]);
+                        any = true;
+                    }
+                }
+                if (!any){
+                    break;
+                }
+            }
+            return order;
+        }
+
+        std::vector<int> cpus_of_node(int node) const {
+            std::vector<int> result;
+            for (const CpuInfo& info : cpus){
+                if (info.node == node){
+                    result.push_back(info.cpu);
+                }
+            }
+            return result;
+        }
+
+        int node_of_cpu(int cpu) const {
+            for (const CpuInfo& info : cpus){
+                if (info.cpu == cpu){
+                    return info.node;
+                }
+            }
+            return 0;
+        }
+
+        //socket (package) a node belongs to, sub-NUMA clustering splits one socket into several nodes
+        int package_of_node(int node) const {
+            for (const CpuInfo& info : cpus){
+                if (info.node == node){
+                    return info.package;
+                }
+            }
+            return 0;
+        }
+
+        static int current_node(){
+            unsigned cpu = 0, node = 0;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0){
+                return 0;
+            }
+            return node;
+        }
+};
+
+//pin the calling thread to a set of cpus, false if the kernel refused (e.g. cpu outside our cgroup)
+inline bool pin_current_thread(const std::vector<int>& cpus){
+    if (cpus.empty()){
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus){
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+
+template <typename T>
+class NumaReplicated {
+    public:
+        //build one copy per node, each on a thread pinned to that node (the builds run in parallel)
+        explicit NumaReplicated(const std::function<T()>& build){
+            const Topology& topology = Topology::get();
+            replicas.resize(topology.num_nodes);
+            std::vector<std::thread> builders;
+            for (int node = 0; node < topology.num_nodes; node++){
+                std::vector<int> cpus = topology.cpus_of_node(node);
+                if (cpus.empty()){
+                    continue;
+                }
+                builders.emplace_back([this, node, cpus, &build] {
+                    pin_current_thread(cpus);
+                    replicas[node] = std::make_shared<const T>(build());
+                });
+            }
+            for (auto& builder : builders){
+                builder.join();
+            }
+
+            //memory-only nodes get the first copy that exists
+            std::shared_ptr<const T> fallback;
+            for (const auto& replica : replicas){
+                if (replica){
+                    fallback = replica;
+                    break;
+                }
+            }
+            for (auto& replica : replicas){
+                if (!replica){
+                    replica = fallback;
+                }
+            }
+        }
+
+        //wrap a single existing object (not owned) so code taking a NumaReplicated also works without replication
+        static NumaReplicated single(const T& object){
+            NumaReplicated replicated;
+            replicated.replicas.push_back(std::shared_ptr<const T>(&object, [](const T*) {}));
+            return replicated;
+        }
+
+        const T& local() const {
+            return *replicas[Topology::current_node() % replicas.size()];
+        }
+
+        size_t copies() const { return replicas.size(); }
+
+    private:
+        NumaReplicated() = default;
+        std::vector<std::shared_ptr<const T>> replicas;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "ray.h"
+#include <cmath>
+#include <cstdint>
+
+/*
+RayPacket struct
+
+Up to 8 rays traced together (4 or 8 for 2x2, 4x2 pixel blocks)
+Stored per axis and per lane (o[axis][lane]) so the per lane loops of packet traversal run over contiguous doubles
+Lanes taking part in a query are given as a bit mask (bit l = lane l)
+*/
+
+struct RayPacket {
+    static constexpr int max_size = 8;
+
+    int size = 0;
+    double o[3][max_size];      //origins
+    double d[3][max_size];      //directions
+    double inv[3][max_size];    //1 / direction
+
+    void set(int lane, const Ray& r){
+        for (int axis = 0; axis < 3; axis++){
+            o[axis][lane] = r.origin()[axis];
+            d[axis][lane] = r.direction()[axis];
+            inv[axis][lane] = 1.0 / d[axis][lane];
+        }
+    }
+
+    Ray ray(int lane) const {
+        return Ray(point3(o[0][lane], o[1][lane], o[2][lane]), vec3(d[0][lane], d[1][lane], d[2][lane]));
+    }
+
+    uint32_t full_mask() const {
+        return size >= 32 ? ~0u : (1u << size) - 1;
+    }
+
+    //whether every lane in mask has the same direction sign on every axis (then all lanes agree on near/far children)
+    bool same_octant(uint32_t mask) const {
+        int first = __builtin_ctz(mask);
+        for (int axis = 0; axis < 3; axis++){
+            bool negative = std::signbit(d[axis][first]);
+            for (uint32_t m = mask; m; m &= m - 1){
+                if (std::signbit(d[axis][__builtin_ctz(m)]) != negative){
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef PATH_TRACER_H
+#define PATH_TRACER_H
+
+#include "hittable_list.h"
+#include "material.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include "light.h"
+#include "environment.h"
+#include "photon_map.h"
+#include "irradiance_cache.h"
+#include "guiding.h"
+
+using namespace std::chrono;
+
+/*
+PathTracer class
+
+The light arriving along a camera ray: one path at a time, next event estimation at every diffuse hit (weighted against
+scatter with MIS), Russian roulette, and the per frame structures a path may end in or be steered by
+(photon map, irradiance cache, path guiding), built by prepare
+
+The Camera renders with it, the other integrators are built from its pieces
+(restir.h, light_tracing.h, the wavefront integrator of wavefront.h, the cache records of irradiance_cache.h)
+*/
+
+class PathTracer {
+    public:
+        int max_depth;
+
+        //bounces after which Russian roulette may end a path (max_depth stays the hard limit, >= max_depth turns it off)
+        int rr_depth = 3;
+
+        //area lights sampled directly at every diffuse hit through a light BVH (light.h), each one also has to be in the world
+        LightList lights;
+
+        //HDR lat-long map seen by rays that leave the scene (instead of the sky gradient), sampled like a light as well
+        shared_ptr<EnvironmentMap> environment;
+
+        //photon mapping (photon_map.h): paths end at their first diffuse hit and take indirect light from the nearest photons
+        bool photon_mapping = false;
+        int photon_count = 200000;          //shot from the area lights per frame
+        int photon_neighbours = 64;
+        double photon_radius = 2.0;         //largest gather radius
+
+        //irradiance caching (irradiance_cache.h): diffuse hits after a diffuse bounce take all their light from cached records
+        bool irradiance_caching = false;
+        int irradiance_cache_rays = 128;            //paths per new record
+        double irradiance_cache_accuracy = 0.25;    //larger = fewer records and more blur
+        double irradiance_cache_min_radius = 0.5;
+        double irradiance_cache_max_radius = 20.0;
+
+        //path guiding (guiding.h, progressive rendering only): diffuse bounces also draw from the light learned in earlier passes
+        //off by default, it does not pay for its cost per bounce yet
+        bool path_guiding = false;
+
+        //random numbers of every sample are derived from (seed, pixel, sample index), change it for a different noise pattern
+        uint64_t seed = 0;
+
+        //where the pixel jitter and scattering directions come from (sampler.h)
+        SamplerType sampler_type = SamplerType::Sobol;
+
+        //rays ignore hits closer than this to their origin, so a scattered ray does not hit the surface it leaves
+        static constexpr double ray_epsilon = 1e-4;
+        //shadow rays stop this far (in units of their length) short of both ends
+        static constexpr double shadow_epsilon = 1e-6;
+
+
+        //build the lights and what this frame's paths read, lighting = false for renders that light nothing (previews)
+        //path guiding learns between passes, so it is only set up for progressive renders
+        void prepare(const hittable_list& world, bool lighting, bool progressive){
+            lights.build();
+            photon_map.reset();
+            if (photon_mapping && lighting){
+                build_photon_map(world);
+            }
+            irradiance_cache.reset();
+            if (irradiance_caching && lighting){
+                irradiance_cache = std::make_shared<IrradianceCache>(irradiance_cache_accuracy, irradiance_cache_min_radius, irradiance_cache_max_radius);
+            }
+            guide.reset();
+            if (path_guiding && lighting){
+                if (progressive){
+                    guide = std::make_shared<GuideField>(world.BoundingBox());
+                } else {
+                    std::clog << "Path guiding learns between progressive passes, set adaptive or time_budget as well (rendering unguided)\n";
+                }
+            }
+        }
+
+        //colour leaving a hit point towards the ray origin, following the path for up to depth hits
+        //iterative: the throughput (product of the attenuations so far) is carried forward instead of
+        //multiplying on the way back up a recursion, and the path ends at the first miss, light or non scattering surface
+        //diffuse hits also add the light of a shadow ray to a sampled light point (sample_direct)
+        //with a photon map the path ends at its first diffuse hit, which reads its indirect light from the photons (gather),
+        //with an irradiance cache (and cached) the first diffuse hit after a diffuse bounce reads all its light from the cache
+        colour shade(Ray r, hit_record rec, int depth, const hittable_list& world, Sampler& sampler, bool cached = true) const {
+            if (guide != nullptr && cached){
+                GuidedPath path;
+                colour radiance = trace(r, rec, depth, world, sampler, cached, &path);
+                path.commit();
+                return radiance;
+            }
+            return trace(r, rec, depth, world, sampler, cached, nullptr);
+        }
+
+        //whether a path ends at this hit and reads the photon map there
+        bool gathers(const material& mat) const {
+            return photon_map != nullptr && mat.diffuse;
+        }
+
+        //indirect light leaving a diffuse hit, estimated from the photons around it
+        colour gather(const hit_record& rec, const material& mat) const {
+            static thread_local std::vector<PhotonMap::Neighbour> neighbours;
+            return photon_map->estimate(rec, mat, photon_neighbours, photon_radius, neighbours);
+        }
+
+        //whether a path ends at this hit and reads the irradiance cache there,
+        //previous_pdf is the density the path scattered here with (0 = camera or mirror, > 0 = diffuse)
+        bool caches(const material& mat, double previous_pdf, bool cached = true) const {
+            return cached && irradiance_cache != nullptr && mat.diffuse && previous_pdf > 0;
+        }
+
+        //all light (direct and indirect) leaving a diffuse hit where the path ends (caches), depth hits were left to the path
+        colour cached_radiance(const hit_record& rec, const material& mat, int depth, const hittable_list& world) const {
+            return irradiance_cache->radiance(*this, rec, mat, depth, world);
+        }
+
+        void report_irradiance_cache() const {
+            if (irradiance_cache != nullptr){
+                std::clog << "Irradiance cache: " << irradiance_cache->size() << " records, "
+                          << 100.0 * irradiance_cache->hit_rate() << "% of lookups answered from the cache\n";
+            }
+        }
+
+        //whether diffuse hits sample light directly (area lights or an environment map)
+        bool direct_lighting() const {
+            return !lights.empty() || environment != nullptr;
+        }
+
+        //next event estimation at a diffuse hit: pick the environment or a light and a point on it,
+        //weighted against scatter finding it (MIS)
+        //shadow goes from the hit towards the light and is blocked by anything hit for t in range,
+        //contribution (already times throughput) is what it adds when it is not blocked
+        //always takes the same sampler dimensions, so both integrators stay in step
+        //weighted = false when the path does not scatter on from the hit (photon gather), the light sample then counts fully
+        //site = the hit's path guiding, its bounce then has the mixture density that MIS weighs against
+        bool sample_direct(const hit_record& rec, const material& mat, const colour& throughput, Sampler& sampler,
+                           Ray& shadow, interval& range, colour& contribution, bool weighted = true, const GuideSite* site = nullptr) const {
+            double u = sampler.get_1D();
+            glm::dvec2 uv = sampler.get_2D();
+            LightSample y;
+            vec3 wi;
+            double light_pdf;
+            if (!sample_light(rec, u, uv, y, wi, light_pdf)){
+                return false;
+            }
+            shadow_ray(rec, y, shadow, range);
+
+            colour f = mat.eval(rec, wi);
+            if (f == colour(0, 0, 0)){
+                return false;
+            }
+            double scatter_density = site != nullptr ? site->pdf(mat.pdf(rec, wi), wi) : mat.pdf(rec, wi);
+            double weight = weighted ? power_heuristic(light_pdf, scatter_density) : 1.0;
+            contribution = throughput * f * y.emitted * (weight / light_pdf);
+            return true;
+        }
+
+        //pick the environment or a light and a point on it for a hit (u and uv uniform),
+        //wi = unit direction towards it, light_pdf = density of wi per solid angle
+        //by_power = the light in proportion to its power alone (constant time, for resampling candidates)
+        //instead of through the light BVH
+        bool sample_light(const hit_record& rec, double u, glm::dvec2 uv, LightSample& y, vec3& wi, double& light_pdf, bool by_power = false) const {
+            double p_environment = environment_probability();
+            if (u < p_environment){
+                double pdf;
+                if (!environment->sample(u / p_environment, uv, wi, pdf)){
+                    return false;
+                }
+                light_pdf = p_environment * pdf;
+                y = LightSample{wi, vec3(0, 0, 0), environment->radiance(wi), true};
+                return true;
+            }
+            double pmf;
+            double u_light = std::min((u - p_environment) / (1.0 - p_environment), one_minus_epsilon);
+            const hittable* light = by_power ? lights.sample_emitter(u_light, pmf) : lights.choose(rec.p, rec.normal, u_light, pmf);
+            surface_sample sample;
+            if (light == nullptr || !light->sample_surface(rec.p, uv, sample)){
+                return false;
+            }
+            wi = glm::normalize(sample.p - rec.p);
+            light_pdf = (1.0 - p_environment) * pmf * sample.pdf;
+            y = LightSample{sample.p, sample.normal, sample.mat->emitted(), false};
+            return true;
+        }
+
+        //ray from a hit towards a light sample, blocked by anything hit for t in range
+        void shadow_ray(const hit_record& rec, const LightSample& y, Ray& shadow, interval& range) const {
+            if (y.environment){
+                shadow = Ray(rec.p, y.p);
+                range = interval(ray_epsilon, infinity);
+            } else {
+                shadow = Ray(rec.p, y.p - rec.p);
+                range = interval(shadow_epsilon, 1 - shadow_epsilon);
+            }
+        }
+
+        //MIS weight of a light found by scatter (r is the scattered ray, normal the one at its origin,
+        //pdf the density it was chosen with, 0 = mirror/camera)
+        double emission_weight(const Ray& r, const vec3& normal, const hit_record& rec, double pdf) const {
+            if (pdf <= 0 || rec.object == nullptr){
+                return 1;
+            }
+            double light_pdf = (1.0 - environment_probability()) * lights.pmf(r.origin(), normal, rec.object) * rec.object->surface_pdf(r.origin(), rec);
+            return power_heuristic(pdf, light_pdf);
+        }
+
+        //MIS weight of the environment seen by a scattered ray that left the scene
+        double environment_weight(const Ray& r, double pdf) const {
+            if (pdf <= 0 || environment == nullptr){
+                return 1;
+            }
+            return power_heuristic(pdf, environment_probability() * environment->pdf(r.direction()));
+        }
+
+        //Russian roulette after rr_depth bounces, a surviving path's throughput is scaled up by 1 / probability
+        bool survives(colour& throughput, int bounce, Sampler& sampler) const {
+            if (bounce < rr_depth){
+                return true;
+            }
+            double probability = std::min(0.95, std::max({throughput.x, throughput.y, throughput.z}));
+            if (sampler.get_1D() >= probability){
+                return false;
+            }
+            throughput /= probability;
+            return true;
+        }
+
+        //colour of a surface that does not scatter: its normal
+        static colour surface_colour(const hit_record& rec){
+            return 0.5 * (rec.normal + colour(1, 1, 1));
+        }
+
+        colour background(const Ray& r) const {
+            if (environment != nullptr){
+                return environment->radiance(r.direction());
+            }
+            vec3 unit_direction = glm::normalize(r.direction());
+            //scale from [-1, 1] to [0, 1]
+            auto a = 0.5*(unit_direction.y + 1.0);
+            return double(1.0 - a)*colour(1.0, 1.0, 1.0) + double(a)*colour(0.5, 0.7, 1.0);
+        }
+
+    protected:
+        //built by prepare when photon_mapping is on
+        shared_ptr<const PhotonMap> photon_map;
+        //created by prepare when irradiance_caching is on, filled while rendering
+        shared_ptr<IrradianceCache> irradiance_cache;
+        //created by prepare when path_guiding is on, learns while rendering
+        shared_ptr<GuideField> guide;
+        //light paths carry the caustics of this frame (light_tracing.h), camera paths leave them out
+        bool light_traced_caustics = false;
+
+    private:
+        //the path of shade, path = where path guiding learns from it and draws its diffuse bounces (nullptr = not guided)
+        colour trace(Ray r, hit_record rec, int depth, const hittable_list& world, Sampler& sampler, bool cached, GuidedPath* path) const {
+            colour radiance(0, 0, 0);
+            colour throughput(1, 1, 1);
+            double scatter_pdf = 0;
+            vec3 scatter_normal(0, 0, 0);
+            //with light tracing a camera path whose first hit is diffuse leaves the lights it reaches through glass or mirrors
+            //straight after a diffuse hit to the light paths (LightTracer), specular_run = specular hits since the last
+            //diffuse one (-1 = none yet)
+            bool leaves_caustics = light_traced_caustics && rec.mat->diffuse;
+            int specular_run = -1;
+            //light found along the path, also credited to the guided bounces before it
+            auto add = [&](const colour& contribution) -> colour {
+                radiance += contribution;
+                if (path != nullptr){
+                    path->add(contribution);
+                }
+                return radiance;
+            };
+            for (int bounce = 0; ; bounce++){
+                if (rec.mat->emissive){
+                    if (leaves_caustics && specular_run > 0 && lights.contains(rec.object)){
+                        return radiance;
+                    }
+                    return add(throughput * (emission_weight(r, scatter_normal, rec, scatter_pdf) * rec.mat->emitted()));
+                }
+                if (rec.mat->absorbs){
+                    return add(throughput * surface_colour(rec));
+                }
+                if (caches(*rec.mat, scatter_pdf, cached)){
+                    return add(throughput * cached_radiance(rec, *rec.mat, depth, world));
+                }
+                if (gathers(*rec.mat)){
+                    add(throughput * gather(rec, *rec.mat));
+                }
+                GuideSite site;
+                if (path != nullptr && rec.mat->diffuse){
+                    site = guide->site(rec.p);
+                }
+                if (depth > 1 && rec.mat->diffuse && direct_lighting()){
+                    Ray shadow;
+                    interval range;
+                    colour contribution;
+                    if (sample_direct(rec, *rec.mat, throughput, sampler, shadow, range, contribution, !gathers(*rec.mat), site.leaf != nullptr ? &site : nullptr)
+                        && !world.occluded(shadow, range)){
+                        add(contribution);
+                    }
+                }
+                if (gathers(*rec.mat)){
+                    return radiance;
+                }
+
+                Ray scattered;
+                colour attenuation;
+                if (site.leaf != nullptr){
+                    vec3 wi;
+                    double guide_pdf, bsdf_pdf;
+                    if (!site.scatter(r, rec, sampler, scattered, wi, guide_pdf, bsdf_pdf, scatter_pdf)){
+                        return add(throughput * surface_colour(rec));
+                    }
+                    colour f = rec.mat->eval(rec, wi);
+                    if (scatter_pdf <= 0 || f == colour(0, 0, 0)){
+                        return radiance;
+                    }
+                    throughput *= f / scatter_pdf;
+                    path->add_vertex(site.leaf, wi, throughput, scatter_pdf, luminance(f), site.alpha, guide_pdf, bsdf_pdf);
+                } else {
+                    if (!rec.mat->scatter(r, rec, attenuation, scattered, sampler)){
+                        return add(throughput * surface_colour(rec));
+                    }
+                    throughput *= attenuation;
+                    scatter_pdf = rec.mat->diffuse ? rec.mat->pdf(rec, scattered.direction()) : 0;
+                }
+                scatter_normal = rec.normal;
+                specular_run = rec.mat->diffuse ? 0 : (specular_run >= 0 ? specular_run + 1 : -1);
+                if (--depth <= 0 || !survives(throughput, bounce, sampler)){
+                    return radiance;
+                }
+
+                r = scattered;
+                if (!world.hit(r, interval(ray_epsilon, infinity), rec)){
+                    return add(throughput * (environment_weight(r, scatter_pdf) * background(r)));
+                }
+            }
+        }
+
+        //shoot the photons of this frame from the lights of the (already built) light list
+        void build_photon_map(const hittable_list& world){
+            auto start = steady_clock::now();
+            photon_map = std::make_shared<const PhotonMap>(PhotonMap::trace(world, lights, photon_count, max_depth, sampler_type, seed, ThreadPool::global()));
+            std::clog << "Photon map: " << photon_map->size() << " photons stored from " << photon_count << " shot in "
+                      << duration_cast<milliseconds>(steady_clock::now() - start).count() << " ms\n";
+        }
+
+        //probability next event estimation samples the environment map instead of the area lights
+        double environment_probability() const {
+            if (environment == nullptr){
+                return 0;
+            }
+            return lights.empty() ? 1.0 : 0.5;
+        }
+};
+
+
+#endif
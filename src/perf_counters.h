@@ -0,0 +1,86 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+/*
+PerfCounters class
+
+Hardware counters of the calling thread (Linux perf_event_open, user space only):
+- Cycles         : core cycles
+- StalledBackend : cycles the backend could not retire anything (mostly waiting on memory)
+- CacheMisses    : last level cache misses
+
+Every thread opens its own counters on first use (thread_counters), reading them costs one read() per counter
+Counters the CPU or kernel does not offer (VMs, perf_event_paranoid) stay closed and read as 0, check available()
+*/
+
+class PerfCounters {
+    public:
+        enum Counter { Cycles, StalledBackend, CacheMisses, count };
+        using Values = std::array<uint64_t, count>;
+
+        static PerfCounters& thread_counters(){
+            static thread_local PerfCounters counters;
+            return counters;
+        }
+
+        PerfCounters(){
+            const uint64_t configs[count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_STALLED_CYCLES_BACKEND, PERF_COUNT_HW_CACHE_MISSES};
+            for (int c = 0; c < count; c++){
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = configs[c];
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fds[c] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            }
+        }
+
+        ~PerfCounters(){
+            for (int fd : fds){
+                if (fd >= 0){
+                    close(fd);
+                }
+            }
+        }
+
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        bool available(Counter c) const {
+            return fds[c] >= 0;
+        }
+
+        bool available() const {
+            for (int fd : fds){
+                if (fd >= 0){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        Values read() const {
+            Values values{};
+            for (int c = 0; c < count; c++){
+                if (fds[c] >= 0 && ::read(fds[c], &values[c], sizeof(uint64_t)) != sizeof(uint64_t)){
+                    values[c] = 0;
+                }
+            }
+            return values;
+        }
+
+    private:
+        int fds[count];
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "hittable_list.h"
+#include "light.h"
+#include "material.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include <vector>
+
+/*
+PhotonMap class
+
+Light carried by photons shot from the area lights, stored where they land on diffuse surfaces
+Used by the photon mapping mode of the camera: paths stop at their first diffuse hit and read the indirect light there
+from the photons around it (density estimation), direct light still comes from next event estimation,
+so photons that land straight from a light are not stored
+
+trace  : shoot count photons from the lights (chosen by power), in parallel over the thread pool,
+         every chunk of photons fills its own buffer (merged in chunk order, so the map does not depend on the threads)
+         photon i takes its random numbers from sample i of the sampler, so the photons are stratified as a whole
+storage: a left-balanced kd-tree kept as an implicit heap (children of node n at 2n + 1 and 2n + 2),
+         no pointers or padding, photons of a subtree close together and only the split axis stored per node
+nearest: the k photons closest to p within max_radius
+within : every photon closer than radius to p
+estimate : reflected radiance at a diffuse hit from its nearest photons (power * bsdf / disc area)
+*/
+
+struct Photon {
+    float p[3];
+    float power[3];
+    float wi[3];        //unit direction the photon came from
+    uint8_t axis;       //split axis of its kd-tree node
+
+    double distance2(const point3& q) const {
+        double dx = q.x - p[0], dy = q.y - p[1], dz = q.z - p[2];
+        return dx*dx + dy*dy + dz*dz;
+    }
+};
+
+class PhotonMap {
+    public:
+        struct Neighbour {
+            double distance2;
+            uint32_t index;
+
+            bool operator<(const Neighbour& other) const {
+                return distance2 < other.distance2;
+            }
+        };
+
+        static PhotonMap trace(const hittable_list& world, const LightList& lights, int count, int max_depth,
+                               SamplerType sampler_type, uint64_t seed, ThreadPool& pool){
+            const int64_t grain = 1024;
+            const int64_t chunks = (count + grain - 1) / grain;
+            std::vector<std::vector<Photon>> buffers(chunks);
+            pool.parallel_for(0, chunks, 1, [&](int64_t lo, int64_t hi){
+                auto sampler = make_sampler(sampler_type, count, seed ^ photon_salt);
+                for (int64_t c = lo; c < hi; c++){
+                    for (int64_t i = c * grain; i < std::min<int64_t>(count, (c + 1) * grain); i++){
+                        sampler->start_pixel_sample(0, 0, int(i));
+                        trace_photon(world, lights, count, max_depth, *sampler, buffers[c]);
+                    }
+                }
+            });
+
+            PhotonMap map;
+            size_t total = 0;
+            for (const auto& buffer : buffers){
+                total += buffer.size();
+            }
+            map.photons.reserve(total);
+            for (auto& buffer : buffers){
+                map.photons.insert(map.photons.end(), buffer.begin(), buffer.end());
+                std::vector<Photon>().swap(buffer);
+            }
+            map.balance();
+            return map;
+        }
+
+        size_t size() const { return photons.size(); }
+
+        //the (up to) k nearest photons within max_radius, as a max heap on distance (found.front() is the farthest)
+        void nearest(const point3& p, int k, double max_radius, std::vector<Neighbour>& found) const {
+            found.clear();
+            double radius2 = max_radius * max_radius;
+            search(p, radius2, [&](uint32_t index, double d2, double& limit2){
+                if (int(found.size()) < k){
+                    found.push_back(Neighbour{d2, index});
+                    std::push_heap(found.begin(), found.end());
+                } else if (d2 < found.front().distance2){
+                    std::pop_heap(found.begin(), found.end());
+                    found.back() = Neighbour{d2, index};
+                    std::push_heap(found.begin(), found.end());
+                }
+                if (int(found.size()) == k){
+                    limit2 = found.front().distance2;
+                }
+            });
+        }
+
+        //visit(photon) for every photon closer than radius
+        template <typename Visit>
+        void within(const point3& p, double radius, Visit&& visit) const {
+            search(p, radius * radius, [&](uint32_t index, double d2, double& limit2){
+                visit(photons[index]);
+            });
+        }
+
+        //radiance leaving a diffuse hit towards the viewer from the k nearest photons (disc of the farthest one's radius)
+        colour estimate(const hit_record& rec, const material& mat, int k, double max_radius, std::vector<Neighbour>& scratch) const {
+            nearest(rec.p, k, max_radius, scratch);
+            if (scratch.empty()){
+                return colour(0, 0, 0);
+            }
+            colour sum(0, 0, 0);
+            for (const Neighbour& n : scratch){
+                const Photon& photon = photons[n.index];
+                vec3 wi(photon.wi[0], photon.wi[1], photon.wi[2]);
+                double cosine = glm::dot(rec.normal, wi);
+                if (cosine <= 0){
+                    continue;
+                }
+                //eval is bsdf * cosine, photon power is already what arrives on the surface
+                sum += mat.eval(rec, wi) / cosine * colour(photon.power[0], photon.power[1], photon.power[2]);
+            }
+            double radius2 = int(scratch.size()) == k ? scratch.front().distance2 : max_radius * max_radius;
+            return sum / (pi * radius2);
+        }
+
+    private:
+        static constexpr uint64_t photon_salt = 0x9e3779b97f4a7c15ull;
+
+        std::vector<Photon> photons;
+
+        static void trace_photon(const hittable_list& world, const LightList& lights, int count, int max_depth,
+                                 Sampler& sampler, std::vector<Photon>& out){
+            double u = sampler.get_1D();
+            glm::dvec2 u_point = sampler.get_2D();
+            glm::dvec2 u_direction = sampler.get_2D();
+            double u_side = sampler.get_1D();
+
+            double pmf;
+            const hittable* light = lights.sample_emitter(u, pmf);
+            emitter_shape shape;
+            point3 origin;
+            vec3 normal;
+            if (light == nullptr || !light->describe_emitter(shape) || !light->sample_point(u_point, origin, normal)){
+                return;
+            }
+            if (shape.two_sided && u_side < 0.5){
+                normal = -normal;
+            }
+
+            //cosine weighted direction, so the photon carries emitted * area * pi (per side) / (pmf * count)
+            vec3 direction = normal + sample_unit_sphere(u_direction);
+            if (near_zero(direction)){
+                direction = normal;
+            }
+            colour power = shape.mat->emitted() * (shape.area * pi * (shape.two_sided ? 2.0 : 1.0) / (pmf * count));
+            Ray r(origin, direction);
+
+            for (int depth = 0; depth < max_depth; depth++){
+                hit_record rec;
+                if (!world.hit(r, interval(1e-4, infinity), rec) || rec.mat->emissive || rec.mat->absorbs){
+                    return;
+                }
+                if (rec.mat->diffuse && depth > 0){
+                    vec3 wi = -glm::normalize(r.direction());
+                    out.push_back(Photon{{float(rec.p.x), float(rec.p.y), float(rec.p.z)},
+                                         {float(power.x), float(power.y), float(power.z)},
+                                         {float(wi.x), float(wi.y), float(wi.z)}, 0});
+                }
+
+                Ray scattered;
+                colour attenuation;
+                if (!rec.mat->scatter(r, rec, attenuation, scattered, sampler)){
+                    return;
+                }
+                //Russian roulette on the attenuation keeps the photon power about constant
+                double survive = std::min(1.0, std::max({attenuation.x, attenuation.y, attenuation.z}));
+                if (sampler.get_1D() >= survive){
+                    return;
+                }
+                power *= attenuation / survive;
+                r = scattered;
+            }
+        }
+
+        //reorder photons into a left-balanced kd-tree
+        void balance(){
+            std::vector<Photon> tree(photons.size());
+            if (!photons.empty()){
+                balance(photons.data(), photons.data() + photons.size(), tree, 0);
+            }
+            photons.swap(tree);
+        }
+
+        void balance(Photon* begin, Photon* end, std::vector<Photon>& tree, size_t node){
+            size_t n = end - begin;
+            if (n == 0){
+                return;
+            }
+
+            //split on the axis the photons spread most along
+            float lo[3] = {begin->p[0], begin->p[1], begin->p[2]};
+            float hi[3] = {lo[0], lo[1], lo[2]};
+            for (const Photon* q = begin; q < end; q++){
+                for (int a = 0; a < 3; a++){
+                    lo[a] = std::min(lo[a], q->p[a]);
+                    hi[a] = std::max(hi[a], q->p[a]);
+                }
+            }
+            int axis = 0;
+            for (int a = 1; a < 3; a++){
+                if (hi[a] - lo[a] > hi[axis] - lo[axis]){
+                    axis = a;
+                }
+            }
+
+            Photon* median = begin + left_size(n);
+            std::nth_element(begin, median, end, [axis](const Photon& a, const Photon& b){
+                return a.p[axis] < b.p[axis];
+            });
+            tree[node] = *median;
+            tree[node].axis = uint8_t(axis);
+            balance(begin, median, tree, 2 * node + 1);
+            balance(median + 1, end, tree, 2 * node + 2);
+        }
+
+        //photons in the left subtree of a left-balanced tree of n photons (every level full except the last, filled from the left)
+        static size_t left_size(size_t n){
+            if (n <= 1){
+                return 0;
+            }
+            size_t levels = 0;
+            while ((size_t(2) << levels) <= n + 1){
+                levels++;
+            }
+            size_t full = (size_t(1) << levels) - 1;            //nodes of the full levels
+            size_t last = n - full;                             //nodes on the partial last level
+            size_t half = size_t(1) << (levels - 1);            //last level slots below the left child
+            return (half - 1) + std::min(last, half);
+        }
+
+        //visit(index, distance2, limit2) for every photon closer than limit2, which visit may shrink
+        template <typename Visit>
+        void search(const point3& p, double limit2, Visit&& visit) const {
+            struct Entry {
+                uint32_t node;
+                double plane2;      //squared distance to the splitting plane that led here (0 = p's side)
+            };
+            Entry stack[64];
+            int top = 0;
+            const uint32_t n = uint32_t(photons.size());
+            if (n == 0){
+                return;
+            }
+            stack[top++] = Entry{0, 0.0};
+            const double q[3] = {p.x, p.y, p.z};
+            while (top > 0){
+                Entry entry = stack[--top];
+                if (entry.plane2 >= limit2){
+                    continue;
+                }
+                const Photon& photon = photons[entry.node];
+                double delta = q[photon.axis] - photon.p[photon.axis];
+                uint32_t near = delta < 0 ? 2 * entry.node + 1 : 2 * entry.node + 2;
+                uint32_t far = delta < 0 ? 2 * entry.node + 2 : 2 * entry.node + 1;
+                //far side first on the stack so the near side is searched (and limit2 shrinks) before it
+                if (far < n){
+                    stack[top++] = Entry{far, delta * delta};
+                }
+                if (near < n){
+                    stack[top++] = Entry{near, entry.plane2};
+                }
+                double d2 = photon.distance2(p);
+                if (d2 < limit2){
+                    visit(entry.node, d2, limit2);
+                }
+            }
+        }
+};
+
+#endif
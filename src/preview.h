@@ -0,0 +1,63 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "path_tracer.h"
+
+/*
+Preview integrators
+
+Layout checks that only look at what the camera rays hit: no material scatters and no light is sampled,
+on the same world (and accelerator), tiles and sampler as full renders
+
+Preview           : what the camera renders, the full path tracer (None) or one of the previews
+PreviewIntegrator : a preview and its parameters (Camera::preview, ao_rays, ...), colour_of = what it shows for one camera ray
+*/
+
+enum class Preview { None, AmbientOcclusion, Albedo, Normal, Depth };
+
+struct PreviewIntegrator {
+    Preview mode;
+    int ao_rays;
+    double ao_distance;
+    double depth_range;
+
+    //what the preview shows for a camera ray, rec = its hit (nullptr = it missed)
+    colour colour_of(const Ray& r, const hit_record* rec, const hittable_list& world, Sampler& sampler) const {
+        switch (mode){
+            case Preview::AmbientOcclusion:
+                return colour(rec != nullptr ? ambient_occlusion(*rec, world, sampler) : 1.0);
+            case Preview::Albedo:
+                if (rec == nullptr){
+                    return colour(0, 0, 0);
+                }
+                return rec->mat->emissive ? rec->mat->emitted() : rec->mat->base_colour();
+            case Preview::Normal:
+                return rec != nullptr ? PathTracer::surface_colour(*rec) : colour(0, 0, 0);
+            case Preview::Depth:
+                return colour(rec != nullptr ? rec->t * glm::length(r.direction()) / depth_range : 1.0);
+            default:
+                return colour(0, 0, 0);
+        }
+    }
+
+    //share of ao_rays cosine weighted rays from a hit that get ao_distance away without hitting anything (any-hit queries)
+    double ambient_occlusion(const hit_record& rec, const hittable_list& world, Sampler& sampler) const {
+        if (ao_rays <= 0){
+            return 1;
+        }
+        int open = 0;
+        for (int k = 0; k < ao_rays; k++){
+            vec3 direction = rec.normal + sample_unit_sphere(sampler.get_2D());
+            if (near_zero(direction)){
+                direction = rec.normal;
+            }
+            if (!world.occluded(Ray(rec.p, glm::normalize(direction)), interval(PathTracer::ray_epsilon, ao_distance))){
+                open++;
+            }
+        }
+        return double(open) / ao_rays;
+    }
+};
+
+
+#endif
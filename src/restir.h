@@ -0,0 +1,275 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "helper.h"
+#include "colour.h"
+#include "hittable.h"
+#include "path_tracer.h"
+#include <vector>
+
+/*
+Reservoir resampling of direct light (ReSTIR, Bitterli et al. 2020)
+
+Every pixel keeps a reservoir: one light sample chosen from a stream of candidates by weighted reservoir sampling,
+with the weight sum and the number of candidates it stands for. The sample is picked with probability proportional to
+its target p_hat = luminance(bsdf * emitted * geometry term), unshadowed, and W makes f(y) * W an estimate of the
+direct light, so light found by any candidate costs one shadow ray to use
+
+Reservoir     : update adds one candidate (or the sample of another reservoir), finish_candidates / finish_combined set W
+                reservoirs of several pixels (or passes) are combined with balance heuristic weights over their hits,
+                mis_i = M_i p_hat_i(y_i) / sum_j M_j p_hat_j(y_i), so a neighbour whose hit sees a light much worse than
+                this one does not turn it into a firefly (ResampledLighting::combine)
+ResampledPixel: what a progressive pass keeps per pixel: camera ray, primary hit, where its sampler stopped,
+                and the reservoir of its candidates and those of its earlier passes (read by the neighbours and the next pass),
+                the reservoir combined with the neighbours only shades and is not kept
+ReservoirImage: the pixels of one image size
+ResampledLighting: the two halves of a progressive pass on a ReservoirImage, with the camera's PathTracer:
+                resample fills the reservoir of every pixel from its own candidates (and last pass), sample then
+                combines it with the neighbours', shades the direct light with one shadow ray and traces the rest of the path
+
+targets leave out visibility (occluded samples are passed on and only the shading shadow ray tests them), which keeps
+the reuse between pixels unbiased; the reservoir carried to the next pass holds only samples of the pixel's own hits,
+so weighting it with the hit of the last pass is right too
+*/
+
+class Reservoir {
+    public:
+        LightSample y;
+        double weight_sum = 0;
+        double M = 0;           //candidates it stands for
+        double W = 0;           //unbiased contribution weight of y
+        double target = 0;      //p_hat of y at the hit that owns the reservoir
+
+        //one candidate with resampling weight weight (target / source pdf, or mis * target * W of a reservoir), u uniform in [0, 1)
+        bool update(const LightSample& sample, double sample_target, double weight, double u){
+            weight_sum += weight;
+            if (weight > 0 && u * weight_sum < weight){
+                y = sample;
+                target = sample_target;
+                return true;
+            }
+            return false;
+        }
+
+        //W of a reservoir of M candidates drawn from the source pdf
+        void finish_candidates(){
+            W = target > 0 && M > 0 ? weight_sum / (M * target) : 0;
+        }
+
+        //W of a reservoir resampled from others with MIS weights that sum to one
+        void finish_combined(){
+            W = target > 0 ? weight_sum / target : 0;
+        }
+
+        bool empty() const { return W <= 0; }
+};
+
+struct ResampledPixel {
+    Ray ray;
+    hit_record rec;
+    bool hit = false;           //the camera ray hit something (rec is valid)
+    bool resampled = false;     //rec is a diffuse hit whose direct light comes from the reservoirs
+    uint32_t dimension = 0;     //sampler dimension after the camera ray
+    Reservoir candidates;
+};
+
+class ReservoirImage {
+    public:
+        const int width, height;
+
+        ReservoirImage(int width, int height) : width(width), height(height), pixels(size_t(width) * height) {}
+
+        ResampledPixel& operator()(int i, int j){
+            return pixels[size_t(j) * width + i];
+        }
+
+        const ResampledPixel& operator()(int i, int j) const {
+            return pixels[size_t(j) * width + i];
+        }
+
+    private:
+        std::vector<ResampledPixel> pixels;
+};
+
+//cosine at the light / squared distance, turns densities per solid angle at rec into densities per area of the light
+inline double light_geometry(const hit_record& rec, const LightSample& y){
+    vec3 d = y.p - rec.p;
+    double d2 = glm::dot(d, d);
+    return d2 > 0 ? std::fabs(glm::dot(y.normal, d)) / (d2 * std::sqrt(d2)) : 0.0;
+}
+
+//p_hat of a light sample at a hit, f = bsdf * cosine * emitted * geometry term (unshadowed contribution)
+inline double light_target(const hit_record& rec, const material& mat, const LightSample& y, colour& f){
+    vec3 wi = y.environment ? y.p : glm::normalize(y.p - rec.p);
+    f = mat.eval(rec, wi) * y.emitted * (y.environment ? 1.0 : light_geometry(rec, y));
+    return luminance(f);
+}
+
+//whether two primary hits are close enough in orientation and distance to share light samples
+inline bool similar_hits(const hit_record& a, const hit_record& b){
+    return glm::dot(a.normal, b.normal) > 0.9 && std::fabs(a.t - b.t) < 0.1 * a.t;
+}
+
+
+class ResampledLighting {
+    public:
+        //separates the random sequence of the resampling candidates from the path's
+        static constexpr uint64_t salt = 0x2545f4914f6cdd1dull;
+        //most neighbours a pixel reuses per pass
+        static constexpr int max_neighbours = 32;
+
+        ResampledLighting(const PathTracer& tracer, ReservoirImage& reservoirs, int candidates, int neighbours, int radius, int history)
+            : tracer(tracer), reservoirs(reservoirs), candidates(candidates), neighbours(neighbours), radius(radius), history(history) {}
+
+        //first half of a pass for pixel (i, j), r = its camera ray (the sampler stands after it):
+        //the primary hit and there a reservoir of candidates light samples (chosen without shadow rays),
+        //combined with the pixel's reservoir of the last pass if its hit looks the same, before the neighbours were added:
+        //samples of a neighbour carried over would be weighted as if they came from this pixel's hit
+        void resample(int i, int j, const Ray& r, const hittable_list& world, const Sampler& sampler) const {
+            ResampledPixel& pixel = reservoirs(i, j);
+            PCG32& rng = thread_rng();
+            hit_record rec;
+            bool hit = tracer.max_depth > 0 && world.hit(r, interval(PathTracer::ray_epsilon, infinity), rec);
+            bool resampled = hit && rec.mat->diffuse && tracer.max_depth > 1 && tracer.direct_lighting();
+
+            Reservoir reservoir;
+            if (resampled){
+                for (int c = 0; c < candidates; c++){
+                    double u = rng.uniform();
+                    glm::dvec2 uv(rng.uniform(), rng.uniform());
+                    double u_pick = rng.uniform();
+                    LightSample y;
+                    vec3 wi;
+                    double light_pdf;
+                    if (!tracer.sample_light(rec, u, uv, y, wi, light_pdf, true)){
+                        continue;
+                    }
+                    //target / source density, both in the sample's measure (the geometry term cancels)
+                    colour f;
+                    double target = light_target(rec, *rec.mat, y, f);
+                    double geometry = y.environment ? 1.0 : light_geometry(rec, y);
+                    reservoir.update(y, target, geometry > 0 ? target / (light_pdf * geometry) : 0.0, u_pick);
+                }
+                reservoir.M = candidates;
+                reservoir.finish_candidates();
+                if (pixel.resampled && similar_hits(rec, pixel.rec)){
+                    const Reservoir* inputs[2] = {&reservoir, &pixel.candidates};
+                    const hit_record* hits[2] = {&rec, &pixel.rec};
+                    double counts[2] = {reservoir.M, std::min(pixel.candidates.M, double(history) * candidates)};
+                    reservoir = combine(rec, inputs, hits, counts, 2, rng);
+                }
+            }
+            pixel.ray = r;
+            pixel.rec = rec;
+            pixel.hit = hit;
+            pixel.resampled = resampled;
+            pixel.dimension = sampler.current_dimension();
+            pixel.candidates = reservoir;
+        }
+
+        //second half: sample s of pixel (i, j) from the hit resample found,
+        //its reservoir combined with those of neighbours random pixels within radius shades the direct light (one shadow ray),
+        //the path then goes on as usual, except that lights it finds from the primary hit are not counted again
+        colour sample(int i, int j, int s, const hittable_list& world, Sampler& sampler) const {
+            const ResampledPixel& pixel = reservoirs(i, j);
+            seed_sample(tracer.seed, i, j, s);
+            sampler.start_pixel_sample(i, j, s);
+            sampler.set_dimension(pixel.dimension);
+            if (!pixel.hit){
+                return tracer.max_depth > 0 ? tracer.background(pixel.ray) : colour(0, 0, 0);
+            }
+            if (!pixel.resampled){
+                return tracer.shade(pixel.ray, pixel.rec, tracer.max_depth, world, sampler);
+            }
+
+            const hit_record& rec = pixel.rec;
+            PCG32& rng = thread_rng();
+            const Reservoir* inputs[max_neighbours + 1] = {&pixel.candidates};
+            const hit_record* hits[max_neighbours + 1] = {&rec};
+            double counts[max_neighbours + 1] = {pixel.candidates.M};
+            int count = 1;
+            for (int n = 0; n < std::min(neighbours, max_neighbours); n++){
+                double distance = radius * std::sqrt(rng.uniform());
+                double angle = 2.0 * pi * rng.uniform();
+                int x = i + int(std::lround(distance * std::cos(angle)));
+                int y = j + int(std::lround(distance * std::sin(angle)));
+                if (x < 0 || y < 0 || x >= reservoirs.width || y >= reservoirs.height || (x == i && y == j)){
+                    continue;
+                }
+                //nothing is written to the pixels in this half, candidates and hits stay as they are
+                const ResampledPixel& other = reservoirs(x, y);
+                if (!other.resampled || !similar_hits(rec, other.rec)){
+                    continue;
+                }
+                inputs[count] = &other.candidates;
+                hits[count] = &other.rec;
+                counts[count] = other.candidates.M;
+                count++;
+            }
+            Reservoir reservoir = combine(rec, inputs, hits, counts, count, rng);
+
+            colour radiance(0, 0, 0);
+            if (!reservoir.empty()){
+                colour f;
+                light_target(rec, *rec.mat, reservoir.y, f);
+                Ray shadow;
+                interval range;
+                tracer.shadow_ray(rec, reservoir.y, shadow, range);
+                if (!world.occluded(shadow, range)){
+                    radiance += f * reservoir.W;
+                }
+            }
+
+            Ray scattered;
+            colour attenuation;
+            if (!rec.mat->scatter(pixel.ray, rec, attenuation, scattered, sampler)){
+                return radiance + PathTracer::surface_colour(rec);
+            }
+            colour throughput = attenuation;
+            if (tracer.max_depth <= 1 || !tracer.survives(throughput, 0, sampler)){
+                return radiance;
+            }
+            hit_record next;
+            if (!world.hit(scattered, interval(PathTracer::ray_epsilon, infinity), next)){
+                //the environment map is sampled by the reservoirs, the sky gradient is not
+                return tracer.environment != nullptr ? radiance : radiance + throughput * tracer.background(scattered);
+            }
+            if (next.mat->emissive){
+                //so are the area lights (pmf is 0 for the ones that can not reach the primary hit, or are not in the list)
+                return tracer.lights.pmf(rec.p, rec.normal, next.object) > 0 ? radiance : radiance + throughput * next.mat->emitted();
+            }
+            return radiance + throughput * tracer.shade(scattered, next, tracer.max_depth - 1, world, sampler);
+        }
+
+    private:
+        const PathTracer& tracer;
+        ReservoirImage& reservoirs;
+        int candidates, neighbours, radius, history;
+
+        //one reservoir for the hit rec from n others, reservoir k belongs to hits[k] and counts for counts[k] candidates,
+        //its sample weighted by the balance heuristic over all the hits (mis = its share of sum_m counts[m] * p_hat_m)
+        static Reservoir combine(const hit_record& rec, const Reservoir* const* inputs, const hit_record* const* hits,
+                                 const double* counts, int n, PCG32& rng){
+            Reservoir out;
+            for (int k = 0; k < n; k++){
+                out.M += counts[k];
+                double u = rng.uniform();
+                const Reservoir& input = *inputs[k];
+                if (input.empty()){
+                    continue;
+                }
+                colour f;
+                double sum = 0;
+                for (int m = 0; m < n; m++){
+                    sum += counts[m] * (m == k ? input.target : light_target(*hits[m], *hits[m]->mat, input.y, f));
+                }
+                double mis = sum > 0 ? counts[k] * input.target / sum : 0;
+                double target = hits[k] == &rec ? input.target : light_target(rec, *rec.mat, input.y, f);
+                out.update(input.y, target, mis * target * input.W, u);
+            }
+            out.finish_combined();
+            return out;
+        }
+};
+
+#endif
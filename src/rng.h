@@ -0,0 +1,93 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+/*
+PCG32 random number generator (pcg-random.org, XSH RR variant)
+
+64 bits of state + a stream selector, so every (pixel, sample) can get its own independent sequence
+The renderer keeps one generator per thread (thread_rng) and reseeds it at the start of every camera sample,
+which makes each sample's random numbers depend only on (seed, pixel, sample index), never on which thread
+ran it or in what order, so images are bit-identical for any number of threads
+
+Methods
+- seed       : restart at the beginning of sequence `stream`, offset by `state`
+- next_u32   : next 32 random bits
+- uniform    : double in [0, 1) with 53 random bits
+- advance    : skip ahead delta outputs in O(log delta)
+*/
+
+//splitmix64 finaliser, turns structured input (pixel coordinates, sample indices) into well mixed seeds
+inline uint64_t mix_bits(uint64_t v){
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return v;
+}
+
+class PCG32 {
+    public:
+        PCG32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+        PCG32(uint64_t stream, uint64_t state) { seed(stream, state); }
+
+        void seed(uint64_t stream, uint64_t state){
+            this->state = 0;
+            inc = (stream << 1) | 1;
+            next_u32();
+            this->state += state;
+            next_u32();
+        }
+
+        uint32_t next_u32(){
+            uint64_t old = state;
+            state = old * multiplier + inc;
+            uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+            uint32_t rot = uint32_t(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+        }
+
+        double uniform(){
+            uint64_t hi = next_u32() >> 5;
+            uint64_t lo = next_u32() >> 6;
+            return double((hi << 26) | lo) * (1.0 / 9007199254740992.0);
+        }
+
+        //lcg jump ahead (Brown, "Random Number Generation with Arbitrary Stride")
+        void advance(uint64_t delta){
+            uint64_t cur_mult = multiplier, cur_plus = inc;
+            uint64_t acc_mult = 1, acc_plus = 0;
+            while (delta > 0){
+                if (delta & 1){
+                    acc_mult *= cur_mult;
+                    acc_plus = acc_plus * cur_mult + cur_plus;
+                }
+                cur_plus = (cur_mult + 1) * cur_plus;
+                cur_mult *= cur_mult;
+                delta /= 2;
+            }
+            state = acc_mult * state + acc_plus;
+        }
+
+    private:
+        static constexpr uint64_t multiplier = 0x5851f42d4c957f2dULL;
+        uint64_t state;
+        uint64_t inc;
+};
+
+//generator of the calling thread, nothing is shared between workers
+inline PCG32& thread_rng(){
+    static thread_local PCG32 rng;
+    return rng;
+}
+
+//start the random sequence of one camera sample: stream per pixel, offset per sample index and frame seed
+inline void seed_sample(uint64_t seed, int i, int j, int sample){
+    uint64_t pixel = (uint64_t(uint32_t(j)) << 32) | uint32_t(i);
+    thread_rng().seed(mix_bits(pixel ^ mix_bits(seed)), mix_bits((uint64_t(uint32_t(sample)) << 32) ^ seed));
+}
+
+#endif
@@ -0,0 +1,437 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "helper.h"
+#include "rng.h"
+#include <vector>
+
+/*
+Sampler classes
+
+A sampler hands out the random numbers of one camera sample, one dimension (or pair of dimensions) at a time:
+the camera takes the first 2D pair for the pixel jitter, every bounce takes the next ones for its scattering direction
+Well distributed samplers spread those numbers evenly over the samples of a pixel, so the image converges with fewer samples
+
+- Independent : white noise (what std::rand gave us), the reference
+- Stratified  : every dimension is split into samples_per_pixel strata, one jittered sample per stratum
+                (2D pairs use an nx * ny grid), strata are shuffled per pixel and dimension so dimensions are not correlated
+- Sobol       : first two Sobol dimensions with Owen scrambling, padded: every 2D pair gets its own scramble and
+                sample order (best with a power of 2 samples_per_pixel)
+- BlueNoise   : the same Sobol points for every pixel (scramble per dimension only), toroidally shifted by the rank of
+                the pixel in a void-and-cluster blue noise mask, so the error of neighbouring pixels is uncorrelated
+                and looks like blue noise even at 1-4 samples per pixel
+
+Every sampler is deterministic in (seed, pixel, sample index, dimension), so images do not depend on the thread count
+
+Methods
+- start_pixel_sample : restart at dimension 0 for sample `index` of pixel (i, j)
+- get_1D / get_2D    : next dimension(s), in [0, 1)
+- get_pixel_2D       : jitter inside the pixel (the first pair of every sample)
+- current_dimension / set_dimension : save and resume a path, for integrators that do not follow one path at a time
+*/
+
+enum class SamplerType { Independent, Stratified, Sobol, BlueNoise };
+
+class Sampler {
+    public:
+        virtual ~Sampler() = default;
+
+        virtual void start_pixel_sample(int i, int j, int index) = 0;
+        virtual double get_1D() = 0;
+        virtual glm::dvec2 get_2D() = 0;
+
+        glm::dvec2 get_pixel_2D(){
+            return get_2D();
+        }
+
+        uint32_t current_dimension() const {
+            return dimension;
+        }
+
+        //continue the current pixel sample at dimension d, as if d dimensions had been taken since start_pixel_sample
+        virtual void set_dimension(uint32_t d){
+            dimension = d;
+        }
+
+    protected:
+        uint32_t dimension = 0;
+};
+
+
+//helpers shared by the samplers
+
+inline uint64_t hash_sample(uint64_t a, uint64_t b, uint64_t c){
+    return mix_bits(a ^ mix_bits(b ^ mix_bits(c)));
+}
+
+inline uint64_t pixel_key(int i, int j){
+    return (uint64_t(uint32_t(j)) << 32) | uint32_t(i);
+}
+
+//largest double below 1, jittered strata can otherwise round up to exactly 1
+const double one_minus_epsilon = 0x1.fffffffffffffp-1;
+
+inline double bits_to_unit(uint32_t v){
+    return v * (1.0 / 4294967296.0);
+}
+
+inline uint32_t reverse_bits(uint32_t v){
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+//element i of a pseudo random permutation of [0, n) chosen by seed (Kensler, "Correlated Multi-Jittered Sampling")
+inline uint32_t permutation_element(uint32_t i, uint32_t n, uint32_t seed){
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+//hash based Owen scrambling: flips every bit depending on all the bits above it (Laine-Karras style)
+inline uint32_t owen_scramble(uint32_t v, uint32_t seed){
+    v = reverse_bits(v);
+    v ^= v * 0x3d20adea;
+    v += seed;
+    v *= (seed >> 16) | 1;
+    v ^= v * 0x05526c56;
+    v ^= v * 0x53a22864;
+    return reverse_bits(v);
+}
+
+//first Sobol dimension (van der Corput)
+inline uint32_t sobol_dim0(uint32_t index){
+    return reverse_bits(index);
+}
+
+//second Sobol dimension (primitive polynomial x + 1)
+inline uint32_t sobol_dim1(uint32_t index){
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1){
+        if (index & 1){
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+
+class IndependentSampler : public Sampler {
+    public:
+        IndependentSampler(uint64_t seed) : seed(seed) {}
+
+        void start_pixel_sample(int i, int j, int index) override {
+            pixel = pixel_key(i, j);
+            sample_index = index;
+            dimension = 0;
+            rng.seed(hash_sample(seed, pixel, 0), uint64_t(uint32_t(index)));
+        }
+
+        double get_1D() override {
+            dimension++;
+            return rng.uniform();
+        }
+
+        glm::dvec2 get_2D() override {
+            dimension += 2;
+            double u = rng.uniform();
+            return glm::dvec2(u, rng.uniform());
+        }
+
+        //every dimension uses two 32 bit outputs (uniform)
+        void set_dimension(uint32_t d) override {
+            rng.seed(hash_sample(seed, pixel, 0), uint64_t(uint32_t(sample_index)));
+            rng.advance(2 * uint64_t(d));
+            dimension = d;
+        }
+
+    private:
+        uint64_t seed;
+        uint64_t pixel = 0;
+        uint32_t sample_index = 0;
+        PCG32 rng;
+};
+
+
+class StratifiedSampler : public Sampler {
+    public:
+        StratifiedSampler(int samples_per_pixel, uint64_t seed) : samples(std::max(1, samples_per_pixel)), seed(seed) {
+            x_strata = std::max(1, int(std::sqrt(double(samples))));
+            y_strata = samples / x_strata;
+        }
+
+        void start_pixel_sample(int i, int j, int index) override {
+            pixel = pixel_key(i, j);
+            sample_index = index;
+            dimension = 0;
+            //the jitter inside a stratum is white noise
+            rng.seed(hash_sample(seed, pixel, 1), uint64_t(uint32_t(index)));
+        }
+
+        double get_1D() override {
+            uint32_t stratum = permutation_element(sample_index % samples, samples, uint32_t(hash_sample(seed, pixel, dimension)));
+            dimension++;
+            return std::min((stratum + rng.uniform()) / samples, one_minus_epsilon);
+        }
+
+        glm::dvec2 get_2D() override {
+            //past the grid (samples not a product of x_strata * y_strata) the extra samples reuse it with new jitter
+            uint32_t cells = x_strata * y_strata;
+            uint32_t stratum = permutation_element(sample_index % cells, cells, uint32_t(hash_sample(seed, pixel, dimension)));
+            dimension += 2;
+            double dx = rng.uniform();
+            double dy = rng.uniform();
+            return glm::dvec2(std::min((stratum % x_strata + dx) / x_strata, one_minus_epsilon),
+                              std::min((stratum / x_strata + dy) / y_strata, one_minus_epsilon));
+        }
+
+        void set_dimension(uint32_t d) override {
+            rng.seed(hash_sample(seed, pixel, 1), uint64_t(uint32_t(sample_index)));
+            rng.advance(2 * uint64_t(d));
+            dimension = d;
+        }
+
+    private:
+        uint32_t samples;
+        uint32_t x_strata, y_strata;
+        uint64_t seed;
+        uint64_t pixel = 0;
+        uint32_t sample_index = 0;
+        PCG32 rng;
+};
+
+
+class SobolSampler : public Sampler {
+    public:
+        SobolSampler(int samples_per_pixel, uint64_t seed) : samples(std::max(1, samples_per_pixel)), seed(seed) {}
+
+        void start_pixel_sample(int i, int j, int index) override {
+            pixel = pixel_key(i, j);
+            sample_index = index;
+            dimension = 0;
+        }
+
+        double get_1D() override {
+            uint64_t hash = hash_sample(seed, pixel, dimension);
+            dimension++;
+            uint32_t index = permutation_element(sample_index % samples, samples, uint32_t(hash)) + sample_index / samples * samples;
+            return bits_to_unit(owen_scramble(sobol_dim0(index), uint32_t(hash >> 32)));
+        }
+
+        glm::dvec2 get_2D() override {
+            uint64_t hash = hash_sample(seed, pixel, dimension);
+            uint64_t hash2 = mix_bits(hash);
+            dimension += 2;
+            uint32_t index = permutation_element(sample_index % samples, samples, uint32_t(hash)) + sample_index / samples * samples;
+            return glm::dvec2(bits_to_unit(owen_scramble(sobol_dim0(index), uint32_t(hash >> 32))),
+                              bits_to_unit(owen_scramble(sobol_dim1(index), uint32_t(hash2))));
+        }
+
+    private:
+        uint32_t samples;
+        uint64_t seed;
+        uint64_t pixel = 0;
+        uint32_t sample_index = 0;
+};
+
+
+/*
+BlueNoiseMask class
+
+64 x 64 tileable mask where every pixel holds its rank (normalised to [0, 1)) in a void-and-cluster ordering (Ulichney 1993):
+any threshold of the mask is an evenly spread set of pixels, so neighbouring pixels get values far apart
+Built once on first use, deterministic (fixed seed)
+*/
+
+class BlueNoiseMask {
+    public:
+        static constexpr int size = 64;
+
+        static const BlueNoiseMask& get(){
+            static BlueNoiseMask mask;
+            return mask;
+        }
+
+        double operator()(int x, int y) const {
+            return values[(y & (size - 1)) * size + (x & (size - 1))];
+        }
+
+    private:
+        static constexpr int radius = 6;
+        static constexpr double sigma = 1.5;
+        static constexpr int count = size * size;
+
+        std::vector<double> values;
+        double kernel[2 * radius + 1][2 * radius + 1];
+
+        BlueNoiseMask() : values(count) {
+            for (int dy = -radius; dy <= radius; dy++){
+                for (int dx = -radius; dx <= radius; dx++){
+                    kernel[dy + radius][dx + radius] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                }
+            }
+
+            //initial pattern: 10% of the pixels at random, then swap the tightest cluster into the largest void until stable
+            std::vector<char> bits(count, 0);
+            std::vector<double> energy(count, 0.0);
+            PCG32 rng(0xb1e, 0x5eed);
+            int ones = 0;
+            while (ones < count / 10){
+                int p = int(rng.next_u32() % count);
+                if (!bits[p]){
+                    set(bits, energy, p, true);
+                    ones++;
+                }
+            }
+            for (int iteration = 0; iteration < count; iteration++){
+                int cluster = tightest_cluster(bits, energy);
+                set(bits, energy, cluster, false);
+                int gap = largest_void(bits, energy);
+                set(bits, energy, gap, true);
+                if (gap == cluster){
+                    break;
+                }
+            }
+
+            std::vector<int> rank(count);
+
+            //ranks below the initial pattern: remove the tightest cluster one by one
+            std::vector<char> removing = bits;
+            std::vector<double> removing_energy = energy;
+            for (int r = ones - 1; r >= 0; r--){
+                int cluster = tightest_cluster(removing, removing_energy);
+                set(removing, removing_energy, cluster, false);
+                rank[cluster] = r;
+            }
+
+            //ranks above it: fill the largest void one by one
+            for (int r = ones; r < count; r++){
+                int gap = largest_void(bits, energy);
+                set(bits, energy, gap, true);
+                rank[gap] = r;
+            }
+
+            for (int p = 0; p < count; p++){
+                values[p] = (rank[p] + 0.5) / count;
+            }
+        }
+
+        //add or remove a pixel, updating the gaussian weighted energy of its (toroidal) neighbourhood
+        void set(std::vector<char>& bits, std::vector<double>& energy, int p, bool on) const {
+            bits[p] = on;
+            double sign = on ? 1.0 : -1.0;
+            int x = p % size, y = p / size;
+            for (int dy = -radius; dy <= radius; dy++){
+                for (int dx = -radius; dx <= radius; dx++){
+                    energy[((y + dy) & (size - 1)) * size + ((x + dx) & (size - 1))] += sign * kernel[dy + radius][dx + radius];
+                }
+            }
+        }
+
+        static int tightest_cluster(const std::vector<char>& bits, const std::vector<double>& energy){
+            int best = -1;
+            for (int p = 0; p < count; p++){
+                if (bits[p] && (best < 0 || energy[p] > energy[best])){
+                    best = p;
+                }
+            }
+            return best;
+        }
+
+        static int largest_void(const std::vector<char>& bits, const std::vector<double>& energy){
+            int best = -1;
+            for (int p = 0; p < count; p++){
+                if (!bits[p] && (best < 0 || energy[p] < energy[best])){
+                    best = p;
+                }
+            }
+            return best;
+        }
+};
+
+
+class BlueNoiseSampler : public Sampler {
+    public:
+        BlueNoiseSampler(uint64_t seed) : seed(seed), mask(BlueNoiseMask::get()) {}
+
+        void start_pixel_sample(int i, int j, int index) override {
+            x = i;
+            y = j;
+            sample_index = index;
+            dimension = 0;
+        }
+
+        double get_1D() override {
+            uint64_t hash = hash_sample(seed, dimension, 2);
+            double u = bits_to_unit(owen_scramble(sobol_dim0(sample_index), uint32_t(hash)));
+            dimension++;
+            return shift(u, hash >> 32);
+        }
+
+        glm::dvec2 get_2D() override {
+            uint64_t hash = hash_sample(seed, dimension, 2);
+            uint64_t hash2 = mix_bits(hash);
+            double u = bits_to_unit(owen_scramble(sobol_dim0(sample_index), uint32_t(hash)));
+            double v = bits_to_unit(owen_scramble(sobol_dim1(sample_index), uint32_t(hash2)));
+            dimension += 2;
+            return glm::dvec2(shift(u, hash >> 32), shift(v, hash2 >> 32));
+        }
+
+    private:
+        uint64_t seed;
+        const BlueNoiseMask& mask;
+        int x = 0, y = 0;
+        uint32_t sample_index = 0;
+
+        //Cranley-Patterson rotation by the mask value, read at a different offset of the mask for every dimension
+        double shift(double u, uint64_t offset) const {
+            double rotated = u + mask(x + int(offset & 0xffff), y + int((offset >> 16) & 0xffff));
+            return rotated >= 1.0 ? rotated - 1.0 : rotated;
+        }
+};
+
+
+inline std::unique_ptr<Sampler> make_sampler(SamplerType type, int samples_per_pixel, uint64_t seed){
+    switch (type){
+        case SamplerType::Stratified: return std::make_unique<StratifiedSampler>(samples_per_pixel, seed);
+        case SamplerType::Sobol: return std::make_unique<SobolSampler>(samples_per_pixel, seed);
+        case SamplerType::BlueNoise: return std::make_unique<BlueNoiseSampler>(seed);
+        default: return std::make_unique<IndependentSampler>(seed);
+    }
+}
+
+//warp a 2D sample to a uniformly distributed direction
+inline vec3 sample_unit_sphere(glm::dvec2 u){
+    double z = 1.0 - 2.0 * u.x;
+    double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+    double phi = 2.0 * pi * u.y;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef SHARED_SCENE_H
+#define SHARED_SCENE_H
+
+#include "helper.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "triangle.h"
+#include "KDTree.h"
+#include <atomic>
+#include <new>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/*
+Shared memory scene
+
+Lets several raytracer processes on one node use a single copy of the same mesh + kd tree
+The first process to ask for a segment loads the mesh, builds the tree and copies both into a named segment
+Every later process maps the segment read-only, so it costs almost no memory per process
+
+Segment names
+- "/name"                : POSIX shared memory (shm_open, lives in /dev/shm)
+- any path with a second '/' (e.g. "/dev/hugepages/dragon") : regular file, use a hugetlbfs mount for hugepage backing
+
+Layout of a segment (offsets are stored in the header)
+- SceneHeader
+- triangles  : 3 point3 per triangle, in the order of the hittable_list they were published from
+- nodes      : flattened KD_Node array (empty when published without a tree)
+- indices    : leaf primitive indices of the tree
+
+Synchronisation
+- the publisher takes an exclusive flock on the segment right after creating it and gives it a size straight away,
+  under that lock, readers take a shared flock before mapping
+- the kernel drops the lock if the publisher dies, so a reader that gets the shared lock on a sized segment that is not
+  Ready takes the exclusive lock, removes the unfinished segment and publishes the scene again itself, instead of every
+  later process loading its own copy; an empty segment has not been locked by its publisher yet and is waited for
+- a publisher that fails removes its segment before it unlocks it
+*/
+
+struct SceneHeader {
+    static constexpr uint64_t magic_value = 0x53434e4552415952; //"RAYRENCS"
+    static constexpr uint32_t current_version = 1;
+
+    enum State : uint32_t { Building = 0, Ready = 1 };
+
+    uint64_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> state;
+    uint64_t total_bytes;
+    uint64_t num_triangles, num_nodes, num_indices;
+    uint64_t triangle_offset, node_offset, index_offset;
+    point3 bounds_min, bounds_max;
+};
+
+struct MeshTriangle {
+    point3 v[3];
+};
+
+
+//owns one mapping of a segment, unmapped when the last mesh using it goes away
+class SharedSegment {
+    public:
+        SharedSegment(void* addr, size_t size) : addr(addr), size(size) {}
+        ~SharedSegment() { munmap(addr, size); }
+
+        const SceneHeader& header() const { return *static_cast<const SceneHeader*>(addr); }
+
+        template <typename T>
+        const T* at(uint64_t offset) const {
+            return reinterpret_cast<const T*>(static_cast<const char*>(addr) + offset);
+        }
+
+    private:
+        void* addr;
+        size_t size;
+};
+
+
+/*
+shared_mesh class
+
+Read-only triangle mesh living in a shared segment
+Uses the published kd tree when there is one, otherwise tests every triangle
+All triangles share one material (materials are per process and can't live in the segment)
+Its hits carry no object, so it can't be a light (the light list needs the emitting triangles), emissive meshes are loaded privately
+*/
+class shared_mesh : public hittable {
+    public:
+        shared_mesh(shared_ptr<SharedSegment> segment, shared_ptr<material> mat) : segment(segment), mat(mat) {
+            const SceneHeader& header = segment->header();
+            triangles = segment->at<MeshTriangle>(header.triangle_offset);
+            nodes = segment->at<KD_Node>(header.node_offset);
+            indices = segment->at<int>(header.index_offset);
+            num_triangles = header.num_triangles;
+            num_nodes = header.num_nodes;
+        }
+
+        bool hit(const Ray& r, interval ray_t, hit_record& rec) const override {
+            auto prim_hit = [this](int prim, const Ray& r, interval ray_t, hit_record& rec) {
+                const MeshTriangle& tri = triangles[prim];
+                return hit_triangle(tri.v[0], tri.v[1], tri.v[2], r, ray_t, rec);
+            };
+
+            bool hit_anything = false;
+            if (num_nodes > 0){
+                hit_anything = kd_traverse(nodes, indices, BoundingBox(), r, ray_t, rec, prim_hit);
+            } else {
+                auto closest = ray_t.max;
+                for (size_t i = 0; i < num_triangles; i++){
+                    if (prim_hit(i, r, interval(ray_t.min, closest), rec)){
+                        hit_anything = true;
+                        closest = rec.t;
+                    }
+                }
+            }
+
+            if (hit_anything){
+                rec.mat = mat;
+                rec.object = nullptr;
+            }
+            return hit_anything;
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            auto prim_occluded = [this](int prim, const Ray& r, interval ray_t) {
+                const MeshTriangle& tri = triangles[prim];
+                double t;
+                return intersect_triangle(tri.v[0], tri.v[1], tri.v[2], r, ray_t, t);
+            };
+            if (num_nodes > 0){
+                return kd_occluded(nodes, indices, BoundingBox(), r, ray_t, prim_occluded);
+            }
+            for (size_t i = 0; i < num_triangles; i++){
+                if (prim_occluded(i, r, ray_t)){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        uint32_t hit_packet(const RayPacket& packet, uint32_t mask, double t_min, double* closest, hit_record* recs) const override {
+            if (num_nodes == 0){
+                return hittable::hit_packet(packet, mask, t_min, closest, recs);
+            }
+            uint32_t hits = kd_traverse_packet(nodes, indices, BoundingBox(), packet, mask, t_min, closest, recs,
+                [this](int prim, const Ray& r, interval ray_t, hit_record& rec) {
+                    const MeshTriangle& tri = triangles[prim];
+                    return hit_triangle(tri.v[0], tri.v[1], tri.v[2], r, ray_t, rec);
+                });
+            for (uint32_t m = hits; m; m &= m - 1){
+                recs[__builtin_ctz(m)].mat = mat;
+                recs[__builtin_ctz(m)].object = nullptr;
+            }
+            return hits;
+        }
+
+        Bounds3f BoundingBox() const override {
+            const SceneHeader& header = segment->header();
+            return Bounds3f(header.bounds_min, header.bounds_max);
+        }
+
+        size_t size() const { return num_triangles; }
+
+    private:
+        shared_ptr<SharedSegment> segment;
+        shared_ptr<material> mat;
+        const MeshTriangle* triangles;
+        const KD_Node* nodes;
+        const int* indices;
+        size_t num_triangles;
+        size_t num_nodes;
+};
+
+
+class SharedScene {
+    public:
+
+        //map the segment `name` if another process already published it
+        //otherwise run load, build the tree (optional) and publish the result for the next processes
+        static shared_ptr<hittable> attach_or_publish(const std::string& name, shared_ptr<material> mat, const std::function<void(hittable_list&)>& load, bool build_tree = true){
+            if (mat->emissive){
+                std::cerr << "Shared scenes can't be lights, loading " << name << " privately\n";
+                return load_private(load);
+            }
+            //a round ends when the segment was removed (by us, as unfinished, or by someone else), the next one creates it again
+            for (int round = 0; round < 3; round++){
+                int fd = open_segment(name, O_CREAT | O_EXCL | O_RDWR);
+                if (fd >= 0){
+                    //locked first and sized at once, before loading, so readers can tell a segment whose publisher died
+                    //(sized, not Ready) from one whose publisher has not locked it yet (empty)
+                    flock(fd, LOCK_EX);
+                    auto mesh = ftruncate(fd, segment_alignment) == 0 ? publish(fd, mat, load, build_tree) : nullptr;
+                    if (!mesh){
+                        remove(name);
+                    }
+                    flock(fd, LOCK_UN);
+                    ::close(fd);
+                    if (mesh){
+                        std::clog << "Published scene to " << name << '\n';
+                        return mesh;
+                    }
+                    return load_private(load);
+                }
+                if (errno != EEXIST){
+                    std::cerr << "Could not create " << name << ": " << std::strerror(errno) << ", loading privately\n";
+                    return load_private(load);
+                }
+
+                //the shared lock waits for a publisher that is building, a sized segment that is still not Ready once we
+                //have it belongs to a publisher that died, an empty one to a publisher that has not taken its lock yet
+                //(one that died right after creating it leaves an empty segment, waited for until we load privately)
+                for (int attempt = 0; attempt < 50; attempt++){
+                    fd = open_segment(name, O_RDONLY);
+                    if (fd < 0){
+                        break;
+                    }
+                    flock(fd, LOCK_SH);
+                    bool empty = is_empty(fd);
+                    auto mesh = empty ? nullptr : attach(fd, mat);
+                    flock(fd, LOCK_UN);
+                    if (mesh){
+                        ::close(fd);
+                        std::clog << "Attached to shared scene " << name << '\n';
+                        return mesh;
+                    }
+                    if (!empty){
+                        remove_unfinished(name, fd, mat);
+                        ::close(fd);
+                        break;
+                    }
+                    ::close(fd);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+            }
+
+            std::cerr << "Shared scene " << name << " could not be published or attached, loading privately\n";
+            return load_private(load);
+        }
+
+        //remove the segment, processes that already mapped it keep their mapping
+        static void remove(const std::string& name){
+            if (is_file_path(name)){
+                ::unlink(name.c_str());
+            } else {
+                shm_unlink(name.c_str());
+            }
+        }
+
+    private:
+        //round segments up to 2 MiB so hugetlbfs accepts the size (and transparent hugepages can back shm)
+        static constexpr size_t segment_alignment = 2 << 20;
+
+        static bool is_file_path(const std::string& name){
+            return name.find('/', 1) != std::string::npos;
+        }
+
+        static int open_segment(const std::string& name, int flags){
+            if (is_file_path(name)){
+                return ::open(name.c_str(), flags | O_CLOEXEC, 0644);
+            }
+            return shm_open(name.c_str(), flags, 0644);
+        }
+
+        //whether the segment open as fd has no size yet (its publisher has not locked it)
+        static bool is_empty(int fd){
+            struct stat st;
+            return fstat(fd, &st) == 0 && st.st_size == 0;
+        }
+
+        static size_t align_up(size_t value, size_t alignment){
+            return (value + alignment - 1) / alignment * alignment;
+        }
+
+        //remove the segment open as fd, whose publisher died before it was Ready, so it can be published again
+        //under the exclusive lock, and only if name still refers to it (another reader may already have replaced it)
+        static void remove_unfinished(const std::string& name, int fd, shared_ptr<material> mat){
+            flock(fd, LOCK_EX);
+            struct stat ours, current;
+            int check = open_segment(name, O_RDONLY);
+            bool same = check >= 0 && fstat(fd, &ours) == 0 && fstat(check, &current) == 0
+                        && ours.st_dev == current.st_dev && ours.st_ino == current.st_ino;
+            if (check >= 0){
+                ::close(check);
+            }
+            if (same && ours.st_size > 0 && attach(fd, mat) == nullptr){
+                std::clog << "Shared scene " << name << " was never completed (publisher died), publishing it again\n";
+                remove(name);
+            }
+            flock(fd, LOCK_UN);
+        }
+
+        static shared_ptr<hittable> load_private(const std::function<void(hittable_list&)>& load){
+            auto world = make_shared<hittable_list>();
+            load(*world);
+            return world;
+        }
+
+        static shared_ptr<hittable> publish(int fd, shared_ptr<material> mat, const std::function<void(hittable_list&)>& load, bool build_tree){
+            //everything here is process local and freed once copied into the segment
+            hittable_list world;
+            load(world);
+            if (world.size() == 0){
+                return nullptr;
+            }
+
+            std::vector<MeshTriangle> triangles;
+            triangles.reserve(world.size());
+            for (const auto& object : world.objects){
+                auto tri = std::dynamic_pointer_cast<triangle>(object);
+                if (!tri){
+                    std::cerr << "Shared scenes only hold triangles\n";
+                    return nullptr;
+                }
+                triangles.push_back({{tri->v0(), tri->v1(), tri->v2()}});
+            }
+
+            std::unique_ptr<KDTree> tree;
+            if (build_tree){
+                tree = std::make_unique<KDTree>(world);
+            }
+            size_t num_nodes = tree ? tree->nodeList().size() : 0;
+            size_t num_indices = tree ? tree->triIndices().size() : 0;
+
+            SceneHeader layout;
+            layout.triangle_offset = align_up(sizeof(SceneHeader), 64);
+            layout.node_offset = align_up(layout.triangle_offset + triangles.size() * sizeof(MeshTriangle), 64);
+            layout.index_offset = align_up(layout.node_offset + num_nodes * sizeof(KD_Node), 64);
+            size_t total = align_up(layout.index_offset + num_indices * sizeof(int), segment_alignment);
+
+            if (ftruncate(fd, total) != 0){
+                std::cerr << "Could not size shared scene: " << std::strerror(errno) << '\n';
+                return nullptr;
+            }
+            void* addr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED){
+                std::cerr << "Could not map shared scene: " << std::strerror(errno) << '\n';
+                return nullptr;
+            }
+
+            char* base = static_cast<char*>(addr);
+            auto* header = new (base) SceneHeader();
+            header->magic = SceneHeader::magic_value;
+            header->version = SceneHeader::current_version;
+            header->total_bytes = total;
+            header->num_triangles = triangles.size();
+            header->num_nodes = num_nodes;
+            header->num_indices = num_indices;
+            header->triangle_offset = layout.triangle_offset;
+            header->node_offset = layout.node_offset;
+            header->index_offset = layout.index_offset;
+            Bounds3f box = world.BoundingBox();
+            header->bounds_min = box.min;
+            header->bounds_max = box.max;
+
+            std::memcpy(base + layout.triangle_offset, triangles.data(), triangles.size() * sizeof(MeshTriangle));
+            if (tree){
+                std::memcpy(base + layout.node_offset, tree->nodeList().data(), num_nodes * sizeof(KD_Node));
+                std::memcpy(base + layout.index_offset, tree->triIndices().data(), num_indices * sizeof(int));
+            }
+            header->state.store(SceneHeader::Ready, std::memory_order_release);
+
+            //the publisher uses the segment like everyone else, read-only
+            mprotect(addr, total, PROT_READ);
+            return make_shared<shared_mesh>(make_shared<SharedSegment>(addr, total), mat);
+        }
+
+        static shared_ptr<hittable> attach(int fd, shared_ptr<material> mat){
+            struct stat st;
+            if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SceneHeader)){
+                return nullptr;
+            }
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED){
+                return nullptr;
+            }
+            auto segment = make_shared<SharedSegment>(addr, st.st_size);
+            const SceneHeader& header = segment->header();
+            if (header.magic != SceneHeader::magic_value || header.version != SceneHeader::current_version
+                || header.state.load(std::memory_order_acquire) != SceneHeader::Ready || header.total_bytes > size_t(st.st_size)){
+                return nullptr;
+            }
+            return make_shared<shared_mesh>(segment, mat);
+        }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "helper.h"
+#include "sampler.h"
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/norm.hpp>
 #include <stdlib.h>
@@ -12,11 +13,113 @@ class sphere: public hittable {
     public:
         sphere(const point3& center, double radius, shared_ptr<material> mat) : center(center), radius(std::fmax(0, radius)), mat(mat) {}
 
+        bool hit(const Ray&r, interval ray_t, hit_record& rec) const override {
+            double root;
+            if (!intersect(r, ray_t, root)){
+                return false;
+            }
+
+            //set hit record members (compute normalized normal by dividing by radius)
+            rec.t = root;
+            rec.p = r.eval(root);
+            vec3 outward_normal = (rec.p - center) / radius;
+            rec.set_face_normal(r, outward_normal);
+            rec.mat = mat;
+            rec.object = this;
+            return true;
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            double root;
+            return intersect(r, ray_t, root);
+        }
+
+        Bounds3f BoundingBox() const override {
+            return Bounds3f(center - vec3(radius), center + vec3(radius));
+        }
+
+        //from outside: uniform direction in the cone the sphere covers, from inside: uniform point on the surface
+        bool sample_surface(const point3& ref, glm::dvec2 u, surface_sample& sample) const override {
+            vec3 to_center = center - ref;
+            double d2 = glm::length2(to_center);
+            sample.mat = mat.get();
+            if (d2 <= radius*radius){
+                sample.normal = sample_unit_sphere(u);
+                sample.p = center + radius * sample.normal;
+                sample.pdf = area_pdf(ref, sample.p, sample.normal);
+                return sample.pdf > 0;
+            }
+
+            double sin2_max = radius*radius / d2;
+            double cos_max = std::sqrt(std::max(0.0, 1.0 - sin2_max));
+            double cos_theta = 1.0 - u.x * (sin2_max / (1.0 + cos_max));
+            double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
+            double phi = 2.0 * pi * u.y;
+
+            //orthonormal basis around the direction to the center
+            double d = std::sqrt(d2);
+            vec3 w = to_center / d;
+            vec3 a = std::fabs(w.x) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+            vec3 s = glm::normalize(glm::cross(a, w));
+            vec3 t = glm::cross(w, s);
+            vec3 dir = sin_theta * std::cos(phi) * s + sin_theta * std::sin(phi) * t + cos_theta * w;
+
+            //first intersection along dir (the tangent point if rounding puts dir just outside the cone)
+            double distance = d * cos_theta - std::sqrt(std::max(0.0, radius*radius - d2 * sin_theta*sin_theta));
+            sample.p = ref + distance * dir;
+            sample.normal = (sample.p - center) / radius;
+            sample.pdf = cone_pdf(sin2_max, cos_max);
+            return true;
+        }
+
+        double surface_pdf(const point3& ref, const hit_record& rec) const override {
+            double d2 = glm::length2(center - ref);
+            if (d2 <= radius*radius){
+                return area_pdf(ref, rec.p, (rec.p - center) / radius);
+            }
+            double sin2_max = radius*radius / d2;
+            return cone_pdf(sin2_max, std::sqrt(std::max(0.0, 1.0 - sin2_max)));
+        }
+
+        bool sample_point(glm::dvec2 u, point3& p, vec3& normal) const override {
+            normal = sample_unit_sphere(u);
+            p = center + radius * normal;
+            return true;
+        }
+
+        bool describe_emitter(emitter_shape& shape) const override {
+            shape.area = 4.0 * pi * radius*radius;
+            shape.axis = vec3(0, 0, 1);
+            shape.cos_theta_o = -1;
+            shape.two_sided = false;
+            shape.mat = mat.get();
+            return true;
+        }
+
+    private:
+        point3 center;
+        double radius;
+        shared_ptr<material> mat;
+
+        //1 / solid angle of the cone (1 - cos_max written as sin2_max / (1 + cos_max) so far away spheres don't cancel to 0)
+        static double cone_pdf(double sin2_max, double cos_max){
+            return 1.0 / (2.0 * pi * sin2_max / (1.0 + cos_max));
+        }
+
+        //uniform area density converted to solid angle
+        double area_pdf(const point3& ref, const point3& p, const vec3& normal) const {
+            vec3 to_p = p - ref;
+            double d2 = glm::length2(to_p);
+            double cosine = std::fabs(glm::dot(normal, to_p)) / std::sqrt(d2);
+            return cosine > 0 ? d2 / (cosine * 4.0 * pi * radius*radius) : 0;
+        }
+
         //sphere intersection code
         //need the radius (double), center (point 3), Ray r
         //compute the ray-sphere intersection components
         //check discriminant (if the ray passes through the sphere (disc >= 0), then colour it red)
-        bool hit(const Ray&r, interval ray_t, hit_record& rec) const override {
+        //gives the nearest root inside ray_t
+        bool intersect(const Ray& r, interval ray_t, double& root) const {
             //check for if the center of the sphere is behind the camera 
             //uses squared length for faster computations (avoid square root)
             vec3 diff = center - r.origin();
@@ -32,32 +135,15 @@ class sphere: public hittable {
             auto sqrtd = std::sqrt(disc);
 
             //check if the solutions fall in the range of acceptable t's
-            auto root = (h - sqrtd) / a;
+            root = (h - sqrtd) / a;
             if (!ray_t.surrounds(root)){
                 root = (h + sqrtd) / a;
                 if (!ray_t.surrounds(root)){
                     return false;
                 }
             }
-
-            //set hit record members (compute normalized normal by dividing by radius)
-            rec.t = root;
-            rec.p = r.eval(root);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat = mat;
             return true;
         }
-
-        Bounds3f BoundingBox() const override {
-            
-            return Bounds3f(point3(0, 0, 0), point3(0, 0, 0)); 
-        }
-
-    private:
-        point3 center;
-        double radius;
-        shared_ptr<material> mat;
 };
 
 #endif
\ No newline at end of file
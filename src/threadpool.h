@@ -2,101 +2,513 @@
 #define THREADPOOL_H
 
 #include "helper.h"
+#include "numa.h"
+#include <atomic>
 #include <condition_variable>
-#include <functional>
+#include <cstring>
+#include <deque>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <type_traits>
 
 /*
-ThreadPool class
+Task class
 
-- unique lock  : locks the mutex and unlocks when out of scope
-- emplace_back : similar to push back but it constructs the element in the structure instead of copying 
+Fixed size storage for a callable so queueing a task never allocates (unlike std::function)
+The callable is copied byte for byte into the task, so it has to be trivially copyable and small
+(lambdas capturing by reference, pointers, ints, tiles... are fine, capture std::function/shared_ptr by reference instead)
+*/
 
+class Task {
+    public:
+        static constexpr size_t words = 8;
+        static constexpr size_t storage_size = (words - 1) * sizeof(uint64_t);
 
-Members
-- threads     : vector containing instantiated threads
-- tasks       : queue containing tasks
-- queue_mutex : mutex for the queue for locking
-- cv          : condition variable for managing threads
-- stop        : variable used by the condition variable
+        Task() = default;
 
+        template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+        Task(F&& f){
+            using Fn = std::decay_t<F>;
+            static_assert(sizeof(Fn) <= storage_size, "task capture is too big for the inline storage, capture by reference");
+            static_assert(alignof(Fn) <= alignof(uint64_t), "task capture is over-aligned");
+            static_assert(std::is_trivially_copyable_v<Fn> && std::is_trivially_destructible_v<Fn>, "task capture must be trivially copyable, capture by reference");
+            new (storage) Fn(std::forward<F>(f));
+            invoke = [](void* fn) { (*static_cast<Fn*>(fn))(); };
+        }
 
-Methods
-- constructor : lock the queue, wait until there is a task in the queue, run the task
-- destructor  : lock the queue, notify all threads and join
-- enqueue     : lock the queue, pass ownership of the task to the vector and notify a waiting thread
+        void operator()() { invoke(storage); }
+
+    private:
+        void (*invoke)(void*) = nullptr;
+        alignas(uint64_t) unsigned char storage[storage_size];
+};
+
+static_assert(sizeof(Task) == Task::words * sizeof(uint64_t) && std::is_trivially_copyable_v<Task>);
 
+
+/*
+WorkDeque class
+
+Chase-Lev work stealing deque (fixed capacity, C11 memory orders from Le et al. 2013)
+- the owning worker pushes and pops at the bottom (LIFO, keeps its cache warm)
+- other workers steal from the top (FIFO, takes the oldest and usually largest piece of work)
+Slots are stored as atomic words so a thief copying a slot never races with the owner in the C++ memory model
+*/
+
+class WorkDeque {
+    public:
+        static constexpr int64_t capacity = 4096;
+
+        WorkDeque() : slots(new Slot[capacity]) {}
+
+        //owner only, false when full
+        bool push(const Task& task){
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            int64_t t = top.load(std::memory_order_acquire);
+            if (b - t >= capacity){
+                return false;
+            }
+            store(slots[b & (capacity - 1)], task);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        //owner only
+        bool pop(Task& task){
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_relaxed);
+
+            if (t > b){
+                //empty
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            load(slots[b & (capacity - 1)], task);
+            if (t == b){
+                //last task, race the thieves for it
+                bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return won;
+            }
+            return true;
+        }
+
+        //any thread
+        bool steal(Task& task){
+            int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b){
+                return false;
+            }
+            load(slots[t & (capacity - 1)], task);
+            return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        }
+
+        bool empty() const {
+            return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+        }
+
+    private:
+        struct Slot {
+            std::atomic<uint64_t> words[Task::words];
+        };
+
+        std::unique_ptr<Slot[]> slots;
+        alignas(64) std::atomic<int64_t> top{0};
+        alignas(64) std::atomic<int64_t> bottom{0};
+
+        static void store(Slot& slot, const Task& task){
+            uint64_t words[Task::words];
+            std::memcpy(words, &task, sizeof(Task));
+            for (size_t i = 0; i < Task::words; i++){
+                slot.words[i].store(words[i], std::memory_order_relaxed);
+            }
+        }
+
+        static void load(const Slot& slot, Task& task){
+            uint64_t words[Task::words];
+            for (size_t i = 0; i < Task::words; i++){
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            }
+            std::memcpy(&task, words, sizeof(Task));
+        }
+};
+
+
+/*
+TaskGroup class
+
+Handle for a set of tasks, ThreadPool::wait(group) returns once all of them have finished
+Lives on the stack of whoever waits, so it has to outlive the tasks (wait before it goes out of scope)
+*/
+
+class TaskGroup {
+    public:
+        TaskGroup() = default;
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        bool done() const { return remaining.load(std::memory_order_acquire) == 0; }
+
+    private:
+        friend class ThreadPool;
+        std::atomic<int64_t> remaining{0};
+};
+
+
+/*
+ThreadPool class (work stealing)
+
+- every worker owns a WorkDeque, tasks enqueued from inside a task go to the worker's own deque
+- tasks enqueued from outside the pool (e.g. the main thread) go to a shared injection queue,
+  workers take them in small batches so the injection lock is not hit once per task
+- a worker with nothing to do steals from a random victim (same NUMA node first), then backs off (pause -> yield -> sleep)
+- workers can be pinned to a list of cpus (see Topology::pinned_cpus), otherwise the scheduler places them
+
+Members
+- threads   : vector containing instantiated threads
+- deques    : one work stealing deque per worker
+- nodes     : NUMA node of each pinned worker (all 0 when not pinned)
+- injected  : queue for tasks coming from threads outside the pool (protected by inject_mutex)
+- pending   : number of tasks enqueued but not finished yet
+- epoch     : bumped on every enqueue and finished group, sleeping threads wait for it to change
+- sleepers  : number of workers blocked on cv, enqueue only touches the mutex when this is non zero
+- stop      : set by the destructor, workers exit once it is set and pending reaches 0
+
+Methods
+- constructor  : start the workers
+- destructor   : wait until every task ran, then join
+- global       : process wide pool (one thread per core, or per cpu given to configure_global) that stays warm between frames
+- enqueue      : push the task to the current worker's deque, or to the injection queue from outside the pool
+                 (optionally counted in a TaskGroup)
+- wait         : block until a group is done, the waiting thread runs queued tasks meanwhile instead of idling
+- parallel_for : run body(lo, hi) over [begin, end) in chunks of at most grain, split recursively so idle workers steal halves
 */
 
 class ThreadPool {
     private:
         std::vector<std::thread> threads;
-        std::queue<std::function<void()>> tasks;
-        std::mutex queue_mutex;
+        std::vector<std::unique_ptr<WorkDeque>> deques;
+        std::vector<int> nodes;
+
+        std::mutex inject_mutex;
+        std::deque<Task> injected;
+        std::atomic<size_t> injected_size{0};
+
+        std::atomic<int64_t> pending{0};
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<int> sleepers{0};
+        std::mutex sleep_mutex;
         std::condition_variable cv;
-        bool stop = false;
+        std::atomic<bool> stop{false};
+
+        //which pool/worker the current thread belongs to (-1 outside any pool)
+        static inline thread_local ThreadPool* current_pool = nullptr;
+        static inline thread_local int current_index = -1;
 
     public:
-        ThreadPool(size_t num_threads) {
+        //cpus: worker i is pinned to cpus[i % cpus.size()], empty leaves placement to the scheduler
+        ThreadPool(size_t num_threads, const std::vector<int>& cpus = {}) {
+            num_threads = std::max<size_t>(num_threads, 1);
             for (size_t i = 0; i < num_threads; i++){
-                threads.emplace_back([this] {
-                    while (true){
-                        std::function<void()> task;
-                        {
-                            //lock on the queue mutex to make the thread sleep till one task is in the queue
-                            std::unique_lock<std::mutex> lock(queue_mutex);
-
-                            //make the thread 
-                            cv.wait(lock, [this] {
-                                return !tasks.empty() || stop;
-                            });
-
-                            if (stop && tasks.empty()){
-                                return;
-                            }
-
-                            //dequeue task
-                            task = move(tasks.front());
-                            tasks.pop();
-                        }
-                        
-                        //run task
-                        task();
+                deques.emplace_back(new WorkDeque());
+                nodes.push_back(cpus.empty() ? 0 : Topology::get().node_of_cpu(cpus[i % cpus.size()]));
+            }
+            for (size_t i = 0; i < num_threads; i++){
+                int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+                threads.emplace_back([this, i, cpu] {
+                    if (cpu >= 0 && !pin_current_thread({cpu})){
+                        std::cerr << "Could not pin worker " << i << " to cpu " << cpu << '\n';
                     }
-                    
+                    worker_loop(i);
                 });
             }
-
         }
 
         ~ThreadPool() {
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                stop = true;
-            }
-            
-            cv.notify_all();
+            stop.store(true);
+            wake_all();
 
             //join all the threads
             for(auto& thread : threads){
                 thread.join();
             }
+        }
+
+        size_t size() const { return threads.size(); }
+
+        //shared pool, created on first use and joined at exit
+        static ThreadPool& global(){
+            static std::once_flag once;
+            std::call_once(once, [] {
+                const std::vector<int>& cpus = global_cpus();
+                size_t count = cpus.empty() ? std::thread::hardware_concurrency() : cpus.size();
+                global_slot().reset(new ThreadPool(count, cpus));
+            });
+            return *global_slot();
+        }
 
+        //pin the global pool's workers (one per cpu in the list), only has an effect before the first call to global()
+        static void configure_global(const std::vector<int>& cpus){
+            global_cpus() = cpus;
         }
 
         //enqueue function to push task into queue
-        void enqueue(std::function<void()> task){
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                tasks.emplace(move(task));
+        template <typename F>
+        void enqueue(F&& f){
+            Task task(std::forward<F>(f));
+            pending.fetch_add(1, std::memory_order_relaxed);
+
+            if (current_pool == this){
+                if (!deques[current_index]->push(task)){
+                    //own deque is full, running inline keeps memory bounded
+                    run(task);
+                    return;
+                }
+            } else {
+                std::unique_lock<std::mutex> lock(inject_mutex);
+                injected.push_back(task);
+                injected_size.store(injected.size(), std::memory_order_release);
             }
-            
-            cv.notify_one();
+            notify();
+        }
+
+        //enqueue a task that counts towards group
+        template <typename F>
+        void enqueue(TaskGroup& group, F&& f){
+            group.remaining.fetch_add(1, std::memory_order_relaxed);
+            enqueue([this, g = &group, f = std::forward<F>(f)]() mutable {
+                f();
+                //g may be gone as soon as the count reaches 0, only the pool is touched after this
+                if (g->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1){
+                    wake_all();
+                }
+            });
+        }
+
+        //wait for every task in the group, helping with queued work meanwhile
+        //safe to call from inside a task (the worker keeps running other tasks instead of blocking)
+        void wait(TaskGroup& group){
+            int index = (current_pool == this) ? current_index : -1;
+            uint64_t rng = 0x2545f4914f6cdd1dull ^ reinterpret_cast<uintptr_t>(&group);
+            int idle = 0;
+            while (!group.done()){
+                Task task;
+                if (find_task(index, rng, task)){
+                    idle = 0;
+                    run(task);
+                    continue;
+                }
+                //the rest of the group is running elsewhere, back off like an idle worker
+                idle++;
+                if (idle < 64){
+                    cpu_relax();
+                } else if (idle < 128){
+                    std::this_thread::yield();
+                } else {
+                    idle_wait([&] { return group.done(); });
+                    idle = 0;
+                }
+            }
+        }
+
+        template <typename F>
+        void parallel_for(int64_t begin, int64_t end, int64_t grain, const F& body){
+            if (begin >= end){
+                return;
+            }
+            TaskGroup group;
+            ForContext<F> context{this, &group, std::max<int64_t>(grain, 1), &body};
+            split_range(&context, begin, end);
+            wait(group);
+        }
+
+    private:
+
+        static std::unique_ptr<ThreadPool>& global_slot(){
+            static std::unique_ptr<ThreadPool> pool;
+            return pool;
+        }
+
+        static std::vector<int>& global_cpus(){
+            static std::vector<int> cpus;
+            return cpus;
+        }
+
+        template <typename F>
+        struct ForContext {
+            ThreadPool* pool;
+            TaskGroup* group;
+            int64_t grain;
+            const F* body;
+        };
+
+        //hand the upper halves to the pool until the range is small enough, then run what is left here
+        template <typename F>
+        static void split_range(const ForContext<F>* context, int64_t begin, int64_t end){
+            while (end - begin > context->grain){
+                int64_t mid = begin + (end - begin) / 2;
+                context->pool->enqueue(*context->group, [context, mid, end] {
+                    split_range(context, mid, end);
+                });
+                end = mid;
+            }
+            (*context->body)(begin, end);
+        }
+
+        void worker_loop(size_t index){
+            current_pool = this;
+            current_index = index;
+            uint64_t rng = 0x9e3779b97f4a7c15ull * (index + 1);
+            int idle = 0;
+
+            while (true){
+                Task task;
+                if (find_task(index, rng, task)){
+                    idle = 0;
+                    run(task);
+                    continue;
+                }
+
+                if (stop.load() && pending.load() == 0){
+                    return;
+                }
+
+                //idle backoff: spin a little, then yield, then sleep until new work shows up
+                idle++;
+                if (idle < 64){
+                    cpu_relax();
+                } else if (idle < 128){
+                    std::this_thread::yield();
+                } else {
+                    idle_wait([this] { return stop.load() && pending.load() == 0; });
+                    idle = 0;
+                }
+            }
+        }
+
+        //index is the worker's own deque, -1 for threads outside the pool (waiting in wait())
+        bool find_task(int index, uint64_t& rng, Task& task){
+            if (index >= 0 && deques[index]->pop(task)){
+                return true;
+            }
+            if (take_injected(index, task)){
+                return true;
+            }
+
+            //steal starting at a random victim, workers on our own NUMA node first (their tasks touch memory close to us)
+            size_t n = deques.size();
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            size_t start = rng % n;
+            int node = (index >= 0) ? nodes[index] : -1;
+            for (int pass = 0; pass < 2; pass++){
+                for (size_t k = 0; k < n; k++){
+                    size_t victim = (start + k) % n;
+                    if (int(victim) == index || (node >= 0 && (nodes[victim] == node) != (pass == 0))){
+                        continue;
+                    }
+                    if (deques[victim]->steal(task)){
+                        return true;
+                    }
+                }
+                if (node < 0){
+                    break;
+                }
+            }
+            return false;
+        }
+
+        //take a batch from the injection queue, run the first and keep the rest in our deque for others to steal
+        bool take_injected(int index, Task& task){
+            if (injected_size.load(std::memory_order_acquire) == 0){
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(inject_mutex);
+            if (injected.empty()){
+                return false;
+            }
+            size_t batch = std::min<size_t>({32, injected.size(), injected.size() / deques.size() + 1});
+            task = injected.front();
+            injected.pop_front();
+            if (index < 0){
+                batch = 1;
+            }
+            for (size_t k = 1; k < batch; k++){
+                if (!deques[index]->push(injected.front())){
+                    break;
+                }
+                injected.pop_front();
+            }
+            injected_size.store(injected.size(), std::memory_order_release);
+            lock.unlock();
+            if (batch > 1){
+                notify();
+            }
+            return true;
+        }
+
+        void run(Task& task){
+            task();
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1 && stop.load()){
+                wake_all();
+            }
+        }
+
+        bool has_work() const {
+            if (injected_size.load(std::memory_order_acquire) > 0){
+                return true;
+            }
+            for (const auto& deque : deques){
+                if (!deque->empty()){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //sleep until something is enqueued or finished (epoch changes) or until the caller's condition holds
+        template <typename Done>
+        void idle_wait(const Done& finished){
+            uint64_t seen = epoch.load();
+            sleepers.fetch_add(1);
+            //re-check after announcing ourselves, an enqueue in between either shows up here or sees sleepers > 0
+            if (!has_work() && !finished()){
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                cv.wait(lock, [&] {
+                    return epoch.load() != seen || finished();
+                });
+            }
+            sleepers.fetch_sub(1);
+        }
+
+        void notify(){
+            epoch.fetch_add(1);
+            if (sleepers.load() > 0){
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                cv.notify_one();
+            }
+        }
+
+        void wake_all(){
+            epoch.fetch_add(1);
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            cv.notify_all();
+        }
+
+        static void cpu_relax(){
+            #if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+            #endif
         }
 };
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,95 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+Image tiles + the order they are handed to the thread pool
+
+Tiles that follow each other in a space filling curve are neighbours on screen,
+so rays from consecutive tasks hit the same part of the scene (and the same tree nodes in cache)
+
+- Scanline : row by row (old behaviour, but with tiles instead of full rows)
+- Morton   : Z-order curve, cheap bit interleaving
+- Hilbert  : Hilbert curve, every step moves to an adjacent tile
+*/
+
+enum class TileOrder { Scanline, Morton, Hilbert };
+
+struct Tile {
+    int x0, y0; //top left pixel (inclusive)
+    int x1, y1; //bottom right pixel (exclusive)
+};
+
+//spread the lower 16 bits of x so there is a 0 bit between each of them
+inline uint32_t part1by1(uint32_t x){
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+inline uint32_t morton2D(uint32_t x, uint32_t y){
+    return (part1by1(y) << 1) | part1by1(x);
+}
+
+//distance of (x, y) along the hilbert curve filling an n x n grid (n a power of 2)
+inline uint32_t hilbert2D(uint32_t n, uint32_t x, uint32_t y){
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2){
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        //rotate the quadrant so the curve stays continuous
+        if (ry == 0){
+            if (rx == 1){
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+//split the image into tile_size x tile_size tiles (edge tiles are clipped) sorted by the given curve
+inline std::vector<Tile> make_tiles(int width, int height, int tile_size, TileOrder order){
+    int nx = (width + tile_size - 1) / tile_size;
+    int ny = (height + tile_size - 1) / tile_size;
+
+    uint32_t n = 1;
+    while (n < uint32_t(std::max(nx, ny))){
+        n *= 2;
+    }
+
+    std::vector<std::pair<uint32_t, Tile>> keyed;
+    keyed.reserve(nx * ny);
+    for (int ty = 0; ty < ny; ty++){
+        for (int tx = 0; tx < nx; tx++){
+            Tile tile{tx * tile_size, ty * tile_size, std::min((tx + 1) * tile_size, width), std::min((ty + 1) * tile_size, height)};
+            uint32_t key;
+            switch (order){
+                case TileOrder::Morton: key = morton2D(tx, ty); break;
+                case TileOrder::Hilbert: key = hilbert2D(n, tx, ty); break;
+                default: key = ty * nx + tx; break;
+            }
+            keyed.emplace_back(key, tile);
+        }
+    }
+
+    std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto& entry : keyed){
+        tiles.push_back(entry.second);
+    }
+    return tiles;
+}
+
+#endif
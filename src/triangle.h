@@ -5,8 +5,68 @@
 #include "helper.h"
 
 /*
-Triangle class 
+Ray-triangle intersection
 Method to compute barcyentric coordinates taken from Marschner textbook
+Free functions so triangles stored outside of the triangle class (e.g. the shared memory mesh) use the same test
+intersect_triangle only finds t (enough for occlusion), hit_triangle fills everything in the hit record except the material
+*/
+inline bool intersect_triangle(const point3& t1, const point3& t2, const point3& t3, const Ray& r, interval ray_t, double& t_hit){
+
+    //calculate barycentric coordinates and check conditions
+    auto a = t1.x - t2.x;
+    auto b = t1.y - t2.y;
+    auto c = t1.z - t2.z;
+    auto d = t1.x - t3.x;
+    auto e = t1.y - t3.y;
+    auto f = t1.z - t3.z;
+    auto g = r.direction().x;
+    auto h = r.direction().y;
+    auto i = r.direction().z;
+    auto j = t1.x - r.origin().x;
+    auto k = t1.y - r.origin().y;
+    auto l = t1.z - r.origin().z;
+
+    //precompute common terms
+    auto c1 = e*i - h*f;
+    auto c2 = g*f - d*i;
+    auto c3 = d*h - e*g;
+    auto c4 = a*k - j*b;
+    auto c5 = j*c - a*l;
+    auto c6 = b*l - k*c;
+
+    auto M = 1.0 / (a*c1 + b*c2 + c*c3);
+    
+    auto t = M * -(f*c4 + e*c5 + d*c6);
+
+    //only compute gamma and beta if the conditions are met
+    if(!ray_t.surrounds(t)){return false;}
+
+    auto gamma = M * (i*c4 + h*c5 + g*c6);
+    if(gamma < 0.0 || gamma > 1.0){return false;}
+
+    auto beta = M * (j*c1 + k*c2 + l*c3);
+    if(beta < 0.0 || beta > 1.0 - gamma){return false;}
+
+    t_hit = t;
+    return true;
+}
+
+inline bool hit_triangle(const point3& t1, const point3& t2, const point3& t3, const Ray& r, interval ray_t, hit_record& rec){
+    double t;
+    if (!intersect_triangle(t1, t2, t3, r, ray_t, t)){
+        return false;
+    }
+
+    //store hit record details
+    rec.t = t;
+    rec.p = r.eval(t);
+    vec3 normal = glm::normalize(glm::cross(t2-t1, t3-t1));
+    rec.set_face_normal(r, normal);
+    return true;
+}
+
+/*
+Triangle class 
 */
 class triangle: public hittable {
     public:
@@ -14,51 +74,19 @@ class triangle: public hittable {
         triangle(const point3& t1, const point3& t2, const point3& t3, shared_ptr<material> mat) : t1(t1), t2(t2), t3(t3), mat(mat) {}
 
         bool hit(const Ray& r, interval ray_t, hit_record& rec) const override {
-
-            //calculate barycentric coordinates and check conditions
-            auto a = t1.x - t2.x;
-            auto b = t1.y - t2.y;
-            auto c = t1.z - t2.z;
-            auto d = t1.x - t3.x;
-            auto e = t1.y - t3.y;
-            auto f = t1.z - t3.z;
-            auto g = r.direction().x;
-            auto h = r.direction().y;
-            auto i = r.direction().z;
-            auto j = t1.x - r.origin().x;
-            auto k = t1.y - r.origin().y;
-            auto l = t1.z - r.origin().z;
-
-            //precompute common terms
-            auto c1 = e*i - h*f;
-            auto c2 = g*f - d*i;
-            auto c3 = d*h - e*g;
-            auto c4 = a*k - j*b;
-            auto c5 = j*c - a*l;
-            auto c6 = b*l - k*c;
-
-            auto M = 1.0 / (a*c1 + b*c2 + c*c3);
-            
-            auto t = M * -(f*c4 + e*c5 + d*c6);
-
-            //only compute gamma and beta if the conditions are met
-            if(!ray_t.surrounds(t)){return false;}
-
-            auto gamma = M * (i*c4 + h*c5 + g*c6);
-            if(gamma < 0.0 || gamma > 1.0){return false;}
-
-            auto beta = M * (j*c1 + k*c2 + l*c3);
-            if(beta < 0.0 || beta > 1.0 - gamma){return false;}
-
-            //store hit record details
-            rec.t = t;
-            rec.p = r.eval(t);
-            vec3 normal = glm::normalize(glm::cross(t2-t1, t3-t1));
-            rec.set_face_normal(r, normal);
+            if (!hit_triangle(t1, t2, t3, r, ray_t, rec)){
+                return false;
+            }
             rec.mat = mat;
+            rec.object = this;
             return true;
         }
 
+        bool occluded(const Ray& r, interval ray_t) const override {
+            double t;
+            return intersect_triangle(t1, t2, t3, r, ray_t, t);
+        }
+
         Bounds3f BoundingBox() const override {
             double minX = std::min({t1.x, t2.x, t3.x});
             double minY = std::min({t1.y, t2.y, t3.y});
@@ -71,12 +99,57 @@ class triangle: public hittable {
             return Bounds3f(point3(minX, minY, minZ), point3(maxX, maxY, maxZ)); 
         }
 
+        //uniform point on the triangle
+        bool sample_surface(const point3& ref, glm::dvec2 u, surface_sample& sample) const override {
+            sample_point(u, sample.p, sample.normal);
+            sample.pdf = area_pdf(ref, sample.p, sample.normal);
+            sample.mat = mat.get();
+            return sample.pdf > 0;
+        }
+
+        //square root warp of u to barycentric coordinates
+        bool sample_point(glm::dvec2 u, point3& p, vec3& normal) const override {
+            double su = std::sqrt(u.x);
+            double b0 = 1.0 - su;
+            double b1 = u.y * su;
+            p = b0 * t1 + b1 * t2 + (1.0 - b0 - b1) * t3;
+            normal = glm::normalize(glm::cross(t2 - t1, t3 - t1));
+            return true;
+        }
+
+        double surface_pdf(const point3& ref, const hit_record& rec) const override {
+            return area_pdf(ref, rec.p, rec.normal);
+        }
+
+        bool describe_emitter(emitter_shape& shape) const override {
+            vec3 n = glm::cross(t2 - t1, t3 - t1);
+            shape.area = 0.5 * glm::length(n);
+            shape.axis = shape.area > 0 ? n / (2.0 * shape.area) : vec3(0, 0, 1);
+            shape.cos_theta_o = 1;
+            shape.two_sided = true;
+            shape.mat = mat.get();
+            return true;
+        }
+
+        //getters for the vertices
+        const point3& v0() const { return t1; }
+        const point3& v1() const { return t2; }
+        const point3& v2() const { return t3; }
 
     private:
         point3 t1;
         point3 t2;
         point3 t3;
         shared_ptr<material> mat;
+
+        //uniform area density converted to solid angle
+        double area_pdf(const point3& ref, const point3& p, const vec3& normal) const {
+            vec3 to_p = p - ref;
+            double d2 = glm::dot(to_p, to_p);
+            double area = 0.5 * glm::length(glm::cross(t2 - t1, t3 - t1));
+            double cosine = std::fabs(glm::dot(normal, to_p)) / std::sqrt(d2);
+            return cosine > 0 && area > 0 ? d2 / (cosine * area) : 0;
+        }
 };
 
 
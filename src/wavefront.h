@@ -0,0 +1,476 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "helper.h"
+#include "hittable.h"
+#include "material.h"
+#include "threadpool.h"
+#include "numa.h"
+#include "framebuffer.h"
+#include "perf_counters.h"
+#include "path_tracer.h"
+#include <vector>
+
+/*
+Wavefront path state
+
+The wavefront integrator (WavefrontIntegrator, rendering for Camera) does not follow one path at a time through
+traversal -> scatter -> recursion. It keeps a whole batch of paths and runs one stage at a time over all of them:
+
+    generate  : camera rays for every (pixel, sample) of the batch
+    extend    : closest hit of every live ray
+    shade     : paths grouped by material, scatter every hit (or finish the path on a miss / non scattering hit)
+                and queue a shadow ray to a point on a light for every diffuse hit
+    connect   : trace the shadow rays (any hit), the unblocked ones add their light to their sample
+    (repeat extend + shade + connect with the scattered rays until no path is left or max_depth is reached)
+    sort      : optional, before each bounce: order the rays by direction octant + Morton code of the origin
+                so consecutive rays (and the rays of one worker) walk the same part of the tree
+    resolve   : average the samples of every pixel
+
+Each stage is a flat loop over structure-of-arrays queues split over the thread pool,
+so every stage touches memory linearly and only runs one kind of work (traversal or one material)
+
+PathQueue : live rays + what a path carries between stages (throughput, sampler dimension, which sample it belongs to,
+            density and surface normal of the bounce that produced the ray for weighting lights it hits)
+            shadow rays use one too, with the light they carry as throughput
+HitQueue  : result of extend for each entry of a PathQueue
+
+WavefrontIntegrator : the stages above over the whole image, shading with the camera's PathTracer,
+                      in waves of whole pixels (all their samples) of at most batch paths
+*/
+
+struct PathQueue {
+    std::vector<double> ox, oy, oz;     //ray origin
+    std::vector<double> dx, dy, dz;     //ray direction
+    std::vector<double> tr, tg, tb;     //throughput
+    std::vector<uint32_t> slot;         //sample of the batch this path belongs to
+    std::vector<uint32_t> dimension;    //sampler dimension to continue from
+    std::vector<double> pdf;            //density scatter chose the direction with (0 = camera ray or mirror)
+    std::vector<double> nx, ny, nz;     //normal of the surface the ray leaves
+
+    size_t size() const { return slot.size(); }
+
+    void resize(size_t n){
+        for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &pdf, &nx, &ny, &nz}){
+            v->resize(n);
+        }
+        slot.resize(n);
+        dimension.resize(n);
+    }
+
+    Ray ray(size_t k) const {
+        return Ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]));
+    }
+
+    colour throughput(size_t k) const {
+        return colour(tr[k], tg[k], tb[k]);
+    }
+
+    vec3 normal(size_t k) const {
+        return vec3(nx[k], ny[k], nz[k]);
+    }
+
+    void set(size_t k, const Ray& r, const colour& throughput, uint32_t path_slot, uint32_t path_dimension, double path_pdf, const vec3& normal){
+        ox[k] = r.origin().x; oy[k] = r.origin().y; oz[k] = r.origin().z;
+        dx[k] = r.direction().x; dy[k] = r.direction().y; dz[k] = r.direction().z;
+        tr[k] = throughput.x; tg[k] = throughput.y; tb[k] = throughput.z;
+        slot[k] = path_slot;
+        dimension[k] = path_dimension;
+        pdf[k] = path_pdf;
+        nx[k] = normal.x; ny[k] = normal.y; nz[k] = normal.z;
+    }
+};
+
+struct HitQueue {
+    std::vector<double> px, py, pz;     //hit point
+    std::vector<double> nx, ny, nz;     //shading normal (facing the ray)
+    std::vector<char> front_face;
+    std::vector<const material*> mat;   //nullptr = the ray escaped
+    std::vector<const hittable*> object;
+
+    void resize(size_t n){
+        for (auto* v : {&px, &py, &pz, &nx, &ny, &nz}){
+            v->resize(n);
+        }
+        front_face.resize(n);
+        mat.resize(n);
+        object.resize(n);
+    }
+
+    void set(size_t k, const hit_record& rec){
+        px[k] = rec.p.x; py[k] = rec.p.y; pz[k] = rec.p.z;
+        nx[k] = rec.normal.x; ny[k] = rec.normal.y; nz[k] = rec.normal.z;
+        front_face[k] = rec.front_face;
+        mat[k] = rec.mat.get();
+        object[k] = rec.object;
+    }
+
+    //hit_record for material::scatter (the shared material pointer itself is not needed there)
+    hit_record record(size_t k) const {
+        hit_record rec;
+        rec.p = point3(px[k], py[k], pz[k]);
+        rec.normal = vec3(nx[k], ny[k], nz[k]);
+        rec.object = object[k];
+        rec.front_face = front_face[k];
+        return rec;
+    }
+};
+
+//indices of the queue sorted by material (misses first), so shading runs one material's code over a contiguous run
+//counting sort over the handful of distinct materials, order inside a material is kept
+inline void group_by_material(const HitQueue& hits, size_t count, std::vector<uint32_t>& order){
+    std::vector<const material*> materials;
+    std::vector<uint32_t> bucket(count);
+    for (size_t k = 0; k < count; k++){
+        auto found = std::find(materials.begin(), materials.end(), hits.mat[k]);
+        bucket[k] = uint32_t(found - materials.begin());
+        if (found == materials.end()){
+            materials.push_back(hits.mat[k]);
+        }
+    }
+
+    std::vector<uint32_t> start(materials.size() + 1, 0);
+    for (size_t k = 0; k < count; k++){
+        start[bucket[k] + 1]++;
+    }
+    for (size_t m = 0; m < materials.size(); m++){
+        start[m + 1] += start[m];
+    }
+    order.resize(count);
+    for (size_t k = 0; k < count; k++){
+        order[start[bucket[k]]++] = uint32_t(k);
+    }
+}
+
+//spread the lower 10 bits of x so there are two 0 bits between each of them
+inline uint32_t part1by2(uint32_t x){
+    x &= 0x000003ff;
+    x = (x | (x << 16)) & 0xff0000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+inline uint32_t morton3D(uint32_t x, uint32_t y, uint32_t z){
+    return (part1by2(z) << 2) | (part1by2(y) << 1) | part1by2(x);
+}
+
+//direction octant in the top bits, origin quantised to 1024^3 cells of the scene bounds below
+inline uint32_t ray_sort_key(const PathQueue& paths, size_t k, const Bounds& scene){
+    uint32_t octant = (paths.dx[k] < 0) | (paths.dy[k] < 0) << 1 | (paths.dz[k] < 0) << 2;
+    auto cell = [](double v, double lo, double hi){
+        double f = hi > lo ? (v - lo) / (hi - lo) : 0.0;
+        return uint32_t(std::clamp(f, 0.0, 1.0) * 1023.0);
+    };
+    uint32_t code = morton3D(cell(paths.ox[k], scene.min.x, scene.max.x),
+                             cell(paths.oy[k], scene.min.y, scene.max.y),
+                             cell(paths.oz[k], scene.min.z, scene.max.z));
+    return octant << 29 | code >> 1;
+}
+
+//reorder paths by ray_sort_key (scratch receives the sorted queue and is swapped in)
+//stable LSD radix sort on the 32 bit keys, so the order (and the image) does not depend on the thread count
+inline void sort_ray_queue(PathQueue& paths, PathQueue& scratch, const Bounds& scene, ThreadPool& pool,
+                      std::vector<uint64_t>& keys, std::vector<uint64_t>& scratch_keys){
+    const int64_t n = paths.size();
+    keys.resize(n);
+    scratch_keys.resize(n);
+    pool.parallel_for(0, n, 4096, [&](int64_t lo, int64_t hi){
+        for (int64_t k = lo; k < hi; k++){
+            keys[k] = uint64_t(ray_sort_key(paths, k, scene)) << 32 | uint64_t(k);
+        }
+    });
+
+    for (int shift = 32; shift < 64; shift += 8){
+        size_t count[257] = {0};
+        for (uint64_t key : keys){
+            count[((key >> shift) & 0xff) + 1]++;
+        }
+        for (int b = 0; b < 256; b++){
+            count[b + 1] += count[b];
+        }
+        for (uint64_t key : keys){
+            scratch_keys[count[(key >> shift) & 0xff]++] = key;
+        }
+        keys.swap(scratch_keys);
+    }
+
+    scratch.resize(n);
+    pool.parallel_for(0, n, 4096, [&](int64_t lo, int64_t hi){
+        for (int64_t k = lo; k < hi; k++){
+            size_t from = size_t(keys[k] & 0xffffffff);
+            scratch.set(k, paths.ray(from), paths.throughput(from), paths.slot[from], paths.dimension[from], paths.pdf[from], paths.normal(from));
+        }
+    });
+    std::swap(paths, scratch);
+}
+
+class WavefrontIntegrator {
+    public:
+        WavefrontIntegrator(const PathTracer& tracer, int samples_per_pixel, int batch, bool sort_rays, int packet_size)
+            : tracer(tracer), samples_per_pixel(samples_per_pixel), batch(batch), sort_rays(sort_rays), packet_size(packet_size) {}
+
+        //the image in waves of whole pixels (all their samples), every wave runs the stages to completion
+        //each stage is a parallel_for over the queues, paths keep their sampler dimension so the image matches the recursive one
+        //camera_ray(i, j, sampler) = the camera ray of a pixel sample, row_done(j) once row j of the image is final
+        template <class CameraRay, class RowDone>
+        void render(const NumaReplicated<hittable_list>& worlds, Framebuffer& image, CameraRay camera_ray, RowDone row_done) const {
+            ThreadPool& pool = ThreadPool::global();
+            const int image_width = image.width, image_height = image.height, max_depth = tracer.max_depth;
+            const uint64_t seed = tracer.seed;
+            const SamplerType sampler_type = tracer.sampler_type;
+            const double sample_scale = 1.0 / samples_per_pixel;
+            const int64_t pixels = int64_t(image_width) * image_height;
+            const int64_t wave_pixels = std::max<int64_t>(1, batch / samples_per_pixel);
+            const int64_t grain = 1024;
+
+            PathQueue paths, next, shadows;
+            HitQueue hits;
+            std::vector<colour> radiance;
+            std::vector<uint32_t> order;
+            std::vector<char> alive, connect;
+            std::vector<interval> shadow_range;
+            std::vector<size_t> chunk_offsets;
+            std::vector<uint64_t> keys, scratch_keys;
+            ExtendStats extend_stats;
+            int next_row = 0;
+            const Bounds scene = sort_rays ? worlds.local().BoundingBox() : Bounds(point3(0), point3(0));
+
+            for (int64_t first = 0; first < pixels; first += wave_pixels){
+                const int64_t wave_end = std::min(first + wave_pixels, pixels);
+                const int64_t n = (wave_end - first) * samples_per_pixel;
+
+                //sample slot -> pixel (i, j) and sample index s
+                auto locate = [&](uint32_t slot, int& i, int& j, int& s){
+                    int64_t pixel = first + slot / samples_per_pixel;
+                    s = int(slot % samples_per_pixel);
+                    i = int(pixel % image_width);
+                    j = int(pixel / image_width);
+                };
+
+                //generate
+                paths.resize(n);
+                radiance.assign(n, colour(0, 0, 0));
+                pool.parallel_for(0, n, grain, [&](int64_t lo, int64_t hi){
+                    auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+                    for (int64_t k = lo; k < hi; k++){
+                        int i, j, s;
+                        locate(uint32_t(k), i, j, s);
+                        seed_sample(seed, i, j, s);
+                        sampler->start_pixel_sample(i, j, s);
+                        Ray r = camera_ray(i, j, *sampler);
+                        paths.set(k, r, colour(1, 1, 1), uint32_t(k), sampler->current_dimension(), 0, vec3(0, 0, 0));
+                    }
+                });
+
+                for (int depth = max_depth; depth > 0 && paths.size() > 0; depth--){
+                    const int64_t live = paths.size();
+
+                    //extend
+                    hits.resize(live);
+                    pool.parallel_for(0, live, grain, [&](int64_t lo, int64_t hi){
+                        const hittable_list& world = worlds.local();
+                        PerfCounters& counters = PerfCounters::thread_counters();
+                        auto start = steady_clock::now();
+                        PerfCounters::Values before = counters.read();
+                        if (packet_size > 1){
+                            extend_packets(world, paths, hits, lo, hi);
+                        } else {
+                            for (int64_t k = lo; k < hi; k++){
+                                hit_record rec;
+                                if (world.hit(paths.ray(k), interval(PathTracer::ray_epsilon, infinity), rec)){
+                                    hits.set(k, rec);
+                                } else {
+                                    hits.mat[k] = nullptr;
+                                }
+                            }
+                        }
+                        extend_stats.add(hi - lo, duration_cast<nanoseconds>(steady_clock::now() - start).count(), before, counters.read());
+                    });
+
+                    //shade, one material after the other
+                    group_by_material(hits, live, order);
+                    next.resize(live);
+                    alive.assign(live, 0);
+                    shadows.resize(live);
+                    shadow_range.resize(live);
+                    connect.assign(live, 0);
+                    pool.parallel_for(0, live, grain, [&](int64_t lo, int64_t hi){
+                        auto sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+                        for (int64_t m = lo; m < hi; m++){
+                            uint32_t k = order[m];
+                            uint32_t slot = paths.slot[k];
+                            const material* mat = hits.mat[k];
+                            if (mat == nullptr){
+                                radiance[slot] += paths.throughput(k) * (tracer.environment_weight(paths.ray(k), paths.pdf[k]) * tracer.background(paths.ray(k)));
+                                continue;
+                            }
+                            if (mat->emissive){
+                                radiance[slot] += paths.throughput(k) * (tracer.emission_weight(paths.ray(k), paths.normal(k), hits.record(k), paths.pdf[k]) * mat->emitted());
+                                continue;
+                            }
+                            if (mat->absorbs){
+                                radiance[slot] += paths.throughput(k) * PathTracer::surface_colour(hits.record(k));
+                                continue;
+                            }
+
+                            int i, j, s;
+                            locate(slot, i, j, s);
+                            sampler->start_pixel_sample(i, j, s);
+                            sampler->set_dimension(paths.dimension[k]);
+
+                            hit_record rec = hits.record(k);
+                            colour throughput = paths.throughput(k);
+                            if (tracer.caches(*mat, paths.pdf[k])){
+                                radiance[slot] += throughput * tracer.cached_radiance(rec, *mat, depth, worlds.local());
+                                continue;
+                            }
+                            if (depth > 1 && mat->diffuse && tracer.direct_lighting()){
+                                Ray shadow;
+                                colour contribution;
+                                if (tracer.sample_direct(rec, *mat, throughput, *sampler, shadow, shadow_range[k], contribution, !tracer.gathers(*mat))){
+                                    shadows.set(k, shadow, contribution, slot, 0, 0, rec.normal);
+                                    connect[k] = 1;
+                                }
+                            }
+                            if (tracer.gathers(*mat)){
+                                radiance[slot] += throughput * tracer.gather(rec, *mat);
+                                continue;
+                            }
+
+                            Ray scattered;
+                            colour attenuation;
+                            if (mat->scatter(paths.ray(k), rec, attenuation, scattered, *sampler)){
+                                throughput *= attenuation;
+                                double pdf = mat->diffuse ? mat->pdf(rec, scattered.direction()) : 0;
+                                if (depth > 1 && tracer.survives(throughput, max_depth - depth, *sampler)){
+                                    next.set(k, scattered, throughput, slot, sampler->current_dimension(), pdf, rec.normal);
+                                    alive[k] = 1;
+                                }
+                            } else {
+                                radiance[slot] += throughput * PathTracer::surface_colour(rec);
+                            }
+                        }
+                    });
+
+                    //connect, the light a shadow ray carries counts if nothing blocks it
+                    if (tracer.direct_lighting()){
+                        pool.parallel_for(0, live, grain, [&](int64_t lo, int64_t hi){
+                            const hittable_list& world = worlds.local();
+                            for (int64_t k = lo; k < hi; k++){
+                                if (connect[k] && !world.occluded(shadows.ray(k), shadow_range[k])){
+                                    radiance[shadows.slot[k]] += shadows.throughput(k);
+                                }
+                            }
+                        });
+                    }
+
+                    //compact the scattered rays into the next queue (count per chunk, prefix sum, copy)
+                    const int64_t chunks = (live + grain - 1) / grain;
+                    chunk_offsets.assign(chunks + 1, 0);
+                    pool.parallel_for(0, chunks, 1, [&](int64_t lo, int64_t hi){
+                        for (int64_t c = lo; c < hi; c++){
+                            chunk_offsets[c + 1] = std::count(alive.begin() + c * grain, alive.begin() + std::min(live, (c + 1) * grain), 1);
+                        }
+                    });
+                    for (int64_t c = 0; c < chunks; c++){
+                        chunk_offsets[c + 1] += chunk_offsets[c];
+                    }
+                    paths.resize(chunk_offsets[chunks]);
+                    pool.parallel_for(0, chunks, 1, [&](int64_t lo, int64_t hi){
+                        for (int64_t c = lo; c < hi; c++){
+                            size_t out = chunk_offsets[c];
+                            for (int64_t k = c * grain; k < std::min(live, (c + 1) * grain); k++){
+                                if (alive[k]){
+                                    paths.set(out++, next.ray(k), next.throughput(k), next.slot[k], next.dimension[k], next.pdf[k], next.normal(k));
+                                }
+                            }
+                        }
+                    });
+
+                    if (sort_rays && depth > 1){
+                        sort_ray_queue(paths, next, scene, pool, keys, scratch_keys);
+                    }
+                }
+                //paths still alive after max_depth bounces contribute nothing (same as the recursive integrator)
+
+                //resolve, samples summed in order like Camera::render_pixel
+                pool.parallel_for(first, wave_end, grain, [&](int64_t lo, int64_t hi){
+                    for (int64_t pixel = lo; pixel < hi; pixel++){
+                        colour pixel_colour(0, 0, 0);
+                        for (int s = 0; s < samples_per_pixel; s++){
+                            pixel_colour += radiance[(pixel - first) * samples_per_pixel + s];
+                        }
+                        image(int(pixel % image_width), int(pixel / image_width)) = sample_scale * pixel_colour;
+                    }
+                });
+
+                while (next_row < image_height && int64_t(next_row + 1) * image_width <= wave_end){
+                    row_done(next_row++);
+                }
+            }
+            extend_stats.report();
+            tracer.report_irradiance_cache();
+        }
+
+    private:
+        const PathTracer& tracer;
+        int samples_per_pixel;
+        int batch;
+        bool sort_rays;
+        int packet_size;
+
+        //cost of the extend stage (closest hit queries), summed over workers
+        struct ExtendStats {
+            std::atomic<uint64_t> rays{0};
+            std::atomic<uint64_t> busy_ns{0};
+            std::atomic<uint64_t> counters[PerfCounters::count] = {};
+
+            void add(int64_t count, int64_t ns, const PerfCounters::Values& before, const PerfCounters::Values& after){
+                rays.fetch_add(count, std::memory_order_relaxed);
+                busy_ns.fetch_add(ns, std::memory_order_relaxed);
+                for (int c = 0; c < PerfCounters::count; c++){
+                    counters[c].fetch_add(after[c] - before[c], std::memory_order_relaxed);
+                }
+            }
+
+            void report() const {
+                double n = std::max<uint64_t>(1, rays.load());
+                std::clog << "Extend: " << rays.load() / 1e6 << " Mrays, " << busy_ns.load() / n << " ns per ray";
+                if (!PerfCounters::thread_counters().available()){
+                    std::clog << " (hardware counters unavailable)\n";
+                    return;
+                }
+                double cycles = counters[PerfCounters::Cycles].load();
+                std::clog << ", " << cycles / n << " cycles per ray, "
+                          << 100.0 * counters[PerfCounters::StalledBackend].load() / std::max(1.0, cycles) << "% backend stalled, "
+                          << counters[PerfCounters::CacheMisses].load() / n << " LLC misses per ray\n";
+            }
+        };
+
+        //closest hits of paths [lo, hi) in groups of packet_size rays (world.hit_packet)
+        void extend_packets(const hittable_list& world, const PathQueue& paths, HitQueue& hits, int64_t lo, int64_t hi) const {
+            int size = std::min(packet_size, RayPacket::max_size);
+            RayPacket packet;
+            hit_record recs[RayPacket::max_size];
+            double closest[RayPacket::max_size];
+            for (int64_t k0 = lo; k0 < hi; k0 += size){
+                packet.size = int(std::min<int64_t>(size, hi - k0));
+                for (int lane = 0; lane < packet.size; lane++){
+                    packet.set(lane, paths.ray(k0 + lane));
+                    closest[lane] = infinity;
+                }
+                uint32_t hit = world.hit_packet(packet, packet.full_mask(), PathTracer::ray_epsilon, closest, recs);
+                for (int lane = 0; lane < packet.size; lane++){
+                    if (hit >> lane & 1){
+                        hits.set(k0 + lane, recs[lane]);
+                    } else {
+                        hits.mat[k0 + lane] = nullptr;
+                    }
+                }
+            }
+        }
+};
+
+#endif